@@ -1,25 +1,39 @@
 #include "IBLT_helpers.hpp"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
 size_t load_buffer_with_file(const std::string& filename, std::vector<char>& buffer) {
 	size_t size = get_file_size(filename);
 
 	FILE* fp = fopen(filename.c_str(), "r");
 	if( !fp ) {
-		std::cerr << "Unable to open file " << filename << std::endl;
-		exit(1);
+		throw std::runtime_error("Unable to open file " + filename);
 	}
 	buffer.resize(size);
-	fread(buffer.data(), 1, size, fp);
+	size_t num_read = fread(buffer.data(), 1, size, fp);
 	fclose(fp);
+	if( num_read != size ) {
+		throw std::runtime_error("Unable to read file " + filename);
+	}
 	return size;
 }
 
+std::string read_contents(const std::string& filename) {
+	MappedFile mf(filename);
+	return std::string(mf.data ? mf.data : "", mf.size);
+}
+
+// stat rather than ftell, whose long offsets do not reach past 2GB everywhere
 size_t get_file_size(const std::string& filename) {
-	FILE* fp1 = fopen(filename.c_str(), "r");
-	fseek(fp1, 0, SEEK_END);
-	size_t file_size = ftell(fp1);
-	fclose(fp1);
-	return file_size;
+	struct stat st;
+	if( stat(filename.c_str(), &st) != 0 ) {
+		throw std::runtime_error("Unable to open file " + filename);
+	}
+	return st.st_size;
 }
 
 std::string get_SHAHash(const std::string& filename) {
@@ -28,6 +42,34 @@ std::string get_SHAHash(const std::string& filename) {
 	return HashUtil::SHA1Hash( buf.data(), buf.size());
 }
 
+MappedFile::MappedFile(const std::string& filename): data(NULL), size(0) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if( fd < 0 ) {
+		throw std::runtime_error("Unable to open file " + filename);
+	}
+	struct stat st;
+	if( fstat(fd, &st) != 0 ) {
+		close(fd);
+		throw std::runtime_error("Unable to open file " + filename);
+	}
+	size = st.st_size;
+	if( size > 0 ) {
+		void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if( addr == MAP_FAILED ) {
+			close(fd);
+			throw std::runtime_error("Unable to map file " + filename);
+		}
+		data = (const char*) addr;
+	}
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if( data ) {
+		munmap((void*) data, size);
+	}
+}
+
 // generate_random_file creates a file with len alphanumeric characters
 void generate_random_file(const std::string& filename, size_t len) {
 	FILE* fp = fopen(filename.c_str(), "w");
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <map>
 #include <random>
+#include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -49,12 +50,30 @@ void checkResults(std::unordered_map<key_type, std::vector<int> >& expected,
 	}
 }
 
+// the file readers below throw std::runtime_error if the file cannot be opened or read
 size_t load_buffer_with_file(const std::string& filename, std::vector<char>& buf);
 
+// read_contents returns the whole file as a string
+std::string read_contents(const std::string& filename);
+
 size_t get_file_size(const std::string& filename);
 
 std::string get_SHAHash(const std::string& filename);
 
+// MappedFile maps a whole file read-only for as long as it is alive
+class MappedFile {
+  public:
+	const char* data;
+	size_t size;
+
+	MappedFile(const std::string& filename);
+	~MappedFile();
+
+  private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
+
 // generate_random_file creates a file with len alphanumeric characters
 void generate_random_file(const std::string& filename, size_t len);
 
@@ -29,6 +29,14 @@ class StrataEstimator {
 			delete *it;
 	}
 
+	// empties every stratum
+	void clear() {
+		for(auto it = iblts.begin(); it != iblts.end(); ++it) {
+			delete *it;
+			*it = new iblt_type(num_buckets, num_hfs);
+		}
+	}
+
 	size_t size_in_bits() const {
 		return num_strata*iblts[0]->size_in_bits();
 	}
@@ -46,6 +54,28 @@ class StrataEstimator {
 	  	}
 	}
 
+	size_t snapshot_bytes() const {
+		size_t tot_bytes = 0;
+		for(size_t i = 0; i < num_strata; ++i) {
+			tot_bytes += iblts[i]->snapshot_bytes();
+		}
+		return tot_bytes;
+	}
+
+	char* write_snapshot(char* out) const {
+		for(size_t i = 0; i < num_strata; ++i) {
+			out = iblts[i]->write_snapshot(out);
+		}
+		return out;
+	}
+
+	const char* read_snapshot(const char* in) {
+		for(size_t i = 0; i < num_strata; ++i) {
+			in = iblts[i]->read_snapshot(in);
+		}
+		return in;
+	}
+
 	void add(StrataEstimator<hash_type, iblt_type>& cp) {
 		for(int i = num_strata - 1; i >= 0; --i) {
 			iblts[i]->add(*(cp.iblts[i]));
@@ -82,6 +112,12 @@ class StrataEstimator {
 		iblts[num_trailing_zeroes(hash)]->insert_key(hash);
 	}
 
+	// the strata are linear, so removing a key exactly undoes insert_key
+	void remove_key(const hash_type k) {
+		hash_type hash = HashUtil::MurmurHash64A ( &k, num_strata/8, 0 );
+		iblts[num_trailing_zeroes(hash)]->remove_key(hash);
+	}
+
 	static int num_trailing_zeroes(hash_type k) {
 		hash_type curr_mask = 1;
 		for(size_t i = 0; i < num_strata; ++i) {
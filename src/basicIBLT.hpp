@@ -6,6 +6,7 @@
 
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
 #include <functional>
 #include <unordered_set>
@@ -101,6 +102,7 @@ class basicIBLT {
   public:
   	typedef basicIBLT_bucket<key_type, hash_type> bucket_type;
   	typedef std::vector<bucket_type> IBLT_type;
+  	typedef hash_type key_hash_type;
   	size_t num_buckets;
 	size_t num_hashfns;
 	size_t buckets_per_subIBLT;
@@ -166,6 +168,29 @@ class basicIBLT {
 		}
 	}
 
+	//raw bucket image, used for on-disk snapshots that are mmapped back in
+	size_t snapshot_bytes() const {
+		return( num_buckets * sizeof(bucket_type) );
+	}
+
+	char* write_snapshot(char* out) const {
+		for(size_t i = 0; i < num_hashfns; ++i) {
+			size_t len = buckets_per_subIBLT * sizeof(bucket_type);
+			memcpy(out, subIBLTs[i].data(), len);
+			out += len;
+		}
+		return out;
+	}
+
+	const char* read_snapshot(const char* in) {
+		for(size_t i = 0; i < num_hashfns; ++i) {
+			size_t len = buckets_per_subIBLT * sizeof(bucket_type);
+			memcpy(subIBLTs[i].data(), in, len);
+			in += len;
+		}
+		return in;
+	}
+
 
 	void add(const basicIBLT<key_type, hash_type>& counterparty) {
 		assert( counterparty.buckets_per_subIBLT == buckets_per_subIBLT 
@@ -201,6 +226,22 @@ class basicIBLT {
 		}
 	}
 
+	// the hashes insert_key needs, which do not depend on the number of buckets, so they can be
+	// worked out before it is known: the key's hash, then one per subIBLT
+	void hash_key(key_type key, hash_type* hashes) {
+		hashes[0] = key_hasher.hash(key);
+		for(size_t i = 0; i < num_hashfns; ++i) {
+			hashes[i+1] = sub_hashers[i].hash(key);
+		}
+	}
+
+	// insert_key with the hashes from hash_key
+	void insert_hashed_key(key_type key, const hash_type* hashes) {
+		for(size_t i = 0; i < num_hashfns; ++i) {
+			subIBLTs[i][hashes[i+1] % buckets_per_subIBLT].add( key, hashes[0]);
+		}
+	}
+
 	void insert_keys(const std::unordered_set<key_type>& keys) {
 		for(auto it = keys.begin(); it!= keys.end(); ++it) {
 			insert_key(*it);
@@ -216,8 +257,9 @@ class basicIBLT {
 		}
 	}	
 
-	bool peel(std::unordered_set<key_type>& my_peeled_keys, 
-              std::unordered_set<key_type>& cp_peeled_keys ) {
+	// set_type is any set of keys with count and insert, e.g. std::unordered_set
+	template <typename set_type>
+	bool peel(set_type& my_peeled_keys, set_type& cp_peeled_keys ) {
 		std::deque<bucket_type> peelable_keys;
 		bucket_type curr_bucket;
 
@@ -229,13 +271,13 @@ class basicIBLT {
 				peelable_keys.pop_front();
 				key_type peeled_key = curr_bucket.key_sum;
 				if( curr_bucket.count == -1) { //counterparty's key
-					if( cp_peeled_keys.find(peeled_key) == cp_peeled_keys.end() ) {
+					if( !cp_peeled_keys.count(peeled_key) ) {
 						cp_peeled_keys.insert(peeled_key);
 						peel_key( curr_bucket, peelable_keys );
 					}
 				} else {
 					assert(curr_bucket.count == 1);
-					if( my_peeled_keys.find(peeled_key) == my_peeled_keys.end() ) {
+					if( !my_peeled_keys.count(peeled_key) ) {
 						my_peeled_keys.insert(peeled_key);
 						peel_key( curr_bucket, peelable_keys );
 					}
@@ -0,0 +1,194 @@
+#ifndef _BATCH_SYNC
+#define _BATCH_SYNC
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "chunk_io.hpp"
+#include "chunk_writer.hpp"
+#include "file_sync.hpp"
+#include "hash_util.hpp"
+#include "round2_codec.hpp"
+
+/** BatchFileSynchronizer synchronizes a batch of files, named relative to a root directory, in
+ ** a single run of the FileSynchronizer protocol. The files are concatenated and each is
+ ** chunked on its own, with a hash of its name mixed into its chunk keys, so one estimator and
+ ** one IBLT cover the whole batch while a chunk only ever matches the same chunk of the file
+ ** with the same name. The round 2 message starts with B's file names and sizes and holds a
+ ** single chunk encoding for all of B's files; the new chunks of all files are deflated
+ ** together, and the whole message is one zlib stream.
+ **
+ ** The batch is kept in memory, so it is meant for many small files rather than a few large
+ ** ones. receive_rd2_encoding writes B's files under an output directory; files only A has are
+ ** left out, and names that would leave the directory are refused. The constructor throws
+ ** std::runtime_error if a file cannot be read.
+ **/
+template <typename hash_type = uint64_t>
+class BatchFileSynchronizer {
+  public:
+	typedef FileSynchronizer<hash_type> fsync_type;
+	typedef typename fsync_type::Round2Info rd2_type;
+	typedef Round2Codec<rd2_type> codec_type;
+
+	std::string root;
+	std::vector<std::string> names; //relative to root
+	fsync_type* sync;
+
+	BatchFileSynchronizer(const std::string& root, const std::vector<std::string>& names,
+                          size_t avg_block_size): root(root), names(names) {
+		std::vector<char> contents;
+		std::vector<size_t> sizes;
+		std::vector<hash_type> ids;
+		for(auto it = names.begin(); it != names.end(); ++it) {
+			size_t old_size = contents.size();
+			read_file(root + "/" + *it, contents);
+			sizes.push_back(contents.size() - old_size);
+			ids.push_back(file_id(*it));
+		}
+		sync = new fsync_type(contents, sizes, ids, avg_block_size);
+	}
+
+	~BatchFileSynchronizer() {
+		delete sync;
+	}
+
+	static hash_type file_id(const std::string& name) {
+		return (hash_type) HashUtil::MurmurHash64A(name.data(), name.size(), 0);
+	}
+
+	// appends the contents of filename to buf
+	static void read_file(const std::string& filename, std::vector<char>& buf) {
+		int fd = open(filename.c_str(), O_RDONLY);
+		struct stat st;
+		if( fd < 0 || fstat(fd, &st) != 0 ) {
+			if( fd >= 0 ) {
+				close(fd);
+			}
+			throw std::runtime_error("Unable to open file " + filename);
+		}
+		size_t pos = buf.size();
+		buf.resize(pos + st.st_size);
+		bool res = ChunkIO::pread_all(fd, buf.data() + pos, st.st_size, 0);
+		close(fd);
+		if( !res ) {
+			throw std::runtime_error("Unable to read file " + filename);
+		}
+	}
+
+	// whether name stays under the directory it is taken relative to: not empty, not absolute
+	// and without a ".." component
+	static bool is_relative_name(const std::string& name) {
+		return !name.empty() && name[0] != '/' && name.find('\0') == std::string::npos
+               && ("/" + name + "/").find("/../") == std::string::npos;
+	}
+
+	std::string send_strata_encoding() {
+		return sync->send_strata_encoding();
+	}
+
+	size_t receive_strata_encoding(const std::string& strata_encoding) {
+		return sync->receive_strata_encoding(strata_encoding);
+	}
+
+	std::string send_IBLT_encoding(size_t diff_estimate) {
+		return sync->send_IBLT_encoding(diff_estimate);
+	}
+
+	size_t retry_estimate() const {
+		return sync->retry_estimate();
+	}
+
+	// party B: fills rd2_encoding with my file list and the chunk encoding of all my files, or
+	// returns false if A has to send an IBLT sized for retry_estimate() instead
+	bool receive_IBLT_encoding(const std::string& iblt_encoding, std::string& rd2_encoding) {
+		if( !sync->decode_IBLT(iblt_encoding) ) {
+			return false;
+		}
+		std::string encoding;
+		codec_type::put_varint(names.size(), encoding);
+		for(size_t i = 0; i < names.size(); ++i) {
+			codec_type::put_varint(names[i].size(), encoding);
+			encoding += names[i];
+			codec_type::put_varint(sync->segment_sizes[i], encoding);
+		}
+		encoding += codec_type::encode(sync->my_rd2);
+		rd2_encoding = compress_string(encoding);
+		return true;
+	}
+
+	// party A: rebuilds B's files under output_root
+	bool receive_rd2_encoding(const std::string& rd2_encoding, const std::string& output_root) {
+		std::string encoding = decompress_string(rd2_encoding);
+		size_t pos = 0;
+		size_t num_files = codec_type::get_varint(encoding, pos);
+		std::vector<std::string> cp_names;
+		sync->cp_segment_sizes.clear();
+		for(size_t i = 0; i < num_files; ++i) {
+			size_t name_len = codec_type::get_varint(encoding, pos);
+			codec_type::check_size(encoding, pos, name_len);
+			cp_names.push_back(encoding.substr(pos, name_len));
+			pos += name_len;
+			if( !is_relative_name(cp_names.back()) ) {
+				std::cerr << "Refusing to write " << cp_names.back() << " outside " << output_root << std::endl;
+				return false;
+			}
+			sync->cp_segment_sizes.push_back(codec_type::get_varint(encoding, pos));
+		}
+		rd2_type cp_rd2;
+		codec_type::decode(encoding.substr(pos), cp_rd2);
+
+		StringChunkWriter writer(sync->contents.data());
+		if( !sync->reconstruct(cp_rd2, sync->contents.data(), writer) ) {
+			return false;
+		}
+
+		size_t total_size = 0;
+		for(size_t i = 0; i < num_files; ++i) {
+			total_size += sync->cp_segment_sizes[i];
+		}
+		if( total_size != writer.contents.size() ) {
+			std::cerr << "Rebuilt batch does not match the counterparty's file sizes" << std::endl;
+			return false;
+		}
+		size_t file_pos = 0;
+		for(size_t i = 0; i < num_files; ++i) {
+			if( !write_file(output_root + "/" + cp_names[i], writer.contents.data() + file_pos,
+                            sync->cp_segment_sizes[i]) ) {
+				return false;
+			}
+			file_pos += sync->cp_segment_sizes[i];
+		}
+		return true;
+	}
+
+	static bool write_file(const std::string& filename, const char* data, size_t len) {
+		boost::system::error_code ec;
+		boost::filesystem::create_directories(boost::filesystem::path(filename).parent_path(), ec);
+		FILE* fp = fopen(filename.c_str(), "w");
+		if( !fp ) {
+			std::cerr << "Unable to open file " << filename << std::endl;
+			return false;
+		}
+		bool res = fwrite(data, 1, len, fp) == len;
+		res &= fclose(fp) == 0;
+		if( !res ) {
+			std::cerr << "Unable to write file " << filename << std::endl;
+		}
+		return res;
+	}
+
+  private:
+	BatchFileSynchronizer(const BatchFileSynchronizer&);
+	BatchFileSynchronizer& operator=(const BatchFileSynchronizer&);
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "batch_sync.hpp"
+
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "IBLT_helpers.hpp"
+
+typedef BatchFileSynchronizer<uint64_t> bsync_type;
+
+// B has every file of A, some of them changed, a few new ones and a few of A's missing;
+// files are from empty to a few blocks long
+void testBatch(size_t num_files, size_t avg_block_size) {
+	const std::string dir_A = "tmp/batch_A", dir_B = "tmp/batch_B", dir_out = "tmp/batch_out";
+	boost::filesystem::remove_all(dir_A);
+	boost::filesystem::remove_all(dir_B);
+	boost::filesystem::remove_all(dir_out);
+	boost::filesystem::create_directories(dir_A + "/sub");
+	boost::filesystem::create_directories(dir_B + "/sub");
+
+	keyGenerator<uint64_t> kg(6);
+	std::vector<std::string> names_A, names_B;
+	size_t num_changed = 0;
+	for(size_t i = 0; i < num_files; ++i) {
+		std::string name = (i % 3 == 0 ? "sub/f" : "f") + std::to_string(i);
+		size_t len = i < 4 ? i : kg.generate_key() % (4*avg_block_size);
+		size_t kind = kg.generate_key() % 100;
+		if( kind < 97 ) {
+			generate_random_file(dir_A + "/" + name, len);
+			names_A.push_back(name);
+		}
+		if( kind < 2 ) {
+			continue; //only A has it
+		}
+		if( kind >= 97 ) {
+			generate_random_file(dir_B + "/" + name, len); //only B has it
+		} else if( kind < 10 && len > 0 ) {
+			generate_block_changed_file(dir_A + "/" + name, dir_B + "/" + name, 1, 5);
+			++num_changed;
+		} else {
+			boost::filesystem::copy_file(dir_A + "/" + name, dir_B + "/" + name);
+		}
+		names_B.push_back(name);
+	}
+
+	bsync_type batch_A(dir_A, names_A, avg_block_size), batch_B(dir_B, names_B, avg_block_size);
+	std::string strata_encoding = batch_A.send_strata_encoding();
+	size_t iblt_estimate = batch_B.receive_strata_encoding(strata_encoding);
+	size_t total_bytes = strata_encoding.size();
+	std::string rd2_encoding;
+	size_t retries = 0;
+	while( true ) {
+		std::string iblt_encoding = batch_A.send_IBLT_encoding(iblt_estimate);
+		total_bytes += iblt_encoding.size();
+		if( batch_B.receive_IBLT_encoding(iblt_encoding, rd2_encoding) ) {
+			break;
+		}
+		++retries;
+		assert( retries < 8 );
+		iblt_estimate = batch_B.retry_estimate();
+	}
+	total_bytes += rd2_encoding.size();
+	bool written = batch_A.receive_rd2_encoding(rd2_encoding, dir_out);
+	assert( written );
+	(void) written;
+
+	for(auto it = names_B.begin(); it != names_B.end(); ++it) {
+		assert( read_contents(dir_out + "/" + *it) == read_contents(dir_B + "/" + *it) );
+	}
+	//files only A has are not written
+	size_t num_written = 0;
+	for(boost::filesystem::recursive_directory_iterator it(dir_out), end; it != end; ++it) {
+		num_written += boost::filesystem::is_regular_file(it->path());
+	}
+	assert( num_written == names_B.size() );
+	std::cout << "Batch of " << num_files << " files with " << num_changed << " changed synchronized in "
+              << total_bytes << " bytes (" << strata_encoding.size() << " of them strata) and "
+              << retries << " retries" << std::endl;
+}
+
+// B's file names come from the peer, so names that would leave A's output directory are
+// refused rather than written, and a file that cannot be read is reported rather than fatal
+void testHostileNames(size_t avg_block_size) {
+	const std::string dir_B = "tmp/batch_hostile/B/sub", dir_out = "tmp/batch_hostile/out";
+	boost::filesystem::remove_all("tmp/batch_hostile");
+	boost::filesystem::create_directories(dir_B + "/sub");
+	generate_random_file(dir_B + "/a", 1000);
+	generate_random_file("tmp/batch_hostile/B/escaped", 1000);
+	std::string absolute = boost::filesystem::absolute("tmp/batch_hostile/absolute").string();
+	generate_random_file(absolute, 1000);
+	std::string names[] = {"../escaped", "sub/../../escaped", absolute};
+	for(size_t i = 0; i < sizeof(names)/sizeof(names[0]); ++i) {
+		bsync_type batch_A(dir_B, std::vector<std::string>(1, "a"), avg_block_size);
+		bsync_type batch_B(i < 2 ? dir_B : "", std::vector<std::string>(1, names[i]), avg_block_size);
+		batch_B.receive_strata_encoding(batch_A.send_strata_encoding());
+		std::string rd2_encoding;
+		bool peeled = batch_B.receive_IBLT_encoding(batch_A.send_IBLT_encoding(100), rd2_encoding);
+		assert( peeled );
+		(void) peeled;
+		boost::filesystem::remove(absolute);
+		bool written = batch_A.receive_rd2_encoding(rd2_encoding, dir_out);
+		assert( !written );
+		(void) written;
+		assert( !boost::filesystem::exists("tmp/batch_hostile/escaped") && !boost::filesystem::exists(absolute) );
+		generate_random_file(absolute, 1000);
+	}
+	bool thrown = false;
+	try {
+		bsync_type missing(dir_B, std::vector<std::string>(1, "missing"), avg_block_size);
+	} catch( std::runtime_error& e ) {
+		thrown = true;
+	}
+	assert( thrown );
+	(void) thrown;
+	std::cout << "Hostile file names refused" << std::endl;
+}
+
+int main() {
+	testBatch(1000, 200);
+	testBatch(300, 16);
+	testHostileNames(200);
+	return 1;
+}
@@ -0,0 +1,381 @@
+#ifndef _CHUNK_IO
+#define _CHUNK_IO
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+/** ChunkIO reads and writes chunk ranges at given positions. Built with USE_IO_URING, requests
+ ** go to an io_uring and up to queue_depth of them are in flight at once; otherwise, or if the
+ ** kernel refuses to set up the ring, each request is done right away with pread/pwrite. If the
+ ** ring fails later, what is in flight is waited for and marked failed, and pread/pwrite take over.
+ ** Buffers passed in have to stay valid until wait() returns. Short transfers are continued
+ ** until the whole range is done.
+ **/
+class ChunkIO {
+  public:
+	static const size_t default_queue_depth = 32;
+
+	size_t queue_depth;
+	bool failed;
+
+	ChunkIO(size_t queue_depth = default_queue_depth): queue_depth(queue_depth), failed(false) {
+#ifdef USE_IO_URING
+		ring_fd = -1;
+		setup_ring();
+#endif
+	}
+
+	~ChunkIO() {
+#ifdef USE_IO_URING
+		if( ring_fd >= 0 ) {
+			wait();
+			close_ring();
+		}
+#endif
+	}
+
+	// whether requests complete asynchronously
+	bool async() const {
+#ifdef USE_IO_URING
+		return ring_fd >= 0;
+#else
+		return false;
+#endif
+	}
+
+	void read(int fd, char* data, size_t len, size_t pos) {
+		if( len == 0 ) {
+			return;
+		}
+#ifdef USE_IO_URING
+		if( ring_fd >= 0 ) {
+			queue(fd, false, data, len, pos);
+			return;
+		}
+#endif
+		failed |= !pread_all(fd, data, len, pos);
+	}
+
+	void write(int fd, const char* data, size_t len, size_t pos) {
+		if( len == 0 ) {
+			return;
+		}
+#ifdef USE_IO_URING
+		if( ring_fd >= 0 ) {
+			queue(fd, true, (char*) data, len, pos);
+			return;
+		}
+#endif
+		failed |= !pwrite_all(fd, data, len, pos);
+	}
+
+	// waits for all requests; returns false if any of them failed
+	bool wait() {
+#ifdef USE_IO_URING
+		while( ring_fd >= 0 && num_in_flight > 0 ) {
+			submit_and_reap(1);
+		}
+#endif
+		bool res = !failed;
+		failed = false;
+		return res;
+	}
+
+	static bool pread_all(int fd, char* data, size_t len, size_t pos) {
+		while( len > 0 ) {
+			ssize_t res = pread(fd, data, len, pos);
+			if( res < 0 && errno == EINTR ) {
+				continue;
+			}
+			if( res <= 0 ) {
+				return false;
+			}
+			data += res;
+			len -= res;
+			pos += res;
+		}
+		return true;
+	}
+
+	static bool pwrite_all(int fd, const char* data, size_t len, size_t pos) {
+		while( len > 0 ) {
+			ssize_t res = pwrite(fd, data, len, pos);
+			if( res < 0 && errno == EINTR ) {
+				continue;
+			}
+			if( res < 0 ) {
+				return false;
+			}
+			data += res;
+			len -= res;
+			pos += res;
+		}
+		return true;
+	}
+
+#ifdef USE_IO_URING
+  private:
+	struct Request {
+		int fd;
+		bool is_write;
+		struct iovec iov; //what is left to transfer
+		size_t pos;
+	};
+
+	int ring_fd;
+	void* sq_ptr;
+	void* cq_ptr;
+	size_t sq_ring_size, cq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	size_t num_sqes;
+	std::vector<Request> requests; //one slot per request in flight
+	std::vector<size_t> free_slots;
+	size_t num_in_flight, num_unsubmitted;
+	bool ring_failed; //waiting for what is in flight before the ring is closed
+
+	void setup_ring() {
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		if( queue_depth == 0 ) {
+			queue_depth = 1;
+		}
+		ring_fd = syscall(__NR_io_uring_setup, (unsigned) queue_depth, &params);
+		if( ring_fd < 0 ) {
+			return;
+		}
+		sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+		bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if( single_mmap && cq_ring_size > sq_ring_size ) {
+			sq_ring_size = cq_ring_size;
+		}
+		sq_ptr = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+		cq_ptr = single_mmap ? sq_ptr : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		num_sqes = params.sq_entries;
+		sqes = (struct io_uring_sqe*) mmap(NULL, num_sqes*sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if( sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED ) {
+			//fall back to pread/pwrite, not worth more than that
+			close(ring_fd);
+			ring_fd = -1;
+			return;
+		}
+		char* sq = (char*) sq_ptr;
+		sq_head = (unsigned*) (sq + params.sq_off.head);
+		sq_tail = (unsigned*) (sq + params.sq_off.tail);
+		sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+		sq_array = (unsigned*) (sq + params.sq_off.array);
+		char* cq = (char*) cq_ptr;
+		cq_head = (unsigned*) (cq + params.cq_off.head);
+		cq_tail = (unsigned*) (cq + params.cq_off.tail);
+		cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+		//never more requests in flight than the submission queue holds
+		queue_depth = std::min(queue_depth, num_sqes);
+		requests.resize(queue_depth);
+		for(size_t i = queue_depth; i-- > 0; ) {
+			free_slots.push_back(i);
+		}
+		num_in_flight = 0;
+		num_unsubmitted = 0;
+		ring_failed = false;
+	}
+
+	void queue(int fd, bool is_write, char* data, size_t len, size_t pos) {
+		while( ring_fd >= 0 && free_slots.empty() ) {
+			submit_and_reap(1);
+		}
+		if( ring_fd < 0 ) {
+			failed |= !(is_write ? pwrite_all(fd, data, len, pos) : pread_all(fd, data, len, pos));
+			return;
+		}
+		size_t slot = free_slots.back();
+		free_slots.pop_back();
+		Request& req = requests[slot];
+		req.fd = fd;
+		req.is_write = is_write;
+		req.iov.iov_base = data;
+		req.iov.iov_len = len;
+		req.pos = pos;
+		++num_in_flight;
+		push_sqe(slot);
+	}
+
+	void push_sqe(size_t slot) {
+		const Request& req = requests[slot];
+		unsigned tail = *sq_tail;
+		unsigned index = tail & *sq_mask;
+		struct io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = req.is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = req.fd;
+		sqe->addr = (unsigned long) &req.iov;
+		sqe->len = 1;
+		sqe->off = req.pos;
+		sqe->user_data = slot;
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++num_unsubmitted;
+	}
+
+	void close_ring() {
+		munmap(sqes, num_sqes*sizeof(struct io_uring_sqe));
+		if( cq_ptr != sq_ptr ) {
+			munmap(cq_ptr, cq_ring_size);
+		}
+		munmap(sq_ptr, sq_ring_size);
+		close(ring_fd);
+		ring_fd = -1;
+	}
+
+	// submits what is queued, waits for min_complete completions and handles all that arrived
+	void submit_and_reap(unsigned min_complete) {
+		int res = syscall(__NR_io_uring_enter, ring_fd, (unsigned) num_unsubmitted, min_complete,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+		if( res < 0 ) {
+			if( errno != EINTR && errno != EAGAIN && errno != EBUSY ) {
+				drop_ring();
+			}
+			return;
+		}
+		num_unsubmitted -= std::min((size_t) res, num_unsubmitted);
+		reap();
+	}
+
+	// the ring is unusable: takes back the requests the kernel has not seen, and waits for the
+	// ones it has, which may still be transferring into their buffers, before going back to
+	// pread/pwrite
+	void drop_ring() {
+		failed = true;
+		ring_failed = true;
+		unsigned tail = *sq_tail;
+		for(; num_unsubmitted > 0; --num_unsubmitted, --num_in_flight) {
+			--tail;
+			free_slots.push_back(sqes[tail & *sq_mask].user_data);
+		}
+		__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+		while( num_in_flight > 0 ) {
+			int res = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			if( res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY ) {
+				//nothing left to wait with; closing the ring has the kernel cancel the rest
+				break;
+			}
+			reap();
+		}
+		close_ring();
+	}
+
+	void reap() {
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; ++head) {
+			const struct io_uring_cqe& cqe = cqes[head & *cq_mask];
+			complete(cqe.user_data, cqe.res);
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	void complete(size_t slot, int res) {
+		Request& req = requests[slot];
+		if( ring_failed ) {
+			//only waited for, never continued
+		} else if( res == -EINTR || res == -EAGAIN ) {
+			push_sqe(slot);
+			return;
+		} else if( res <= 0 ) {
+			failed = true;
+		} else if( (size_t) res < req.iov.iov_len ) {
+			req.iov.iov_base = (char*) req.iov.iov_base + res;
+			req.iov.iov_len -= res;
+			req.pos += res;
+			push_sqe(slot);
+			return;
+		}
+		free_slots.push_back(slot);
+		--num_in_flight;
+	}
+#endif
+
+  private:
+	ChunkIO(const ChunkIO&);
+	ChunkIO& operator=(const ChunkIO&);
+};
+
+/** ChunkBuffer holds ranges of a file at their positions in the file, so code that takes the
+ ** contents as one array can be given only the chunks it needs. Address space is reserved for
+ ** the whole file, but only the ranges read take up memory. The constructor throws
+ ** std::runtime_error if the space cannot be reserved.
+ **/
+class ChunkBuffer {
+  public:
+	char* data;
+	size_t size;
+
+	ChunkBuffer(size_t size): data(NULL), size(size) {
+		if( size > 0 ) {
+			void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if( addr == MAP_FAILED ) {
+				throw std::runtime_error("Unable to reserve a buffer for chunks");
+			}
+			data = (char*) addr;
+		}
+	}
+
+	~ChunkBuffer() {
+		if( data ) {
+			munmap(data, size);
+		}
+	}
+
+	// reads the ranges of fd, given as position and length, through io; overlapping and adjacent
+	// ranges are merged, and read in requests of up to block_size bytes. Returns false if a
+	// range is past the end of the buffer or could not be read
+	bool read(int fd, std::vector<std::pair<size_t, size_t> > ranges, ChunkIO& io, size_t block_size) {
+		std::sort(ranges.begin(), ranges.end());
+		size_t begin = 0, end = 0; //the merged range gathered so far
+		for(auto it = ranges.begin(); it != ranges.end(); ++it) {
+			if( it->first > size || it->second > size - it->first ) {
+				io.wait();
+				return false;
+			}
+			if( it->first > end ) {
+				read_range(fd, begin, end, io, block_size);
+				begin = it->first;
+			}
+			end = std::max(end, it->first + it->second);
+		}
+		read_range(fd, begin, end, io, block_size);
+		return io.wait();
+	}
+
+  private:
+	void read_range(int fd, size_t begin, size_t end, ChunkIO& io, size_t block_size) {
+		for(size_t pos = begin; pos < end; pos += block_size) {
+			io.read(fd, data + pos, std::min(block_size, end - pos), pos);
+		}
+	}
+
+	ChunkBuffer(const ChunkBuffer&);
+	ChunkBuffer& operator=(const ChunkBuffer&);
+};
+
+#endif
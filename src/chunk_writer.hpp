@@ -0,0 +1,184 @@
+#ifndef _CHUNK_WRITER
+#define _CHUNK_WRITER
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "chunk_io.hpp"
+
+/** Reconstructing a file produces a sequence of local chunks, given by their position in the
+ ** local source, and new chunks received from the counterparty. Chunk writers take that
+ ** sequence and write it out; it has been checked against the counterparty's Merkle tree before.
+ **/
+
+// FileChunkWriter writes to a file descriptor at its current offset. Runs of local chunks that
+// are adjacent in the source are merged and copied in one copy_file_range call where the kernel
+// supports it, and written from the source in memory otherwise. New chunks are gathered into
+// writev calls. src_fd may be -1 if the source is only in memory. Given a ChunkIO, everything
+// that is not copied in the kernel is written through it instead, at explicit positions.
+class FileChunkWriter {
+  public:
+	int out_fd;
+	const char* src;
+	int src_fd;
+	bool use_copy_range;
+	size_t run_pos, run_len; //local chunks not written yet
+	std::vector<struct iovec> literals; //new chunks not written yet
+	size_t bytes_written;
+	bool failed;
+	ChunkIO* io;
+	size_t out_pos; //where the next write goes, when writing through io
+
+	FileChunkWriter(int out_fd, const char* src, int src_fd, ChunkIO* io = NULL):
+                    out_fd(out_fd), src(src), src_fd(src_fd), use_copy_range(src_fd >= 0),
+                    run_pos(0), run_len(0), bytes_written(0), failed(false), io(io), out_pos(0) {
+		if( io ) {
+			out_pos = lseek(out_fd, 0, SEEK_CUR);
+		}
+	}
+
+	void add_local(size_t pos, size_t len) {
+		flush_literals();
+		if( run_len > 0 && run_pos + run_len == pos ) {
+			run_len += len;
+			return;
+		}
+		flush_run();
+		run_pos = pos;
+		run_len = len;
+	}
+
+	// data has to stay valid until the next flush
+	void add_literal(const std::string& data) {
+		flush_run();
+		if( data.empty() ) {
+			return;
+		}
+		if( io ) {
+			io->write(out_fd, data.data(), data.size(), out_pos);
+			out_pos += data.size();
+			bytes_written += data.size();
+			return;
+		}
+		struct iovec iov;
+		iov.iov_base = (void*) data.data();
+		iov.iov_len = data.size();
+		literals.push_back(iov);
+		if( literals.size() >= IOV_MAX ) {
+			flush_literals();
+		}
+	}
+
+	// writes everything still pending; returns false if anything could not be written
+	bool finish() {
+		flush_run();
+		flush_literals();
+		if( io ) {
+			if( !io->wait() ) {
+				fail();
+			}
+			lseek(out_fd, out_pos, SEEK_SET);
+		}
+		return !failed;
+	}
+
+	void flush_run() {
+		if( run_len == 0 ) {
+			return;
+		}
+		size_t done = 0;
+#ifdef __linux__
+		loff_t src_off = run_pos, out_off = out_pos;
+		while( use_copy_range && done < run_len ) {
+			ssize_t res = copy_file_range(src_fd, &src_off, out_fd, io ? &out_off : NULL, run_len - done, 0);
+			if( res <= 0 ) {
+				//e.g. a pipe or another file system; copy what is left by hand from now on
+				use_copy_range = false;
+				break;
+			}
+			done += res;
+		}
+#endif
+		if( io ) {
+			io->write(out_fd, src + run_pos + done, run_len - done, out_pos + done);
+			out_pos += run_len;
+		} else {
+			write_all(src + run_pos + done, run_len - done);
+		}
+		bytes_written += run_len;
+		run_len = 0;
+	}
+
+	void flush_literals() {
+		size_t first = 0;
+		while( first < literals.size() ) {
+			ssize_t res = writev(out_fd, &literals[first], literals.size() - first);
+			if( res < 0 ) {
+				if( errno == EINTR ) {
+					continue;
+				}
+				fail();
+				break;
+			}
+			bytes_written += res;
+			//skip what was written, and continue a partially written chunk where it stopped
+			size_t written = res;
+			while( first < literals.size() && written >= literals[first].iov_len ) {
+				written -= literals[first].iov_len;
+				++first;
+			}
+			if( first < literals.size() ) {
+				literals[first].iov_base = (char*) literals[first].iov_base + written;
+				literals[first].iov_len -= written;
+			}
+		}
+		literals.clear();
+	}
+
+	void write_all(const char* data, size_t len) {
+		while( len > 0 ) {
+			ssize_t res = write(out_fd, data, len);
+			if( res < 0 ) {
+				if( errno == EINTR ) {
+					continue;
+				}
+				fail();
+				return;
+			}
+			data += res;
+			len -= res;
+		}
+	}
+
+	void fail() {
+		if( !failed ) {
+			std::cerr << "Unable to write reconstructed file" << std::endl;
+		}
+		failed = true;
+	}
+};
+
+// StringChunkWriter collects the reconstructed contents in memory
+class StringChunkWriter {
+  public:
+	const char* src;
+	std::string contents;
+
+	StringChunkWriter(const char* src): src(src) {}
+
+	void add_local(size_t pos, size_t len) {
+		contents.append(src + pos, len);
+	}
+
+	void add_literal(const std::string& data) {
+		contents.append(data);
+	}
+};
+
+#endif
@@ -1,11 +1,25 @@
 #ifndef _COMPRESSION
 #define _COMPRESSION
 
+#include <limits.h>
+
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 
+/** zlib takes at most 4GB of input at a time, so longer input is passed on in pieces as the
+  * previous piece is used up. Returns whether the rest of the input has been passed on. */
+inline bool refill_input(z_stream& zs, const char* data, size_t len)
+{
+    size_t used = (const char*)zs.next_in - data;
+    if (zs.avail_in == 0) {
+        zs.avail_in = (uInt)std::min(len - used, (size_t)UINT_MAX);
+    }
+    return used + zs.avail_in == len;
+}
+
 /** Compress a STL string using zlib with given compression level and return
   * the binary data. */
 std::string compress_string(const std::string& str,
@@ -18,7 +32,7 @@ std::string compress_string(const std::string& str,
         throw(std::runtime_error("deflateInit failed while compressing."));
 
     zs.next_in = (Bytef*)str.data();
-    zs.avail_in = str.size();           // set the z_stream's input
+    zs.avail_in = 0;           // set the z_stream's input
 
     int ret;
     char outbuffer[32768];
@@ -29,7 +43,7 @@ std::string compress_string(const std::string& str,
         zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
         zs.avail_out = sizeof(outbuffer);
 
-        ret = deflate(&zs, Z_FINISH);
+        ret = deflate(&zs, refill_input(zs, str.data(), str.size()) ? Z_FINISH : Z_NO_FLUSH);
 
         if (outstring.size() < zs.total_out) {
             // append the block to the output string
@@ -59,7 +73,7 @@ std::string decompress_string(const std::string& str)
         throw(std::runtime_error("inflateInit failed while decompressing."));
 
     zs.next_in = (Bytef*)str.data();
-    zs.avail_in = str.size();
+    zs.avail_in = 0;
 
     int ret;
     char outbuffer[32768];
@@ -70,6 +84,7 @@ std::string decompress_string(const std::string& str)
         zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
         zs.avail_out = sizeof(outbuffer);
 
+        refill_input(zs, str.data(), str.size());
         ret = inflate(&zs, 0);
 
         if (outstring.size() < zs.total_out) {
@@ -90,4 +105,248 @@ std::string decompress_string(const std::string& str)
 
     return outstring;
 }
+
+/** Compress a STL string with raw deflate, using dictionary as if it came right before the
+  * data. Only the last 32K of the dictionary can be referred to. */
+std::string compress_with_dictionary(const std::string& str, const std::string& dictionary,
+                                     int compressionlevel = Z_BEST_COMPRESSION)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    if (deflateInit2(&zs, compressionlevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw(std::runtime_error("deflateInit failed while compressing."));
+    if (!dictionary.empty() &&
+        deflateSetDictionary(&zs, (const Bytef*)dictionary.data(), dictionary.size()) != Z_OK) {
+        deflateEnd(&zs);
+        throw(std::runtime_error("deflateSetDictionary failed while compressing."));
+    }
+
+    zs.next_in = (Bytef*)str.data();
+    zs.avail_in = 0;
+
+    int ret;
+    char outbuffer[32768];
+    std::string outstring;
+
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
+        zs.avail_out = sizeof(outbuffer);
+
+        ret = deflate(&zs, refill_input(zs, str.data(), str.size()) ? Z_FINISH : Z_NO_FLUSH);
+
+        if (outstring.size() < zs.total_out) {
+            outstring.append(outbuffer,
+                             zs.total_out - outstring.size());
+        }
+    } while (ret == Z_OK);
+
+    deflateEnd(&zs);
+
+    if (ret != Z_STREAM_END) {
+        std::ostringstream oss;
+        oss << "Exception during zlib compression: (" << ret << ") " << zs.msg;
+        throw(std::runtime_error(oss.str()));
+    }
+
+    return outstring;
+}
+
+/** Size of data once compressed like compress_string does, without keeping the output. */
+size_t compressed_size(const char* data, size_t len,
+                       int compressionlevel = Z_BEST_COMPRESSION)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    if (deflateInit(&zs, compressionlevel) != Z_OK)
+        throw(std::runtime_error("deflateInit failed while compressing."));
+
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = 0;
+
+    int ret;
+    char outbuffer[32768];
+
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
+        zs.avail_out = sizeof(outbuffer);
+
+        ret = deflate(&zs, refill_input(zs, data, len) ? Z_FINISH : Z_NO_FLUSH);
+    } while (ret == Z_OK);
+
+    deflateEnd(&zs);
+
+    if (ret != Z_STREAM_END) {
+        std::ostringstream oss;
+        oss << "Exception during zlib compression: (" << ret << ") " << zs.msg;
+        throw(std::runtime_error(oss.str()));
+    }
+
+    return zs.total_out;
+}
+
+/** Decompress a STL string made by compress_with_dictionary with the same dictionary. */
+std::string decompress_with_dictionary(const std::string& str, const std::string& dictionary)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    if (inflateInit2(&zs, -15) != Z_OK)
+        throw(std::runtime_error("inflateInit failed while decompressing."));
+    if (!dictionary.empty() &&
+        inflateSetDictionary(&zs, (const Bytef*)dictionary.data(), dictionary.size()) != Z_OK) {
+        inflateEnd(&zs);
+        throw(std::runtime_error("inflateSetDictionary failed while decompressing."));
+    }
+
+    zs.next_in = (Bytef*)str.data();
+    zs.avail_in = 0;
+
+    int ret;
+    char outbuffer[32768];
+    std::string outstring;
+
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
+        zs.avail_out = sizeof(outbuffer);
+
+        refill_input(zs, str.data(), str.size());
+        ret = inflate(&zs, 0);
+
+        if (outstring.size() < zs.total_out) {
+            outstring.append(outbuffer,
+                             zs.total_out - outstring.size());
+        }
+
+    } while (ret == Z_OK);
+
+    inflateEnd(&zs);
+
+    if (ret != Z_STREAM_END) {
+        std::ostringstream oss;
+        oss << "Exception during zlib decompression: (" << ret << ") "
+            << zs.msg;
+        throw(std::runtime_error(oss.str()));
+    }
+
+    return outstring;
+}
+
+/** DeflateStream compresses data handed to it piece by piece with raw deflate, using dictionary
+  * as compress_with_dictionary does. Each call returns the output that is ready; after a
+  * Z_SYNC_FLUSH that is all of it, so the receiver can inflate everything written so far, and
+  * Z_FINISH ends the stream. */
+class DeflateStream {
+  public:
+    DeflateStream(const std::string& dictionary, int compressionlevel = Z_BEST_COMPRESSION)
+    {
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, compressionlevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw(std::runtime_error("deflateInit failed while compressing."));
+        if (!dictionary.empty() &&
+            deflateSetDictionary(&zs, (const Bytef*)dictionary.data(), dictionary.size()) != Z_OK) {
+            deflateEnd(&zs);
+            throw(std::runtime_error("deflateSetDictionary failed while compressing."));
+        }
+    }
+
+    ~DeflateStream()
+    {
+        deflateEnd(&zs);
+    }
+
+    std::string write(const std::string& str, int flush = Z_NO_FLUSH)
+    {
+        zs.next_in = (Bytef*)str.data();
+        zs.avail_in = 0;
+
+        int ret;
+        char outbuffer[32768];
+        std::string outstring;
+
+        do {
+            zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
+            zs.avail_out = sizeof(outbuffer);
+
+            bool last = refill_input(zs, str.data(), str.size());
+            ret = deflate(&zs, last ? flush : Z_NO_FLUSH);
+            if (ret == Z_STREAM_ERROR)
+                throw(std::runtime_error("Exception during zlib compression."));
+
+            outstring.append(outbuffer, sizeof(outbuffer) - zs.avail_out);
+            //done once all input is taken and there was room for all output
+            if (last && zs.avail_in == 0 && zs.avail_out != 0)
+                break;
+        } while (ret == Z_OK);
+
+        return outstring;
+    }
+
+  private:
+    z_stream zs;
+
+    DeflateStream(const DeflateStream&);
+    DeflateStream& operator=(const DeflateStream&);
+};
+
+/** InflateStream decompresses a stream made by DeflateStream with the same dictionary, piece by
+  * piece as the pieces arrive. */
+class InflateStream {
+  public:
+    InflateStream(const std::string& dictionary): ended(false)
+    {
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -15) != Z_OK)
+            throw(std::runtime_error("inflateInit failed while decompressing."));
+        if (!dictionary.empty() &&
+            inflateSetDictionary(&zs, (const Bytef*)dictionary.data(), dictionary.size()) != Z_OK) {
+            inflateEnd(&zs);
+            throw(std::runtime_error("inflateSetDictionary failed while decompressing."));
+        }
+    }
+
+    ~InflateStream()
+    {
+        inflateEnd(&zs);
+    }
+
+    // appends what the next piece decompresses to to out; returns whether the stream has ended
+    bool write(const std::string& str, std::string& out)
+    {
+        if (ended && !str.empty())
+            throw(std::runtime_error("Data past the end of a zlib stream."));
+        zs.next_in = (Bytef*)str.data();
+        zs.avail_in = 0;
+
+        char outbuffer[32768];
+        while (!ended) {
+            zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
+            zs.avail_out = sizeof(outbuffer);
+
+            bool last = refill_input(zs, str.data(), str.size());
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            out.append(outbuffer, sizeof(outbuffer) - zs.avail_out);
+            if (ret == Z_STREAM_END) {
+                ended = true;
+                if (!last || zs.avail_in > 0)
+                    throw(std::runtime_error("Data past the end of a zlib stream."));
+            } else if (ret == Z_BUF_ERROR || (ret == Z_OK && last && zs.avail_in == 0 && zs.avail_out != 0)) {
+                break; //needs the next piece
+            } else if (ret != Z_OK) {
+                std::ostringstream oss;
+                oss << "Exception during zlib decompression: (" << ret << ") " << zs.msg;
+                throw(std::runtime_error(oss.str()));
+            }
+        }
+        return ended;
+    }
+
+  private:
+    z_stream zs;
+    bool ended;
+
+    InflateStream(const InflateStream&);
+    InflateStream& operator=(const InflateStream&);
+};
 #endif
@@ -124,14 +124,14 @@ class dir_sync {
   	void create_IBLT(size_t bucket_estimate) {
   		size_t num_buckets = bucket_estimate * 2;
   		size_t num_hashfns = ( bucket_estimate < 200 ) ? 3 : 4;
+  		delete iblt;
   		iblt = new iblt_type(num_buckets, num_hashfns);
   		iblt->insert_keys(keys);
   	}
 
   	//based on my IBLT and counterparty IBLT, determine which files are shared/not shared
-  	//update_info find_differences(dir_sync& cp_IBLT) {
-  	update_info find_differences(iblt_type& cp_IBLT) {
-  		update_info new_info;
+  	//returns false if the IBLTs could not be peeled, in which case both need larger ones
+  	bool find_differences(iblt_type& cp_IBLT, update_info& new_info) {
   		iblt_type resIBLT(cp_IBLT.num_buckets, cp_IBLT.num_hashfns);
   		
   		resIBLT.add(*iblt, 0); //my keys
@@ -141,7 +141,7 @@ class dir_sync {
   		bool res = resIBLT.peel(distinct_keys);
   		if( !res ) {
   			std::cout << "Failed to peel, need to retry" << std::endl;
-  			exit(1);
+  			return false;
   		}
 
   		std::cout << "Distict keys has size " << distinct_keys.size();
@@ -175,7 +175,7 @@ class dir_sync {
 
   		//for now non-existent files, just send file name	
 
-  		return new_info;
+  		return true;
   	}
 
   	void process_differences(update_info& new_info) {
@@ -18,8 +18,16 @@ int main () {
   A_sync.create_IBLT(diff_estimate);
   B_sync.create_IBLT(diff_estimate);
 
-  //A sends IBLT to B
-  dir_sync::update_info info = B_sync.find_differences(*(A_sync.iblt));
+  //A sends IBLT to B, and a twice as large one for as long as B cannot peel it
+  dir_sync::update_info info;
+  for(int retries = 0; !B_sync.find_differences(*(A_sync.iblt), info); ++retries) {
+    if( retries == 5 ) {
+      return 1;
+    }
+    diff_estimate *= 2;
+    A_sync.create_IBLT(diff_estimate);
+    B_sync.create_IBLT(diff_estimate);
+  }
   A_sync.process_differences(info);
   //B sends all relevant info to A
   return 1;
@@ -0,0 +1,235 @@
+#ifndef _ESTIMATOR_SNAPSHOT
+#define _ESTIMATOR_SNAPSHOT
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "StrataEstimator.hpp"
+
+// a number no earlier call in this process got, to tell temporary files apart
+inline unsigned long next_snapshot_temp_id() {
+	static std::atomic<unsigned long> next_id(0);
+	return next_id++;
+}
+
+/** EstimatorSnapshot is a compact on-disk image of a file's strata estimator together
+ ** with the (hash, length) chunk list it was built from. The image is memory mapped on
+ ** load, so restarting does not require fingerprinting the file again. Since the strata
+ ** are linear, a changed chunk list is folded into an existing estimator by removing and
+ ** inserting only the hashes that changed.
+ **/
+template <typename hash_type>
+class EstimatorSnapshot {
+  public:
+	typedef StrataEstimator<hash_type> estimator_type;
+	typedef std::vector<std::pair<hash_type, size_t> > chunk_list;
+
+	static const uint32_t version = 3; //records the digest the chunk keys come from
+
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t hash_bytes;
+		uint32_t digest;
+		uint32_t unused;
+		uint64_t avg_block_size;
+		uint64_t overlap;
+		uint64_t file_size;
+		int64_t file_mtime;
+		uint64_t num_chunks;
+		uint64_t estimator_bytes;
+	};
+
+	struct chunk_record {
+		uint64_t hash;
+		uint64_t len;
+	};
+
+	//parameters and file state the snapshot was taken with
+	size_t avg_block_size;
+	uint32_t digest; //how the chunk keys were made, a DigestMethod
+	size_t overlap;
+	size_t file_size;
+	int64_t file_mtime;
+
+	EstimatorSnapshot(): avg_block_size(0), digest(0), overlap(0), file_size(0), file_mtime(0) {}
+
+	static void set_magic(header& hdr) {
+		memcpy(hdr.magic, "SRSNAP\0\0", sizeof(hdr.magic));
+	}
+
+	// true if filename still has the size and modification time recorded in the snapshot
+	bool matches_file(const std::string& filename) const {
+		struct stat st;
+		if( stat(filename.c_str(), &st) != 0 ) {
+			return false;
+		}
+		return( (size_t) st.st_size == file_size && get_mtime(st) == file_mtime );
+	}
+
+	//modification time in nanoseconds, so rewrites within the same second are noticed
+	static int64_t get_mtime(const struct stat& st) {
+		return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	}
+
+	void record_file(const std::string& filename) {
+		struct stat st;
+		if( stat(filename.c_str(), &st) == 0 ) {
+			file_size = st.st_size;
+			file_mtime = get_mtime(st);
+		}
+	}
+
+	bool save(const std::string& snapshot_file,
+              const estimator_type& estimator,
+              const chunk_list& hashes) const {
+		header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		set_magic(hdr);
+		hdr.version = version;
+		hdr.hash_bytes = sizeof(hash_type);
+		hdr.digest = digest;
+		hdr.avg_block_size = avg_block_size;
+		hdr.overlap = overlap;
+		hdr.file_size = file_size;
+		hdr.file_mtime = file_mtime;
+		hdr.num_chunks = hashes.size();
+		hdr.estimator_bytes = estimator.snapshot_bytes();
+
+		std::vector<char> buf(sizeof(hdr) + hdr.estimator_bytes + hashes.size()*sizeof(chunk_record));
+		memcpy(buf.data(), &hdr, sizeof(hdr));
+		char* out = estimator.write_snapshot(buf.data() + sizeof(hdr));
+		for(auto it = hashes.begin(); it != hashes.end(); ++it) {
+			chunk_record rec;
+			rec.hash = it->first;
+			rec.len = it->second;
+			memcpy(out, &rec, sizeof(rec));
+			out += sizeof(rec);
+		}
+
+		//write to a temporary file and rename so readers never see a partial snapshot; the name
+		//is unique to this process and call, so writers of the same snapshot do not mix
+		std::string temp_file = snapshot_file + "." + std::to_string(getpid()) + "."
+                                + std::to_string(next_snapshot_temp_id()) + ".tmp";
+		FILE* fp = fopen(temp_file.c_str(), "w");
+		if( !fp ) {
+			std::cerr << "Unable to write snapshot " << temp_file << std::endl;
+			return false;
+		}
+		size_t written = fwrite(buf.data(), 1, buf.size(), fp);
+		fclose(fp);
+		if( written != buf.size() || rename(temp_file.c_str(), snapshot_file.c_str()) != 0 ) {
+			std::cerr << "Unable to write snapshot " << snapshot_file << std::endl;
+			unlink(temp_file.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// maps snapshot_file and restores estimator and hashes from it. Returns false
+	// (leaving both untouched) if the snapshot is missing or was written with other parameters.
+	// If avg_block_size is set beforehand, snapshots taken with another block size are rejected,
+	// and so are snapshots whose chunk keys were made with another digest than the one set
+	bool load(const std::string& snapshot_file,
+              estimator_type& estimator,
+              chunk_list& hashes) {
+		int fd = open(snapshot_file.c_str(), O_RDONLY);
+		if( fd < 0 ) {
+			return false;
+		}
+		struct stat st;
+		if( fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header) ) {
+			close(fd);
+			return false;
+		}
+		size_t map_size = st.st_size;
+		void* addr = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if( addr == MAP_FAILED ) {
+			return false;
+		}
+
+		bool res = restore((const char*) addr, map_size, estimator, hashes);
+		munmap(addr, map_size);
+		return res;
+	}
+
+	bool restore(const char* data, size_t size, estimator_type& estimator, chunk_list& hashes) {
+		header hdr, expected;
+		if( size < sizeof(hdr) ) {
+			std::cerr << "Ignoring incompatible snapshot" << std::endl;
+			return false;
+		}
+		memcpy(&hdr, data, sizeof(hdr));
+		set_magic(expected);
+		//the records are counted by dividing, since a forged num_chunks could overflow a product
+		size_t body_size = size - sizeof(hdr);
+		if( memcmp(hdr.magic, expected.magic, sizeof(hdr.magic)) != 0
+            || hdr.version != version
+            || hdr.hash_bytes != sizeof(hash_type)
+            || hdr.digest != digest
+            || hdr.estimator_bytes != estimator.snapshot_bytes()
+            || (avg_block_size != 0 && hdr.avg_block_size != avg_block_size)
+            || body_size < hdr.estimator_bytes
+            || (body_size - hdr.estimator_bytes) % sizeof(chunk_record) != 0
+            || (body_size - hdr.estimator_bytes) / sizeof(chunk_record) != hdr.num_chunks ) {
+			std::cerr << "Ignoring incompatible snapshot" << std::endl;
+			return false;
+		}
+		avg_block_size = hdr.avg_block_size;
+		overlap = hdr.overlap;
+		file_size = hdr.file_size;
+		file_mtime = hdr.file_mtime;
+
+		const char* in = estimator.read_snapshot(data + sizeof(hdr));
+		hashes.clear();
+		hashes.reserve(hdr.num_chunks);
+		for(size_t i = 0; i < hdr.num_chunks; ++i) {
+			chunk_record rec;
+			memcpy(&rec, in, sizeof(rec));
+			in += sizeof(rec);
+			hashes.push_back(std::make_pair((hash_type) rec.hash, (size_t) rec.len));
+		}
+		return true;
+	}
+
+	// updates estimator, built from the distinct hashes of old_hashes, so that it reflects
+	// new_hashes instead. Only hashes whose presence changed are touched. Returns the number
+	// of estimator updates performed
+	static size_t apply_delta(estimator_type& estimator,
+                              const chunk_list& old_hashes,
+                              const chunk_list& new_hashes) {
+		//bit 1 marks a hash present in the old list, bit 2 one present in the new list
+		std::unordered_map<hash_type, int> presence;
+		for(auto it = old_hashes.begin(); it != old_hashes.end(); ++it) {
+			presence[it->first] |= 1;
+		}
+		for(auto it = new_hashes.begin(); it != new_hashes.end(); ++it) {
+			presence[it->first] |= 2;
+		}
+
+		size_t num_updates = 0;
+		for(auto it = presence.begin(); it != presence.end(); ++it) {
+			if( it->second == 1 ) { //only in the old file
+				estimator.remove_key(it->first);
+				++num_updates;
+			} else if( it->second == 2 ) { //only in the new file
+				estimator.insert_key(it->first);
+				++num_updates;
+			}
+		}
+		return num_updates;
+	}
+};
+
+#endif
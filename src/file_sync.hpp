@@ -2,17 +2,31 @@
 #define _FILE_SYNC
 
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <zlib.h>
 
-#include <map>
 #include <cmath>
+#include <functional>
+#include <memory>
+#include <thread>
 
 #include "basicIBLT.hpp"
+#include "chunk_io.hpp"
+#include "chunk_writer.hpp"
 #include "compression.hpp"
+#include "estimator_snapshot.hpp"
 #include "file_sync.pb.h"
 #include "fingerprinting.hpp"
+#include "flat_index.hpp"
 #include "IBLT_helpers.hpp"
+#include "inplace_patch.hpp"
+#include "merkle_tree.hpp"
 #include "multiIBLT.hpp"
+#include "parallel.hpp"
+#include "round2_codec.hpp"
+#include "signature_cache.hpp"
 #include "StrataEstimator.hpp"
 
 #define FILE_SYNC_DEBUG 0
@@ -30,40 +44,260 @@
 #endif
 
 #define DEFAULT_BLOCK_SIZE 700
+#define MIN_ADAPTIVE_BLOCK_SIZE 32
+//rough bytes of hashes and round 2 flags per chunk of a mostly unchanged file
+#define CHUNK_COST 0.25
 
 template <typename hash_type = uint32_t, typename iblt_type = basicIBLT<hash_type> >
 class FileSynchronizer {
   public:
   	size_t overlap;
+	typedef std::function<void(const std::string&)> frame_sink;
 	class Round1Info;
   	class Round2Info;
 	class OverlapInfo;
 
   	Round1Info my_rd1;
   	Round2Info my_rd2;
-  	std::unordered_set<hash_type> my_distinct_keys, cp_distinct_keys, shared_keys;
+  	FlatHashSet<hash_type> my_distinct_keys, cp_distinct_keys, shared_keys;
     OverlapInfo oi; //only for the shared hashes
    	std::string file;
 	size_t avg_block_size; 
+	DigestMethod digest; //how blocks are hashed into chunk keys; both parties have to use the same
+	bool in_memory; //synchronizing contents rather than file
+	std::vector<char> contents;
+	size_t io_queue_depth; //file reads and writes in flight at once
+	bool pack_new_chunks; //deflate new chunks with the shared chunks around them as dictionary
+	size_t iblt_estimate; //difference estimate my IBLT was sized for
+	double iblt_growth; //how much larger an IBLT is asked for after failing to peel
+	size_t num_threads; //threads hashing chunks into the Merkle tree
+	bool pipelined; //work on my IBLT in the background while the strata round is in flight
+	uint64_t max_new_bytes; //most new chunk contents a pipelined round 2 may announce up front
+	//sizes of the independently chunked segments my contents are made of, if any, and the
+	//same for the counterparty's contents; no chunk spans two segments
+	std::vector<size_t> segment_sizes, cp_segment_sizes;
+	//Merkle tree of my chunks once they are encoded for the counterparty, or of the
+	//counterparty's chunks once they are rebuilt
+	MerkleTree chunk_tree;
+	//what the last received round 2 message rebuilds, kept to replace chunks that turn out bad:
+	//position and length of each chunk I have, or index into new_chunk_info and length
+	Round2Info received_rd2;
+	std::vector<std::pair<size_t, size_t> > local_chunks;
+	MerkleDescent descent;
+	//hashes of my keys for the IBLT, worked out ahead of its size (see basicIBLT::hash_key), and
+	//the thread working them out or building my IBLT in the background
+	std::vector<typename iblt_type::key_hash_type> key_hashes;
+	std::thread iblt_thread;
+	//round 2 as its frames arrive: the contents stream, and the new chunk and byte it fills next
+	std::unique_ptr<InflateStream> rd2_stream;
+	size_t rd2_chunk, rd2_chunk_pos;
+	std::string rd2_tail; //what follows the contents
+	//the chunks of my file the last received round 2 message shares, once they are read
+	std::unique_ptr<ChunkBuffer> shared_chunks;
+	static const size_t max_dictionary_size = 1 << 15; //deflate window
+	static const size_t io_block_size = 1 << 20;
+	static const size_t min_parallel_chunks = 1 << 14; //fewer chunks per thread are not worth one
+	static const size_t rd2_frame_size = 1 << 16; //bytes of new chunks per round 2 frame
 
-  	FileSynchronizer(const std::string& filename): FileSynchronizer(filename, get_block_size(get_file_size(file))) 
+  	FileSynchronizer(const std::string& filename): FileSynchronizer(filename, get_block_size(get_file_size(filename))) 
     {
                                                    //file(filename)  {
 	//	avg_block_size = get_block_size( get_file_size(file() ) );
 	//	process_file(file);
   	};
 
-	FileSynchronizer(const std::string& filename, size_t avg_block_size): file(filename), avg_block_size(avg_block_size) {
+	FileSynchronizer(const std::string& filename, size_t avg_block_size, DigestMethod digest = MURMUR128): 
+                     file(filename), avg_block_size(avg_block_size), digest(digest), in_memory(false),
+                     io_queue_depth(ChunkIO::default_queue_depth), pack_new_chunks(true),
+                     iblt_estimate(0), iblt_growth(2), num_threads(std::thread::hardware_concurrency()),
+                     pipelined(false), max_new_bytes((uint64_t) 1 << 32) {
 		process_file(file);
 	} 
 
+	// synchronizes the given contents instead of a file
+	FileSynchronizer(const std::vector<char>& contents, size_t avg_block_size, DigestMethod digest = MURMUR128): 
+                     avg_block_size(avg_block_size), digest(digest), in_memory(true), contents(contents),
+                     io_queue_depth(ChunkIO::default_queue_depth), pack_new_chunks(true),
+                     iblt_estimate(0), iblt_growth(2), num_threads(std::thread::hardware_concurrency()),
+                     pipelined(false), max_new_bytes((uint64_t) 1 << 32) {
+		process_contents();
+	}
+
+	// synchronizes contents made of segments (e.g. the files of a batch) that are chunked on
+	// their own, with each segment's id mixed into the keys of its chunks
+	FileSynchronizer(const std::vector<char>& contents, const std::vector<size_t>& segment_sizes,
+                     const std::vector<hash_type>& segment_ids, size_t avg_block_size,
+                     DigestMethod digest = MURMUR128):
+                     avg_block_size(avg_block_size), digest(digest), in_memory(true), contents(contents),
+                     io_queue_depth(ChunkIO::default_queue_depth), pack_new_chunks(true),
+                     iblt_estimate(0), iblt_growth(2), num_threads(std::thread::hardware_concurrency()),
+                     pipelined(false), max_new_bytes((uint64_t) 1 << 32),
+                     segment_sizes(segment_sizes) {
+		process_segments(segment_ids);
+	}
+
+	// restores the estimator and chunk list from snapshot_file when possible, and otherwise
+	// processes the file and leaves a snapshot behind for the next run
+	FileSynchronizer(const std::string& filename, size_t avg_block_size, const std::string& snapshot_file,
+                     DigestMethod digest = MURMUR128): 
+                     file(filename), avg_block_size(avg_block_size), digest(digest), in_memory(false),
+                     io_queue_depth(ChunkIO::default_queue_depth), pack_new_chunks(true),
+                     iblt_estimate(0), iblt_growth(2), num_threads(std::thread::hardware_concurrency()),
+                     pipelined(false), max_new_bytes((uint64_t) 1 << 32) {
+		if( !load_snapshot(snapshot_file) ) {
+			process_file(file);
+			save_snapshot(snapshot_file);
+		}
+	}
+
+	// same, with the snapshot kept in cache under the file's identity
+	FileSynchronizer(const std::string& filename, size_t avg_block_size, SignatureCache& cache,
+                     DigestMethod digest = MURMUR128): 
+                     file(filename), avg_block_size(avg_block_size), digest(digest), in_memory(false),
+                     io_queue_depth(ChunkIO::default_queue_depth), pack_new_chunks(true),
+                     iblt_estimate(0), iblt_growth(2), num_threads(std::thread::hardware_concurrency()),
+                     pipelined(false), max_new_bytes((uint64_t) 1 << 32) {
+		std::string entry = cache.entry_path(file, avg_block_size, sizeof(hash_type));
+		if( entry.empty() ) {
+			process_file(file);
+			return;
+		}
+		SignatureCache::EntryLock lock = cache.lock_entry(entry);
+		bool up_to_date = false;
+		if( !load_snapshot(entry, up_to_date) ) {
+			process_file(file);
+			save_snapshot(entry);
+		}
+		if( up_to_date ) {
+			++cache.hits;
+			cache.touch(entry);
+		} else {
+			++cache.misses;
+			cache.add(entry);
+		}
+	}
+
+	~FileSynchronizer() {
+		join_IBLT_thread();
+	}
+
 	static size_t get_block_size(size_t file_size) {
 		size_t new_block_size = (size_t) sqrt( file_size );
 		return (new_block_size > DEFAULT_BLOCK_SIZE) ? new_block_size : DEFAULT_BLOCK_SIZE;
 	}
 
+	// block size for a first pass that only estimates how much the files differ
+	static size_t get_probe_block_size(size_t file_size) {
+		return get_block_size(file_size);
+	}
+
+	// block size that minimizes the bytes sent, given that a first pass with probe block sizes
+	// found probe_diff chunks to differ. A changed region costs about a block of new contents
+	// and turns into about two differing chunks, while every chunk costs about CHUNK_COST bytes,
+	// so for k changes the total of k*B + CHUNK_COST*F/B is smallest at B = sqrt(CHUNK_COST*F/k)
+	static size_t get_adaptive_block_size(size_t file_size, size_t probe_diff) {
+		size_t new_block_size = (size_t) sqrt( CHUNK_COST * file_size / probe_changes(probe_diff) );
+		new_block_size = std::min(new_block_size, std::max(file_size, (size_t) MIN_ADAPTIVE_BLOCK_SIZE));
+		return std::max(new_block_size, (size_t) MIN_ADAPTIVE_BLOCK_SIZE);
+	}
+
+	// bytes expected to be sent at block_size, in the same model
+	static double get_expected_bytes(size_t file_size, size_t probe_diff, size_t block_size) {
+		return probe_changes(probe_diff) * block_size + CHUNK_COST * file_size / block_size;
+	}
+
+	static double probe_changes(size_t probe_diff) {
+		return probe_diff > 2 ? probe_diff / 2.0 : 1;
+	}
+
+	//choose overlap so should get ~1 elt per start mapping
+	static size_t get_overlap(size_t file_size, size_t avg_block_size) {
+		size_t num_blocks = file_size/avg_block_size;
+		return log(num_blocks > 0 ? num_blocks : 1)/log(1 << 8) + 1;
+	}
+
+	void load_contents(std::vector<char>& buf) {
+		if( in_memory ) {
+			buf = contents;
+		} else {
+			read_file(buf);
+		}
+	}
+
+	// reads my file into buf, with up to io_queue_depth reads in flight; throws
+	// std::runtime_error if it cannot be read
+	void read_file(std::vector<char>& buf) {
+		int fd = open(file.c_str(), O_RDONLY);
+		struct stat st;
+		if( fd < 0 || fstat(fd, &st) != 0 ) {
+			if( fd >= 0 ) {
+				close(fd);
+			}
+			throw std::runtime_error("Unable to open file " + file);
+		}
+		buf.resize(st.st_size);
+		ChunkIO io(io_queue_depth);
+		for(size_t pos = 0; pos < buf.size(); pos += io_block_size) {
+			io.read(fd, buf.data() + pos, std::min((size_t) io_block_size, buf.size() - pos), pos);
+		}
+		bool res = io.wait();
+		close(fd);
+		if( !res ) {
+			throw std::runtime_error("Unable to read file " + file);
+		}
+	}
+
+	// the ranges of my file, given as position and length, read into a buffer laid out like the
+	// file with up to io_queue_depth reads in flight; throws std::runtime_error if they cannot be read
+	std::unique_ptr<ChunkBuffer> read_chunks(const std::vector<std::pair<size_t, size_t> >& ranges) const {
+		std::unique_ptr<ChunkBuffer> buf(new ChunkBuffer(my_file_size()));
+		int fd = open(file.c_str(), O_RDONLY);
+		if( fd < 0 ) {
+			throw std::runtime_error("Unable to open file " + file);
+		}
+		ChunkIO io(io_queue_depth);
+		bool res = buf->read(fd, ranges, io, io_block_size);
+		close(fd);
+		if( !res ) {
+			throw std::runtime_error("Unable to read file " + file);
+		}
+		return buf;
+	}
+
+	// the size of my contents as they were chunked
+	size_t my_file_size() const {
+		size_t size = 0;
+		for(auto it = my_rd1.hashes.begin(); it != my_rd1.hashes.end(); ++it) {
+			size += it->second;
+		}
+		return size;
+	}
+
+	// my contents, or the chunks of my file that cp_rd2 says the counterparty shares: those are
+	// all its version is rebuilt from, so the rest of the file is never read
+	const char* local_source(const Round2Info& cp_rd2) {
+		if( in_memory ) {
+			return contents.data();
+		}
+		if( !shared_chunks ) {
+			std::vector<std::pair<size_t, size_t> > ranges;
+			for(size_t i = 0; i < cp_rd2.hash_exists.size() && i < my_rd1.hashes_to_poslen.size(); ++i) {
+				if( cp_rd2.hash_exists[i] ) {
+					ranges.push_back(my_rd1.hashes_to_poslen.entry(i).second);
+				}
+			}
+			shared_chunks = read_chunks(ranges);
+		}
+		return shared_chunks->data;
+	}
+
 //ENCODING STUFF:
   	std::string send_strata_encoding() {
+		if( pipelined ) {
+			//my IBLT's size is only known once the estimate comes back
+			join_IBLT_thread();
+			iblt_thread = std::thread([this]() { hash_keys(); });
+		}
   		file_sync::strata_estimator estimator;
   		my_rd1.estimator.serialize(estimator);
   		std::string estimator_encoding;
@@ -76,18 +310,119 @@ class FileSynchronizer {
   	}
 
   	size_t receive_strata_encoding(const std::string& strata_encoding) {
+  		size_t diff_estimate = decode_strata(strata_encoding);
+		prepare_IBLT(diff_estimate);
+  		return diff_estimate;
+  	}
+
+  	size_t decode_strata(const std::string& strata_encoding) {
   		file_sync::strata_estimator estimator;
   		std::string strata_decoding = decompress_string(strata_encoding);
   		estimator.ParseFromString(strata_decoding);
   		StrataEstimator<hash_type> cp_estimator;
   		cp_estimator.deserialize(estimator);
-  		size_t diff_estimate = get_difference_estimate(cp_estimator);
-		create_IBLT(diff_estimate);
-  		return diff_estimate;
-  	}
+  		return get_difference_estimate(cp_estimator);
+	}
+
+	void prepare_IBLT(size_t diff_estimate) {
+		if( pipelined ) {
+			join_IBLT_thread();
+			//built while the estimate goes back and the counterparty builds its IBLT
+			iblt_thread = std::thread([this, diff_estimate]() {
+				hash_keys();
+				build_IBLT(diff_estimate);
+			});
+		} else {
+			create_IBLT(diff_estimate);
+		}
+	}
+
+	// adaptive mode, party A: the strata round of a first pass, chunked at a probe block size
+	// (see get_probe_block_size), led by that block size
+	std::string send_probe_encoding() {
+		std::string probe_encoding;
+		Round2Codec<Round2Info>::put_varint(avg_block_size, probe_encoding);
+		return probe_encoding + send_strata_encoding();
+	}
+
+	// party B: estimates the difference at the counterparty's probe block size and picks the
+	// block size to synchronize at (see choose_block_size), chunking my file again if it
+	// changed. The reply holds that block size and the estimate, which the IBLT round goes on
+	// with: a change turns into about as many differing chunks at any block size, so the strata
+	// round is not repeated
+	std::string receive_probe_encoding(const std::string& probe_encoding) {
+		size_t pos = 0;
+		size_t probe_block_size = Round2Codec<Round2Info>::get_varint(probe_encoding, pos);
+		if( probe_block_size < MIN_ADAPTIVE_BLOCK_SIZE ) {
+			throw std::runtime_error("Probe block size is too small");
+		}
+		if( probe_block_size != avg_block_size ) {
+			rechunk(probe_block_size);
+		}
+		size_t strata_size = probe_encoding.size() - pos;
+		size_t diff_estimate = decode_strata(probe_encoding.substr(pos));
+		size_t new_block_size = choose_block_size(diff_estimate, strata_size);
+		std::string reply;
+		Round2Codec<Round2Info>::put_varint(new_block_size, reply);
+		Round2Codec<Round2Info>::put_varint(diff_estimate, reply);
+		if( new_block_size != avg_block_size ) {
+			rechunk(new_block_size);
+		}
+		prepare_IBLT(diff_estimate);
+		return reply;
+	}
+
+	// party A: takes the reply to my probe encoding, chunking my file again if the block size
+	// changed, and fills diff_estimate to size my IBLT for. Returns whether the probe block
+	// size was kept
+	bool receive_probe_reply(const std::string& reply, size_t& diff_estimate) {
+		size_t pos = 0;
+		size_t new_block_size = Round2Codec<Round2Info>::get_varint(reply, pos);
+		diff_estimate = Round2Codec<Round2Info>::get_varint(reply, pos);
+		if( new_block_size < MIN_ADAPTIVE_BLOCK_SIZE ) {
+			throw std::runtime_error("Adaptive block size is too small");
+		}
+		if( new_block_size == avg_block_size ) {
+			return true;
+		}
+		rechunk(new_block_size);
+		return false;
+	}
+
+	// the adaptive block size for my contents, unless it is expected to save fewer bytes than the
+	// strata round took, strata_size; the model ignores that new chunks are deflated, and that
+	// would not pay for chunking both files again
+	size_t choose_block_size(size_t diff_estimate, size_t strata_size) const {
+		size_t total_size = 0;
+		for(auto it = my_rd1.hashes.begin(); it != my_rd1.hashes.end(); ++it) {
+			total_size += it->second;
+		}
+		size_t new_block_size = get_adaptive_block_size(total_size, diff_estimate);
+		double saved = get_expected_bytes(total_size, diff_estimate, avg_block_size)
+                       - get_expected_bytes(total_size, diff_estimate, new_block_size);
+		return saved > strata_size ? new_block_size : avg_block_size;
+	}
+
+	// chunks my file or contents again at another block size
+	void rechunk(size_t new_block_size) {
+		if( !segment_sizes.empty() ) {
+			throw std::runtime_error("Segmented contents cannot be chunked again");
+		}
+		join_IBLT_thread();
+		avg_block_size = new_block_size;
+		my_rd1.hashes.clear();
+		my_rd1.estimator.clear();
+		delete my_rd1.iblt;
+		my_rd1.iblt = NULL;
+		key_hashes.clear();
+		if( in_memory ) {
+			process_contents();
+		} else {
+			process_file(file);
+		}
+	}
 
   	std::string send_IBLT_encoding(size_t diff_estimate) {
-		create_IBLT(diff_estimate);
   		create_IBLT(diff_estimate);
   		file_sync::IBLT2 iblt_protobuf;
 		my_rd1.iblt->serialize(iblt_protobuf);
@@ -100,21 +435,58 @@ class FileSynchronizer {
 		return iblt_encoding;
   	}
 
-  	std::string receive_IBLT_encoding(const std::string& iblt_encoding) {
+	// party B: fills rd2_encoding, or returns false if the IBLT could not be peeled. The
+	// counterparty should then send an IBLT sized for retry_estimate() differences
+  	bool receive_IBLT_encoding(const std::string& iblt_encoding, std::string& rd2_encoding) {
+		if( !decode_IBLT(iblt_encoding) ) {
+			return false;
+		}
+		rd2_encoding = send_rd2_encoding();
+		return true;
+  	}
+
+	// party B, pipelined: rather than encoding round 2 as one message, passes it to sink in
+	// frames once the chunk encoding is determined (see send_rd2_frames). sink is called on a
+	// stage thread
+	bool receive_IBLT_encoding(const std::string& iblt_encoding, const frame_sink& sink) {
+		return decode_IBLT(iblt_encoding, sink);
+	}
+
+	// peels the counterparty's IBLT and fills my_rd2 with the chunk encoding, which also goes to
+	// sink if one is given. On failure, my IBLT is grown to retry_estimate() and the keys peeled
+	// so far are kept for the next try
+	bool decode_IBLT(const std::string& iblt_encoding, const frame_sink& sink = frame_sink()) {
+		join_IBLT_thread();
   		file_sync::IBLT2 iblt_protobuf;
   		std::string iblt_deencoding = decompress_string(iblt_encoding);
 		iblt_protobuf.ParseFromString(iblt_deencoding);
+		size_t num_buckets = iblt_protobuf.count_size();
+		if( num_buckets == 0 || iblt_protobuf.key_sum_size() != (int) num_buckets
+            || iblt_protobuf.hash_sum_size() != (int) num_buckets ) {
+			std::cerr << "Malformed IBLT encoding" << std::endl;
+			return false;
+		}
+		//the counterparty may have sized its IBLT for another estimate, e.g. when retrying
+		if( num_buckets != my_rd1.iblt->num_buckets ) {
+			create_IBLT(num_buckets / 2);
+		}
 		iblt_type new_iblt(my_rd1.iblt->num_buckets, my_rd1.iblt->num_hashfns);
 		new_iblt.deserialize(iblt_protobuf);
-		receive_IBLT(new_iblt);
-		return send_rd2_encoding();
-  	}
+		if( !receive_IBLT(new_iblt, sink) ) {
+			create_IBLT(retry_estimate());
+			return false;
+		}
+		return true;
+	}
+
+	// difference estimate to size the next IBLT for after a failed peel
+	size_t retry_estimate() const {
+		size_t next_estimate = (size_t) (iblt_estimate * iblt_growth);
+		return next_estimate > iblt_estimate ? next_estimate : iblt_estimate + 1;
+	}
 
   	std::string send_rd2_encoding() {
-  		file_sync::Round2 rd2_protobuf;
-		my_rd2.serialize(rd2_protobuf);
-		std::string rd2_encoding;
-		rd2_protobuf.SerializeToString(&rd2_encoding);
+		std::string rd2_encoding = Round2Codec<Round2Info>::encode(my_rd2);
 		ENCODING_DEBUG("Serialized rd2 structure: " << rd2_encoding.size()*8 
                        << " bits vs actual " << my_rd2.size_in_bits());
 		rd2_encoding = compress_string(rd2_encoding);
@@ -122,66 +494,428 @@ class FileSynchronizer {
 		return rd2_encoding;
   	}
 
-  	void receive_rd2_encoding(const std::string& rd2_encoding) {
-		file_sync::Round2 rd2_protobuf;
-		std::string rd2_decoding = decompress_string(rd2_encoding);
-		rd2_protobuf.ParseFromString(rd2_decoding);
-		Round2Info cp_rd2;
-		cp_rd2.deserialize(rd2_protobuf);
-		reconstruct_file(cp_rd2);
-  	}
+	// rebuilds the counterparty's file over my own
+	bool receive_rd2_encoding_in_place(const std::string& rd2_encoding, size_t max_scratch = (size_t) 1 << 26) {
+		received_rd2 = Round2Info();
+		decode_rd2(rd2_encoding, received_rd2);
+		return reconstruct_in_place(received_rd2, max_scratch);
+	}
+
+	// rebuilds the counterparty's file in output_file. Returns false without writing anything
+	// if the rebuilt chunks do not match the counterparty's Merkle root; needs_repair() then
+	// tells whether the chunks that differ can be fetched with the requests below
+	bool receive_rd2_encoding(const std::string& rd2_encoding, const std::string& output_file) {
+		received_rd2 = Round2Info();
+		decode_rd2(rd2_encoding, received_rd2);
+		return reconstruct_file(received_rd2, output_file);
+	}
+
+	static void decode_rd2(const std::string& rd2_encoding, Round2Info& cp_rd2) {
+		Round2Codec<Round2Info>::decode(decompress_string(rd2_encoding), cp_rd2);
+	}
+
+	// party A, pipelined: takes the frames of round 2 in the order they were sent; returns true
+	// once the last one is in. The first frame lays out the chunks, which I find in my file
+	// while the contents of the new ones are still arriving
+	bool receive_rd2_frame(const std::string& frame) {
+		if( !rd2_stream ) {
+			received_rd2 = Round2Info();
+			std::string layout = decompress_string(frame);
+			if( Round2Codec<Round2Info>::decode_layout(layout, received_rd2, max_new_bytes) != layout.size() ) {
+				throw std::runtime_error("Round 2 layout has trailing data");
+			}
+			shared_chunks.reset();
+			start_rd2_stream(local_source(received_rd2));
+			return false;
+		}
+		std::string decoded;
+		bool ended = rd2_stream->write(frame, decoded);
+		size_t pos = 0;
+		for(; rd2_chunk < received_rd2.new_chunk_info.size() && pos < decoded.size(); ++rd2_chunk, rd2_chunk_pos = 0) {
+			std::string& chunk = received_rd2.new_chunk_info[rd2_chunk];
+			size_t len = std::min(chunk.size() - rd2_chunk_pos, decoded.size() - pos);
+			chunk.replace(rd2_chunk_pos, len, decoded, pos, len);
+			pos += len;
+			rd2_chunk_pos += len;
+			if( rd2_chunk_pos < chunk.size() ) {
+				break;
+			}
+		}
+		rd2_tail.append(decoded, pos, std::string::npos);
+		if( !ended ) {
+			return false;
+		}
+		rd2_stream.reset();
+		//empty chunks take no bytes, so they may still be ahead of the cursor
+		while( rd2_chunk < received_rd2.new_chunk_info.size() && received_rd2.new_chunk_info[rd2_chunk].empty() ) {
+			++rd2_chunk;
+		}
+		pos = 0;
+		size_t sha_size = rd2_chunk == received_rd2.new_chunk_info.size()
+                          ? Round2Codec<Round2Info>::get_varint(rd2_tail, pos) : (size_t) -1;
+		if( sha_size != rd2_tail.size() - pos ) {
+			throw std::runtime_error("Round 2 contents do not match their lengths");
+		}
+		received_rd2.SHAHash = rd2_tail.substr(pos);
+		return true;
+	}
+
+	void start_rd2_stream(const char* src) {
+		locate_chunks(received_rd2, src);
+		rd2_stream.reset(new InflateStream(local_dictionary(received_rd2, src)));
+		rd2_chunk = rd2_chunk_pos = 0;
+		rd2_tail.clear();
+	}
+
+	// party A, pipelined: once all frames are in, rebuilds the counterparty's file in
+	// output_file like receive_rd2_encoding
+	bool finish_rd2_frames(const std::string& output_file) {
+		return check_chunks(received_rd2) && write_reconstruction(received_rd2, output_file);
+	}
+
+//REPAIR STUFF: A narrows down the chunks it rebuilt wrong (e.g. my file changed in the meantime
+//or two blocks share a key) by descending the counterparty's Merkle tree, and fetches only those
+
+	bool needs_repair() const {
+		return descent.tree != NULL;
+	}
+
+	// party A: asks for the counterparty's tree nodes below my nodes that still differ
+	std::string send_tree_request() {
+		std::string request;
+		Round2Codec<Round2Info>::put_varint(descent.level, request);
+		Round2Codec<Round2Info>::put_varint(descent.next_level(), request);
+		put_indices(descent.differing, request);
+		return request;
+	}
+
+	// party B
+	std::string send_tree_nodes(const std::string& request) {
+		size_t pos = 0;
+		size_t level = Round2Codec<Round2Info>::get_varint(request, pos);
+		size_t to_level = Round2Codec<Round2Info>::get_varint(request, pos);
+		std::vector<size_t> nodes;
+		get_indices(request, pos, nodes);
+		std::string digests;
+		if( !chunk_tree.get_nodes_below(level, nodes, to_level, digests) ) {
+			throw std::runtime_error("Tree request asks for nodes not in the tree");
+		}
+		return digests;
+	}
+
+	// party A: returns false if the counterparty's nodes contradict its own root
+	bool receive_tree_nodes(const std::string& digests) {
+		if( !descent.receive(digests) ) {
+			std::cerr << "Counterparty's Merkle tree nodes do not match its root" << std::endl;
+			descent = MerkleDescent();
+			return false;
+		}
+		return true;
+	}
+
+	// party A: whether the tree has been descended down to the chunks that differ
+	bool bad_chunks_found() const {
+		return descent.done();
+	}
+
+	// party A
+	std::string send_chunk_request() {
+		std::string request;
+		put_indices(descent.differing, request);
+		return request;
+	}
+
+	// party B: the contents of the chunks asked for
+	std::string send_chunks(const std::string& request) {
+		size_t pos = 0;
+		std::vector<size_t> chunks;
+		get_indices(request, pos, chunks);
+		if( in_memory ) {
+			return send_chunks(chunks, contents.data());
+		}
+		//only the chunks asked for are read
+		std::vector<size_t> chunk_positions(1, 0);
+		for(auto it = my_rd1.hashes.begin(); it != my_rd1.hashes.end(); ++it) {
+			chunk_positions.push_back(chunk_positions.back() + it->second);
+		}
+		std::vector<std::pair<size_t, size_t> > ranges;
+		for(auto it = chunks.begin(); it != chunks.end(); ++it) {
+			if( *it < my_rd1.hashes.size() ) {
+				ranges.push_back(std::make_pair(chunk_positions[*it], my_rd1.hashes[*it].second));
+			}
+		}
+		std::unique_ptr<ChunkBuffer> src = read_chunks(ranges);
+		return send_chunks(chunks, src->data);
+	}
+
+	std::string send_chunks(const std::vector<size_t>& chunks, const char* data) {
+		std::vector<size_t> chunk_positions(1, 0);
+		for(auto it = my_rd1.hashes.begin(); it != my_rd1.hashes.end(); ++it) {
+			chunk_positions.push_back(chunk_positions.back() + it->second);
+		}
+		std::string res;
+		for(auto it = chunks.begin(); it != chunks.end(); ++it) {
+			if( *it >= my_rd1.hashes.size() ) {
+				throw std::runtime_error("Chunk request asks for chunks not in the file");
+			}
+			Round2Codec<Round2Info>::put_varint(my_rd1.hashes[*it].second, res);
+			res.append(data + chunk_positions[*it], my_rd1.hashes[*it].second);
+		}
+		return compress_string(res);
+	}
+
+	// party A: writes the counterparty's file to output_file with the chunks received in place
+	// of the ones that differed
+	bool receive_chunks(const std::string& chunks, const std::string& output_file) {
+		return replace_bad_chunks(chunks) && write_reconstruction(received_rd2, output_file);
+	}
+
+	bool receive_chunks_in_place(const std::string& chunks, size_t max_scratch = (size_t) 1 << 26) {
+		return replace_bad_chunks(chunks) && write_reconstruction_in_place(received_rd2, max_scratch);
+	}
+
+	bool replace_bad_chunks(const std::string& chunks) {
+		std::string decoded = decompress_string(chunks);
+		size_t pos = 0;
+		for(auto it = descent.differing.begin(); it != descent.differing.end(); ++it) {
+			size_t len = Round2Codec<Round2Info>::get_varint(decoded, pos);
+			Round2Codec<Round2Info>::check_size(decoded, pos, len);
+			//local_chunks refers to new chunks by index, so a replaced chunk can go at the end
+			if( received_rd2.chunk_exists[*it] ) {
+				received_rd2.chunk_exists[*it] = false;
+				local_chunks[*it].first = received_rd2.new_chunk_info.size();
+				received_rd2.new_chunk_info.push_back(std::string());
+			}
+			local_chunks[*it].second = len;
+			std::string& chunk = received_rd2.new_chunk_info[local_chunks[*it].first];
+			chunk.assign(decoded, pos, len);
+			pos += len;
+			chunk_tree.set_leaf(*it, chunk.data(), len);
+		}
+		chunk_tree.build_levels();
+		descent = MerkleDescent();
+		if( chunk_tree.root() != received_rd2.SHAHash ) {
+			std::cerr << "Repaired chunks do not match the counterparty's Merkle root" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	static void put_indices(const std::vector<size_t>& indices, std::string& res) {
+		Round2Codec<Round2Info>::put_varint(indices.size(), res);
+		for(auto it = indices.begin(); it != indices.end(); ++it) {
+			Round2Codec<Round2Info>::put_varint(*it, res);
+		}
+	}
+
+	static void get_indices(const std::string& encoding, size_t& pos, std::vector<size_t>& indices) {
+		size_t num_indices = Round2Codec<Round2Info>::get_varint(encoding, pos);
+		for(size_t i = 0; i < num_indices; ++i) {
+			indices.push_back(Round2Codec<Round2Info>::get_varint(encoding, pos));
+		}
+	}
 
 //PROTOCOL STUFF
 
   	//Party A fills his structure with info to estimate set difference
   	//and fills the rest of the hash structure while he's at it
   	void process_file(const std::string& filename) {
-		//choose overlap so should get ~1 elt per start mapping
-		overlap = log(get_file_size(filename)/avg_block_size)/log(1 << 8) + 1;
- 		Fingerprinter<hash_type> f(avg_block_size);	
+		overlap = get_overlap(get_file_size(filename), avg_block_size);
+ 		Fingerprinter<hash_type> f = make_fingerprinter();
 		f.digest_file( filename, my_rd1.hashes, overlap);
+		report_key_collisions(f);
 
-		// create mapping from my hashes to their block lengths and start position in file
-		size_t curr_pos = 0;
-  		for(auto it = my_rd1.hashes.begin(); it != my_rd1.hashes.end(); ++it) {
-  			if( my_rd1.hashes_to_poslen.find(it->first) != my_rd1.hashes_to_poslen.end() ) {
-  				SYNC_DEBUG("Already have hash " << it->first << " pos " << curr_pos << " len" << it->second);
-  			} else {
-  				my_rd1.hashes_to_poslen[it->first] = std::make_pair(curr_pos, it->second);
-  			}
-  			SYNC_DEBUG("File" << filename << " Hash " << it->first << " pos " << curr_pos << " len" << it->second);
-			curr_pos += it->second;
-  		}
-  		SYNC_DEBUG("File " << filename << " has " << my_rd1.hashes.size() 
-                   << "hashes" << ". hashes_to_pos_len has size" << my_rd1.hashes_to_poslen.size());
+		index_chunks();
+		fill_estimator();
+  	}
+
+	void process_contents() {
+		overlap = get_overlap(contents.size(), avg_block_size);
+		Fingerprinter<hash_type> f = make_fingerprinter();
+		f.digest_buffer(contents.data(), contents.size(), my_rd1.hashes, overlap);
+		report_key_collisions(f);
+
+		index_chunks();
+		fill_estimator();
+	}
+
+	void process_segments(const std::vector<hash_type>& segment_ids) {
+		overlap = get_overlap(contents.size(), avg_block_size);
+		Fingerprinter<hash_type> f = make_fingerprinter();
+		size_t pos = 0;
+		for(size_t i = 0; i < segment_sizes.size(); ++i) {
+			//empty segments have no chunks at all
+			if( segment_sizes[i] > 0 ) {
+				size_t first = my_rd1.hashes.size();
+				f.digest_buffer(contents.data() + pos, segment_sizes[i], my_rd1.hashes, overlap);
+				report_key_collisions(f);
+				for(size_t j = first; j < my_rd1.hashes.size(); ++j) {
+					my_rd1.hashes[j].first = segment_key(segment_ids[i], my_rd1.hashes[j].first);
+				}
+			}
+			pos += segment_sizes[i];
+		}
+
+		index_chunks();
+		fill_estimator();
+	}
+
+	static hash_type segment_key(hash_type segment_id, hash_type key) {
+		hash_type pair[2] = {segment_id, key};
+		return (hash_type) HashUtil::MurmurHash64A(pair, sizeof(pair), 0);
+	}
+
+	// positions where segments start; one segment of total_size if there are no segments
+	static std::vector<size_t> segment_starts(const std::vector<size_t>& sizes, size_t total_size) {
+		std::vector<size_t> starts(1, 0);
+		for(auto it = sizes.begin(); it != sizes.end(); ++it) {
+			starts.push_back(starts.back() + *it);
+		}
+		if( sizes.empty() ) {
+			starts.push_back(total_size);
+		}
+		return starts;
+	}
+
+	void fill_estimator() {
   	 	for(auto it = my_rd1.hashes_to_poslen.begin(); it != my_rd1.hashes_to_poslen.end(); ++it) {
   	 		my_rd1.estimator.insert_key(it->first);
   	 	}
-  	}
+	}
+
+	// a fingerprinter for my block size and digest
+	Fingerprinter<hash_type> make_fingerprinter() const {
+		Fingerprinter<hash_type> f(avg_block_size);
+		f.digest = digest;
+		return f;
+	}
+
+	// blocks with the same key are treated as the same block, so the counterparty's copy of
+	// the file would fail its checksum
+	void report_key_collisions(const Fingerprinter<hash_type>& f) {
+		if( f.key_collisions > 0 ) {
+			std::cerr << file << ": " << f.key_collisions 
+                      << " different blocks share a chunk key" << std::endl;
+		}
+	}
+
+	// create mapping from my hashes to their block lengths and start position in file
+	void index_chunks() {
+		my_rd1.hashes_to_poslen.build(my_rd1.hashes);
+  		SYNC_DEBUG("File " << file << " has " << my_rd1.hashes.size() 
+                   << "hashes" << ". hashes_to_pos_len has size" << my_rd1.hashes_to_poslen.size());
+	}
+
+	// replaces the chunk list, updating the estimator only for the chunks that changed
+	void update_chunks(std::vector<std::pair<hash_type, size_t> >& new_hashes) {
+		EstimatorSnapshot<hash_type>::apply_delta(my_rd1.estimator, my_rd1.hashes, new_hashes);
+		my_rd1.hashes.swap(new_hashes);
+		index_chunks();
+	}
+
+	bool save_snapshot(const std::string& snapshot_file) {
+		EstimatorSnapshot<hash_type> snapshot;
+		snapshot.avg_block_size = avg_block_size;
+		snapshot.digest = digest;
+		snapshot.overlap = overlap;
+		snapshot.record_file(file);
+		return snapshot.save(snapshot_file, my_rd1.estimator, my_rd1.hashes);
+	}
+
+	// restores Round1Info from snapshot_file. If the file was modified since the snapshot was
+	// taken, it is fingerprinted again and only the changed chunks are applied to the estimator
+	bool load_snapshot(const std::string& snapshot_file) {
+		bool up_to_date;
+		return load_snapshot(snapshot_file, up_to_date);
+	}
+
+	// up_to_date tells whether the snapshot could be used as is
+	bool load_snapshot(const std::string& snapshot_file, bool& up_to_date) {
+		EstimatorSnapshot<hash_type> snapshot;
+		snapshot.avg_block_size = avg_block_size;
+		snapshot.digest = digest;
+		up_to_date = false;
+		if( !snapshot.load(snapshot_file, my_rd1.estimator, my_rd1.hashes) ) {
+			return false;
+		}
+		if( snapshot.matches_file(file) ) {
+			overlap = snapshot.overlap;
+			index_chunks();
+			up_to_date = true;
+			return true;
+		}
+
+		overlap = get_overlap(get_file_size(file), avg_block_size);
+		std::vector<std::pair<hash_type, size_t> > new_hashes;
+		Fingerprinter<hash_type> f = make_fingerprinter();
+		f.digest_file(file, new_hashes, overlap);
+		report_key_collisions(f);
+		update_chunks(new_hashes);
+		save_snapshot(snapshot_file);
+		return true;
+	}
 
   	size_t get_difference_estimate(StrataEstimator<hash_type>& cp_estimator) {
   		return my_rd1.estimator.estimate_diff(cp_estimator);
   	}
 
   	void create_IBLT(size_t bucket_estimate) {
+		join_IBLT_thread();
+		build_IBLT(bucket_estimate);
+	}
+
+  	void build_IBLT(size_t bucket_estimate) {
   		size_t num_buckets = bucket_estimate * 2;
   		size_t num_hashfns = 4;
   		
+		delete my_rd1.iblt;
+		iblt_estimate = bucket_estimate;
   		my_rd1.iblt = new iblt_type(num_buckets, num_hashfns);
 		fill_IBLT();		
   	}
 
   	void fill_IBLT() {
+		size_t stride = my_rd1.iblt->num_hashfns + 1;
+		if( key_hashes.size() == my_rd1.hashes_to_poslen.size() * stride ) {
+			for(size_t i = 0; i < my_rd1.hashes_to_poslen.size(); ++i) {
+				my_rd1.iblt->insert_hashed_key(my_rd1.hashes_to_poslen.entry(i).first, &key_hashes[i * stride]);
+			}
+			return;
+		}
   		for(auto it = my_rd1.hashes_to_poslen.begin(); it != my_rd1.hashes_to_poslen.end(); ++it) {
 			my_rd1.iblt->insert_key(it->first);
 		}
   	}
 
+	// works out the hashes of my keys that fill_IBLT needs for an IBLT of any size; they are
+	// kept for IBLTs of later tries too
+	void hash_keys() {
+		size_t num_hashfns = 4;
+		size_t stride = num_hashfns + 1;
+		const ChunkIndex<hash_type>& index = my_rd1.hashes_to_poslen;
+		if( key_hashes.size() == index.size() * stride ) {
+			return;
+		}
+		key_hashes.resize(index.size() * stride);
+		parallel_for(index.size(), num_threads, min_parallel_chunks, [&](size_t begin, size_t end) {
+			iblt_type hasher(num_hashfns, num_hashfns);
+			for(size_t i = begin; i < end; ++i) {
+				hasher.hash_key(index.entry(i).first, &key_hashes[i * stride]);
+			}
+		});
+	}
+
+	void join_IBLT_thread() {
+		if( iblt_thread.joinable() ) {
+			iblt_thread.join();
+		}
+	}
+
   	void get_counterparty_hashes(std::vector<hash_type>& cp_sorted_hashes) {
 		//Create structure of Party A's sorted hashes by going through each of Party B's hashes
 		//and seeing if it is in B-A. If not, then must be in A intersect B
 		for(auto it = my_rd1.hashes_to_poslen.begin(); it != my_rd1.hashes_to_poslen.end(); ++it ) {
-			if(my_distinct_keys.find(it->first) == my_distinct_keys.end() ) {//key is in A intersect B
+			if( !my_distinct_keys.count(it->first) ) {//key is in A intersect B
 				cp_sorted_hashes.push_back(it->first);
 				shared_keys.insert(it->first);
 			}
@@ -199,204 +933,511 @@ class FileSynchronizer {
   		iblt_type resIBLT(cp_IBLT.num_buckets, cp_IBLT.num_hashfns);
   		resIBLT.add(*(my_rd1.iblt));
   		resIBLT.remove(cp_IBLT);
-  		bool res = resIBLT.peel(my_distinct_keys, cp_distinct_keys);
-		if( !res ) {
-  			std::cerr << "Failed to peel, need to retry" << std::endl;
-  			exit(1);
-			return false;
-  		}
-		return true;
+		//keys peeled from an earlier IBLT that was too small need not be peeled again
+		for(auto it = my_distinct_keys.begin(); it != my_distinct_keys.end(); ++it) {
+			resIBLT.remove_key(*it);
+		}
+		for(auto it = cp_distinct_keys.begin(); it != cp_distinct_keys.end(); ++it) {
+			resIBLT.insert_key(*it);
+		}
+  		return resIBLT.peel(my_distinct_keys, cp_distinct_keys);
   	}
 
-  	void determine_chunk_encoding(std::vector<hash_type>& cp_sorted_hashes) {
-  		std::vector<char> buf;
-		load_buffer_with_file(file, buf);
-
-		fill_OverlapInfo(shared_keys, buf);
-
-  		std::unordered_map<hash_type, size_t> cp_hash_to_index;
-		for(size_t i = 0; i < cp_sorted_hashes.size(); ++i) {
-			cp_hash_to_index[cp_sorted_hashes[i]] = i;
-		}
-		
-		// fill up hash_exists structure
-		for(auto it = cp_sorted_hashes.begin(); it != cp_sorted_hashes.end(); ++it) {
-			//hash exists if not unique to Party A
-			bool hash_exists = (cp_distinct_keys.find(*it) == cp_distinct_keys.end() );
-			my_rd2.hash_exists.push_back( hash_exists );
-		}
-
-		bool last_chunk_existed = false;
-  		// fill up chunk_exists structure
-  		for(size_t i = 0; i < my_rd1.hashes.size(); ++i ) {
-  			//chunk exists for both parties if can't find the hash in my unique hashes
-  			bool chunk_exists = (my_distinct_keys.find(my_rd1.hashes[i].first) == my_distinct_keys.end());
-  			my_rd2.chunk_exists.push_back( chunk_exists );
-  			hash_type hash_val = my_rd1.hashes[i].first;
-  			if(chunk_exists) { 
-				size_t cp_chunk_index;
-				if( last_chunk_existed ) {
+  	void determine_chunk_encoding(std::vector<hash_type>& cp_sorted_hashes, const frame_sink& sink = frame_sink()) {
+		if( in_memory ) {
+			determine_chunk_encoding(cp_sorted_hashes, contents.data(), contents.size(), sink);
+		} else {
+			//the Merkle root covers every chunk, so all of the file is needed, not only the new chunks
+			std::unique_ptr<ChunkBuffer> src = read_chunks(std::vector<std::pair<size_t, size_t> >(
+                                                           1, std::make_pair((size_t) 0, my_file_size())));
+			determine_chunk_encoding(cp_sorted_hashes, src->data, src->size, sink);
+		}
+	}
+
+	// fills my_rd2 for the counterparty, or streams it to sink if one is given
+  	void determine_chunk_encoding(std::vector<hash_type>& cp_sorted_hashes, const char* data, size_t size,
+                                  const frame_sink& sink = frame_sink()) {
+		fill_OverlapInfo(shared_keys, data);
+
+		// fill up hash_exists structure; hash exists if not unique to Party A
+		std::vector<char> hash_exists(cp_sorted_hashes.size());
+		parallel_for(cp_sorted_hashes.size(), num_threads, min_parallel_chunks, [&](size_t begin, size_t end) {
+			for(size_t i = begin; i < end; ++i) {
+				hash_exists[i] = !cp_distinct_keys.count(cp_sorted_hashes[i]);
+			}
+		});
+		my_rd2.hash_exists.assign(hash_exists.begin(), hash_exists.end());
+
+		size_t num_chunks = my_rd1.hashes.size();
+		std::vector<size_t> chunk_positions(num_chunks + 1, 0);
+		for(size_t i = 0; i < num_chunks; ++i) {
+			chunk_positions[i+1] = chunk_positions[i] + my_rd1.hashes[i].second;
+		}
+		//chunk exists for both parties if can't find the hash in my unique hashes
+		std::vector<char> chunk_exists(num_chunks);
+		parallel_for(num_chunks, num_threads, min_parallel_chunks, [&](size_t begin, size_t end) {
+			for(size_t i = begin; i < end; ++i) {
+				chunk_exists[i] = !my_distinct_keys.count(my_rd1.hashes[i].first);
+			}
+		});
+		std::vector<size_t> starts = segment_starts(segment_sizes, size);
+		std::vector<uint64_t> chunk_index(num_chunks);
+		parallel_for(num_chunks, num_threads, min_parallel_chunks, [&](size_t begin, size_t end) {
+			for(size_t i = begin; i < end; ++i) {
+				if( !chunk_exists[i] ) {
+					continue;
+				}
+				hash_type hash_val = my_rd1.hashes[i].first;
+				size_t pos = chunk_positions[i];
+				//the first chunk of a segment does not follow on from the chunk before it
+				if( i > 0 && chunk_exists[i-1] && !std::binary_search(starts.begin(), starts.end(), pos) ) {
 					//if the last chunk existed, then we transit the index of the new chunk that has the same start bytes
 					// as the last chunk's end bytes
-					cp_chunk_index = oi.hash_to_start_index[hash_val];
+					chunk_index[i] = oi.index_in_run(start_key(data, pos, my_rd1.hashes[i].second, starts), hash_val);
 				} else {
-  					// if chunk exists, then all we need to do is find the appropriate index in Party A's set of hashes
-  					cp_chunk_index = cp_hash_to_index[hash_val];
-
+					// if chunk exists, then all we need to do is find the appropriate index in Party A's set of hashes
+					chunk_index[i] = std::lower_bound(cp_sorted_hashes.begin(), cp_sorted_hashes.end(), hash_val)
+                                     - cp_sorted_hashes.begin();
 				}
-  				my_rd2.existing_chunk_encoding.push_back(cp_chunk_index);
-				last_chunk_existed = true;
-  			} else { //if chunk doesn't exist, then we need to copy the actual characters from the file
-  				size_t chunk_size = my_rd1.hashes_to_poslen[hash_val].second;
-  				size_t chunk_pos = my_rd1.hashes_to_poslen[hash_val].first;
-  				std::string chunk_info(&(buf.data()[chunk_pos]), chunk_size);
-  				my_rd2.new_chunk_info.push_back(chunk_info);
-				last_chunk_existed = false;
-  			}
-  		}
-		my_rd2.SHAHash = HashUtil::SHA1Hash(buf.data(), buf.size() );
-		buf.clear();	
+			}
+		});
+
+		my_rd2.chunk_exists.assign(chunk_exists.begin(), chunk_exists.end());
+		for(size_t i = 0; i < num_chunks; ++i) {
+			if( chunk_exists[i] ) {
+				my_rd2.existing_chunk_encoding.push_back(chunk_index[i]);
+			} else { //if chunk doesn't exist, then we need to copy the actual characters from the file
+				my_rd2.new_chunk_info.push_back(std::string(data + chunk_positions[i], my_rd1.hashes[i].second));
+			}
+		}
+		oi.clear();
+		if( sink ) {
+			send_rd2_frames(data, chunk_positions, sink);
+			return;
+		}
+		if( pack_new_chunks && !my_rd2.new_chunk_info.empty() ) {
+			std::string dictionary = new_chunk_dictionary(my_rd2.chunk_exists, [&](size_t i) {
+				return std::string(data + chunk_positions[i], my_rd1.hashes[i].second);
+			});
+			pack_new_chunk_info(my_rd2, dictionary);
+		}
+		chunk_tree.build(num_chunks, [&](size_t i) {
+			return std::make_pair(data + chunk_positions[i], my_rd1.hashes[i].second);
+		}, num_threads);
+		my_rd2.SHAHash = chunk_tree.root();
   	}
 
-  	bool receive_IBLT(iblt_type& cp_IBLT) {
+	// passes round 2 to sink in frames: first its layout, compressed on its own, then the new
+	// chunks deflated as one stream against the shared chunks around them, in frames of about
+	// rd2_frame_size bytes, and last the Merkle root. Frames are compressed and passed on by a
+	// stage thread, so they go out while later ones are gathered and the tree is hashed. The
+	// layout holds the index of every shared chunk, so nothing goes out before the chunk
+	// encoding is complete
+	void send_rd2_frames(const char* data, const std::vector<size_t>& chunk_positions, const frame_sink& sink) {
+		DeflateStream stream(new_chunk_dictionary(my_rd2.chunk_exists, [&](size_t i) {
+			return std::string(data + chunk_positions[i], my_rd1.hashes[i].second);
+		}));
+		StageThread stage; //finishes before stream goes away
+		std::string layout = Round2Codec<Round2Info>::encode_layout(my_rd2);
+		stage.run([layout, &sink]() { sink(compress_string(layout)); });
+		std::string piece;
+		for(auto it = my_rd2.new_chunk_info.begin(); it != my_rd2.new_chunk_info.end(); ++it) {
+			piece += *it;
+			if( piece.size() >= rd2_frame_size ) {
+				stage.run([piece, &stream, &sink]() { sink(stream.write(piece, Z_SYNC_FLUSH)); });
+				piece.clear();
+			}
+		}
+		chunk_tree.build(chunk_positions.size() - 1, [&](size_t i) {
+			return std::make_pair(data + chunk_positions[i], my_rd1.hashes[i].second);
+		}, num_threads);
+		my_rd2.SHAHash = chunk_tree.root();
+		Round2Codec<Round2Info>::put_varint(my_rd2.SHAHash.size(), piece);
+		piece += my_rd2.SHAHash;
+		stage.run([piece, &stream, &sink]() { sink(stream.write(piece, Z_FINISH)); });
+		stage.wait();
+	}
+
+	// the shared chunks next to new chunks, which both parties have; chunk(i) gives the
+	// contents of the i-th chunk of the counterparty's file, if it exists
+	template <typename chunk_func>
+	static std::string new_chunk_dictionary(const std::vector<bool>& chunk_exists, chunk_func chunk) {
+		std::string dictionary;
+		size_t last_added = (size_t) -1;
+		for(size_t i = 0; i < chunk_exists.size() && dictionary.size() < max_dictionary_size; ++i) {
+			if( chunk_exists[i] ) {
+				continue;
+			}
+			if( i > 0 && chunk_exists[i-1] && last_added != i-1 ) {
+				dictionary += chunk(i-1);
+				last_added = i-1;
+			}
+			if( i + 1 < chunk_exists.size() && chunk_exists[i+1] ) {
+				dictionary += chunk(i+1);
+				last_added = i+1;
+			}
+		}
+		if( dictionary.size() > max_dictionary_size ) {
+			dictionary.resize(max_dictionary_size);
+		}
+		return dictionary;
+	}
+
+	// replaces the new chunks with one deflated stream, if that is shorter
+	static void pack_new_chunk_info(Round2Info& rd2, const std::string& dictionary) {
+		std::string contents;
+		for(auto it = rd2.new_chunk_info.begin(); it != rd2.new_chunk_info.end(); ++it) {
+			contents += *it;
+		}
+		rd2.packed_contents = compress_with_dictionary(contents, dictionary);
+		if( rd2.packed_contents.size() >= contents.size() ) {
+			rd2.packed_contents.clear();
+		}
+	}
+
+	// restores the new chunks from the deflated stream, whose lengths are already known
+	static void unpack_new_chunk_info(Round2Info& rd2, const std::string& dictionary) {
+		std::string contents = decompress_with_dictionary(rd2.packed_contents, dictionary);
+		size_t pos = 0;
+		for(auto it = rd2.new_chunk_info.begin(); it != rd2.new_chunk_info.end(); ++it) {
+			if( contents.size() - pos < it->size() ) {
+				throw std::runtime_error("Packed new chunks are shorter than their lengths");
+			}
+			it->assign(contents, pos, it->size());
+			pos += it->size();
+		}
+		rd2.packed_contents.clear();
+	}
+
+  	bool receive_IBLT(iblt_type& cp_IBLT, const frame_sink& sink = frame_sink()) {
 		if( !get_distinct_keys(cp_IBLT) ) {
 			return false;
 		};
 
 		std::vector<hash_type> cp_sorted_hashes;
 		get_counterparty_hashes(cp_sorted_hashes);
-		determine_chunk_encoding(cp_sorted_hashes);
+		determine_chunk_encoding(cp_sorted_hashes, sink);
 		return true;
   	}
-	//TODO: should be function defined within oi?
-	void fill_OverlapInfo(std::unordered_set<hash_type> shared_hashes, std::vector<char>& buf) {
-		for(auto it = shared_hashes.begin(); it != shared_hashes.end(); ++it) {
-			assert(my_rd1.hashes_to_poslen.find(*it) != my_rd1.hashes_to_poslen.end());
-			std::pair<size_t, size_t> poslen = my_rd1.hashes_to_poslen[*it];
-			size_t len = poslen.second;
-			if (*it != my_rd1.hashes[my_rd1.hashes.size() - 1].first) { //ensure not last element
-				len += overlap;
-			}
-			assert( len >= overlap ); //TODO: Be careful about last element
-			SYNC_DEBUG("len " << len << " pos " << poslen.first);
-			std::string contents(&(buf.data()[poslen.first]), len);
-			std::string start_chars = contents.substr(0, overlap);
-			std::string end_chars = contents.substr(len-overlap, overlap);
-			insert_to_map<std::string, hash_type>(start_chars, *it, oi.start_to_hashes);
-			insert_to_map<std::string, hash_type>(end_chars, *it, oi.end_to_hashes);
-			
-			oi.hash_to_start[*it] = start_chars;
-			oi.hash_to_end[*it] = end_chars;
-		}
-		//sort each section
-		sort_mapping(oi.start_to_hashes);
-		sort_mapping(oi.end_to_hashes);
-		fill_hash_char_pos(oi.start_to_hashes, oi.hash_to_start_index);
-		fill_hash_char_pos(oi.end_to_hashes, oi.hash_to_end_index);
-		assert( shared_hashes.size() == oi.hash_to_start_index.size());
-		assert( shared_hashes.size() == oi.hash_to_end_index.size());
-	}  	
-
-	void fill_hash_char_pos( std::unordered_map<std::string, std::vector<hash_type> >& chars_map,
-				 std::unordered_map<hash_type, int>& hash_char_pos) {
-		for(auto it = chars_map.begin(); it != chars_map.end(); ++it ) {
-			for(size_t i = 0; i < it->second.size(); ++i) {
-				hash_char_pos[(it->second)[i]] = i;
-			}
-		}
-	}
-	
-	template <typename first_type, typename second_type>
-	void sort_mapping(std::unordered_map<first_type, std::vector<second_type> >& mapping) {
-		for(auto it = mapping.begin(); it != mapping.end(); ++it) {
-			//std::cout << "Sorting " << it->first << " with size" << it->second.size() << std::endl;
-			std::sort(it->second.begin(), it->second.end());
-		}
-	}
-
-	template <typename first_type, typename second_type>
-	void insert_to_map(first_type& chars, second_type val, 
-                       std::unordered_map<first_type, std::vector<second_type> >& mapping) {
-		if( mapping.find(chars) == mapping.end() ) {
-			mapping[chars];
-		}
-		mapping[chars].push_back(val);
-	}
-
-  	void reconstruct_file(Round2Info& cp_rd2) {
-		std::string tempfile("tmp/temp.txt");
-  		FILE* fp = fopen(tempfile.c_str(), "w");
-		if( !fp ) {
-            std::cout << "Unable to open file" << std::endl;
-			exit(1);
-		}
-
-		std::vector<char> buf;
-		load_buffer_with_file(file, buf);
-
-		//get my hashes in order
-		std::vector<hash_type> ordered_hashes;
-		for(auto it = my_rd1.hashes_to_poslen.begin(); it != my_rd1.hashes_to_poslen.end(); ++it) {
-			ordered_hashes.push_back(it->first);
-		}
-		
-		//get only the shared hashes
-		assert(cp_rd2.hash_exists.size() == ordered_hashes.size());
+	// positions where my segments start
+	std::vector<size_t> my_segment_starts() const {
+		size_t total_size = 0;
+		for(auto it = my_rd1.hashes.begin(); it != my_rd1.hashes.end(); ++it) {
+			total_size += it->second;
+		}
+		return segment_starts(segment_sizes, total_size);
+	}
+
+	// a chunk's key covers up to overlap bytes after it, but none past the end of its segment,
+	// so both parties see the same characters for the same key. These are the key of its first
+	// overlap of those bytes, and of the bytes after it
+	uint64_t start_key(const char* data, size_t pos, size_t len, const std::vector<size_t>& starts) const {
+		size_t ext = std::min(overlap, *std::upper_bound(starts.begin(), starts.end(), pos) - (pos + len));
+		return OverlapInfo::key(data + pos, std::min(overlap, len + ext));
+	}
+
+	uint64_t end_key(const char* data, size_t pos, size_t len, const std::vector<size_t>& starts) const {
+		size_t ext = std::min(overlap, *std::upper_bound(starts.begin(), starts.end(), pos) - (pos + len));
+		return OverlapInfo::key(data + pos + len, ext);
+	}
+
+	// sorts the shared hashes by the key of their start bytes, on several threads. Only needed
+	// while round 2 is encoded or resolved, so it is cleared right after
+	void fill_OverlapInfo(const FlatHashSet<hash_type>& shared_hashes, const char* data) {
+		std::vector<size_t> starts = my_segment_starts();
+		const ChunkIndex<hash_type>& index = my_rd1.hashes_to_poslen;
+		std::vector<typename OverlapInfo::entry_type>& by_start = oi.by_start;
+		std::vector<char> is_shared(index.size());
+		parallel_for(index.size(), num_threads, min_parallel_chunks, [&](size_t begin, size_t end) {
+			for(size_t i = begin; i < end; ++i) {
+				is_shared[i] = shared_hashes.count(index.entry(i).first);
+			}
+		});
+		//entries hold their place in the index until their key is known, so the array never
+		//grows past the shared hashes
+		by_start.clear();
+		by_start.reserve(shared_hashes.size());
+		for(size_t i = 0; i < index.size(); ++i) {
+			if( is_shared[i] ) {
+				by_start.push_back(std::make_pair((uint64_t) i, index.entry(i).first));
+			}
+		}
+		//walking the index in order keeps the reads from data ordered by hash, not scattered
+		parallel_for(by_start.size(), num_threads, min_parallel_chunks, [&](size_t begin, size_t end) {
+			for(size_t i = begin; i < end; ++i) {
+				const std::pair<size_t, size_t>& poslen = index.entry(by_start[i].first).second;
+				by_start[i].first = start_key(data, poslen.first, poslen.second, starts);
+			}
+		});
+		parallel_sort(by_start.begin(), by_start.end(), num_threads, min_parallel_chunks);
+		assert( shared_hashes.size() == by_start.size() );
+	}
+
+	bool reconstruct_file(Round2Info& cp_rd2, const std::string& output_file) {
+		return resolve_chunks(cp_rd2) && write_reconstruction(cp_rd2, output_file);
+	}
+
+	// writes the counterparty's version of the file to out_fd, starting at its current offset,
+	// if it matches the counterparty's Merkle root
+	bool reconstruct_file(Round2Info& cp_rd2, int out_fd) {
+		return resolve_chunks(cp_rd2) && write_reconstruction(cp_rd2, out_fd);
+	}
+
+	// writes the chunks resolved by resolve_chunks to output_file. If that is my own file, it is
+	// patched in place, since truncating it would lose the chunks still to be copied from it
+	bool write_reconstruction(const Round2Info& cp_rd2, const std::string& output_file) {
+		struct stat my_st, out_st;
+		if( !in_memory && stat(file.c_str(), &my_st) == 0 && stat(output_file.c_str(), &out_st) == 0
+            && my_st.st_dev == out_st.st_dev && my_st.st_ino == out_st.st_ino ) {
+			return write_reconstruction_in_place(cp_rd2, (size_t) 1 << 26);
+		}
+		int out_fd = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if( out_fd < 0 ) {
+			std::cerr << "Unable to open file " << output_file << std::endl;
+			return false;
+		}
+		bool res = write_reconstruction(cp_rd2, out_fd);
+		close(out_fd);
+		return res;
+	}
+
+	// writes the chunks resolved by resolve_chunks to out_fd, and lets go of the shared chunks
+	bool write_reconstruction(const Round2Info& cp_rd2, int out_fd) {
+		//positioned asynchronous writes only pay off on regular files
+		ChunkIO io(io_queue_depth);
+		struct stat st;
+		ChunkIO* out_io = (io.async() && fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode)) ? &io : NULL;
+		if( in_memory ) {
+			FileChunkWriter writer(out_fd, contents.data(), -1, out_io);
+			write_chunks(cp_rd2, writer);
+			return writer.finish();
+		}
+		int src_fd = open(file.c_str(), O_RDONLY);
+		FileChunkWriter writer(out_fd, local_source(cp_rd2), src_fd, out_io);
+		write_chunks(cp_rd2, writer);
+		bool res = writer.finish();
+		if( src_fd >= 0 ) {
+			close(src_fd);
+		}
+		shared_chunks.reset();
+		return res;
+	}
+
+	// turns my file into the counterparty's version in place, writing only the chunks that moved
+	// or are new. If breaking cycles of moves needs more than max_scratch bytes, a new copy is
+	// written next to the file and renamed over it instead
+	bool reconstruct_in_place(Round2Info& cp_rd2, size_t max_scratch = (size_t) 1 << 26) {
+		if( in_memory ) {
+			std::cerr << "In place reconstruction needs a file" << std::endl;
+			return false;
+		}
+		//checked before anything is overwritten
+		return resolve_chunks(cp_rd2) && write_reconstruction_in_place(cp_rd2, max_scratch);
+	}
+
+	bool write_reconstruction_in_place(const Round2Info& cp_rd2, size_t max_scratch) {
+		shared_chunks.reset(); //the patch reads what it moves from the file itself
+		InPlacePatch patch;
+		write_chunks(cp_rd2, patch);
+		int fd = open(file.c_str(), O_RDWR);
+		if( fd < 0 ) {
+			std::cerr << "Unable to open file " << file << std::endl;
+			return false;
+		}
+		bool res;
+		if( patch.plan(max_scratch) ) {
+			res = patch.apply(fd);
+		} else {
+			std::string tempfile = file + ".sync";
+			int out_fd = open(tempfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			res = out_fd >= 0 && patch.write_copy(fd, out_fd);
+			if( out_fd >= 0 ) {
+				close(out_fd);
+			}
+			res = res && rename(tempfile.c_str(), file.c_str()) == 0;
+			if( !res ) {
+				unlink(tempfile.c_str());
+			}
+		}
+		close(fd);
+		if( !res ) {
+			std::cerr << "Unable to write reconstructed file " << file << std::endl;
+		}
+		return res;
+	}
+
+	// passes the counterparty's version of the contents to writer, chunk by chunk, if it
+	// matches the counterparty's Merkle root; src holds my contents
+	template <typename writer_type>
+	bool reconstruct(Round2Info& cp_rd2, const char* src, writer_type& writer) {
+		if( !resolve_chunks(cp_rd2, src) ) {
+			return false;
+		}
+		write_chunks(cp_rd2, writer);
+		return true;
+	}
+
+	bool resolve_chunks(Round2Info& cp_rd2) {
+		shared_chunks.reset();
+		return resolve_chunks(cp_rd2, local_source(cp_rd2));
+	}
+
+	// finds each of the counterparty's chunks that I have in my contents src and unpacks the
+	// new ones, filling local_chunks, then checks them with check_chunks
+	bool resolve_chunks(Round2Info& cp_rd2, const char* src) {
+		locate_chunks(cp_rd2, src);
+		if( !cp_rd2.packed_contents.empty() ) {
+			unpack_new_chunk_info(cp_rd2, local_dictionary(cp_rd2, src));
+		}
+		return check_chunks(cp_rd2, src);
+	}
+
+	// fills local_chunks with where the counterparty's chunks are in my contents src, or
+	// which of the new chunks they are
+	void locate_chunks(const Round2Info& cp_rd2, const char* src) {
+		//get only the shared hashes; my index is already in sorted order
+		if( cp_rd2.hash_exists.size() != my_rd1.hashes_to_poslen.size() ) {
+			throw std::runtime_error("Round 2 message flags a different number of hashes than I have");
+		}
 		auto it1 = cp_rd2.hash_exists.begin();
-		auto it2 = ordered_hashes.begin();
+		auto it2 = my_rd1.hashes_to_poslen.begin();
 		for(; it1 != cp_rd2.hash_exists.end(); ++it1, ++it2) {
 			if( *it1 ) {
-				shared_keys.insert(*it2);
+				shared_keys.insert(it2->first);
 			}
 		}
-		fill_OverlapInfo(shared_keys, buf);
-
-		size_t new_chunk = 0;
-		size_t existing_chunk = 0;
+		fill_OverlapInfo(shared_keys, src);
 
+		local_chunks.assign(cp_rd2.chunk_exists.size(), std::make_pair((size_t) 0, (size_t) 0));
+		size_t existing_chunk = 0, new_chunk = 0;
 		bool last_chunk_exists = false;
-		hash_type last_hash;
-		for(auto it = cp_rd2.chunk_exists.begin(); it != cp_rd2.chunk_exists.end(); ++it) {
-			if(*it) { // if I already have the chunk somewhere, then all I need to do is find it using the encoding
-				size_t existing_chunk_hash_index = cp_rd2.existing_chunk_encoding[existing_chunk];
-				hash_type relevant_hash;
-				if( last_chunk_exists ) {
-					relevant_hash = oi.start_to_hashes[oi.hash_to_end[last_hash]][existing_chunk_hash_index];
-				} else {
-					relevant_hash = ordered_hashes[existing_chunk_hash_index];
+		std::vector<size_t> starts = segment_starts(cp_segment_sizes, (size_t) -1);
+		std::vector<size_t> my_starts = my_segment_starts();
+		auto next_start = starts.begin();
+		size_t chunk_pos = 0;
+		for(size_t i = 0; i < cp_rd2.chunk_exists.size(); ++i) {
+			while( next_start != starts.end() && *next_start <= chunk_pos ) {
+				if( *next_start++ == chunk_pos ) {
+					last_chunk_exists = false;
 				}
-				last_chunk_exists = true;
-				last_hash = relevant_hash;
-				std::pair<size_t, size_t> chunk_info = my_rd1.hashes_to_poslen[relevant_hash];
-				fwrite(&(buf.data()[chunk_info.first]), 1, chunk_info.second, fp);
-				SYNC_DEBUG("I already have chunk starting at pos " << chunk_info.first 
-                           << " with len " << chunk_info.second);
-				++existing_chunk;
-			} else { // otherwise I need to read it from the passed in structure
-				fwrite(cp_rd2.new_chunk_info[new_chunk].c_str(), 1, 
-                       cp_rd2.new_chunk_info[new_chunk].size(), fp);
-				SYNC_DEBUG("I need new chunk with contents" << cp_rd2.new_chunk_info[new_chunk] 
-                           << " with len " << cp_rd2.new_chunk_info[new_chunk].size());
-				++new_chunk;
+			}
+			if( !cp_rd2.chunk_exists[i] ) {
 				last_chunk_exists = false;
+				local_chunks[i] = std::make_pair(new_chunk, cp_rd2.new_chunk_info[new_chunk].size());
+				chunk_pos += local_chunks[i].second;
+				++new_chunk;
+				continue;
 			}
+			// if I already have the chunk somewhere, then all I need to do is find it using the encoding
+			size_t existing_chunk_hash_index = cp_rd2.existing_chunk_encoding[existing_chunk];
+			if( last_chunk_exists ) {
+				const std::pair<size_t, size_t>& last = local_chunks[i-1];
+				uint64_t last_end = end_key(src, last.first, last.second, my_starts);
+				local_chunks[i] = my_rd1.hashes_to_poslen.at(oi.hash_in_run(last_end, existing_chunk_hash_index));
+			} else {
+				if( existing_chunk_hash_index >= my_rd1.hashes_to_poslen.size() ) {
+					throw std::runtime_error("Round 2 message refers to a chunk I do not have");
+				}
+				local_chunks[i] = my_rd1.hashes_to_poslen.entry(existing_chunk_hash_index).second;
+			}
+			last_chunk_exists = true;
+			++existing_chunk;
+			chunk_pos += local_chunks[i].second;
+		}
+		oi.clear();
+	}
+
+	// the dictionary the counterparty deflated its new chunks against, once they are located
+	std::string local_dictionary(const Round2Info& cp_rd2, const char* src) const {
+		return new_chunk_dictionary(cp_rd2.chunk_exists, [&](size_t i) {
+			return std::string(src + local_chunks[i].first, local_chunks[i].second);
+		});
+	}
+
+	bool check_chunks(const Round2Info& cp_rd2) {
+		return check_chunks(cp_rd2, local_source(cp_rd2));
+	}
+
+	// hashes the located chunks into chunk_tree, on several threads, and checks them against the
+	// counterparty's root before anything is written; on a mismatch the descent to the chunks
+	// that differ is started
+	bool check_chunks(const Round2Info& cp_rd2, const char* src) {
+		chunk_tree.build(local_chunks.size(), [&](size_t i) {
+			if( cp_rd2.chunk_exists[i] ) {
+				return std::make_pair(src + local_chunks[i].first, local_chunks[i].second);
+			}
+			return std::make_pair((const char*) cp_rd2.new_chunk_info[local_chunks[i].first].data(),
+                                  local_chunks[i].second);
+		}, num_threads);
+		descent = MerkleDescent();
+		if( chunk_tree.root() != cp_rd2.SHAHash ) {
+			std::cerr << "Reconstructed file does not match the counterparty's Merkle root" << std::endl;
+			descent.start(chunk_tree);
+			return false;
 		}
-		fclose(fp);
-		assert( get_SHAHash(tempfile) == cp_rd2.SHAHash );
+		return true;
+	}
 
+	// passes the chunks resolved by resolve_chunks to writer
+	template <typename writer_type>
+	void write_chunks(const Round2Info& cp_rd2, writer_type& writer) const {
+		for(size_t i = 0; i < cp_rd2.chunk_exists.size(); ++i) {
+			if( cp_rd2.chunk_exists[i] ) {
+				writer.add_local(local_chunks[i].first, local_chunks[i].second);
+				SYNC_DEBUG("I already have chunk starting at pos " << local_chunks[i].first 
+                           << " with len " << local_chunks[i].second);
+			} else { // otherwise I need to read it from the passed in structure
+				writer.add_literal(cp_rd2.new_chunk_info[local_chunks[i].first]);
+				SYNC_DEBUG("I need new chunk with contents" << cp_rd2.new_chunk_info[local_chunks[i].first] 
+                           << " with len " << local_chunks[i].second);
+			}
+		}
   	}
 };
 
 template <typename hash_type, typename iblt_type>
 class FileSynchronizer<hash_type, iblt_type>::OverlapInfo {
   public:
-        //mapping from first/last "overlap" chars to the sorted list of corresponding hashes
-  	std::unordered_map<std::string, std::vector<hash_type> > start_to_hashes, end_to_hashes;	
-	//mapping from hash to start and end chars
-	std::unordered_map<hash_type, std::string> hash_to_start, hash_to_end;
-	//mapping from hash to index within start_to_hashes and end_to_hashes resp
-	std::unordered_map<hash_type, int> hash_to_start_index, hash_to_end_index;
+	typedef std::pair<uint64_t, hash_type> entry_type; //key of the start bytes, hash
+	//the shared hashes sorted by the key of their start bytes, then by hash, so hashes with the
+	//same start bytes form a sorted run; 16 bytes per shared chunk for 64-bit hashes
+	std::vector<entry_type> by_start;
+
+	// a fixed size key for up to overlap bytes: the count of bytes in the top byte and the bytes
+	// themselves below it, or a hash of them if there are more than fit. Both parties key the
+	// same bytes the same way, so a hash collision only merges two runs
+	static uint64_t key(const char* chars, size_t len) {
+		uint64_t res = 0;
+		if( len <= 7 ) {
+			for(size_t i = 0; i < len; ++i) {
+				res |= (uint64_t) (unsigned char) chars[i] << 8*i;
+			}
+		} else {
+			res = HashUtil::MurmurHash64A(chars, len, 0) & (((uint64_t) 1 << 56) - 1);
+		}
+		return res | (uint64_t) len << 56;
+	}
+
+	// index of hash within the run of hashes whose start bytes have start_key
+	size_t index_in_run(uint64_t start_key, hash_type hash) const {
+		auto run = std::lower_bound(by_start.begin(), by_start.end(), start_key,
+                                    [](const entry_type& e, uint64_t k) { return e.first < k; });
+		return std::lower_bound(run, by_start.end(), std::make_pair(start_key, hash)) - run;
+	}
 
+	// the index-th hash of the run of hashes whose start bytes have start_key
+	hash_type hash_in_run(uint64_t start_key, size_t index) const {
+		auto run = std::lower_bound(by_start.begin(), by_start.end(), start_key,
+                                    [](const entry_type& e, uint64_t k) { return e.first < k; });
+		if( (size_t) (by_start.end() - run) <= index || run[index].first != start_key ) {
+			throw std::runtime_error("Round 2 message refers to a chunk I do not have");
+		}
+		return run[index].second;
+	}
+
+	void clear() {
+		std::vector<entry_type>().swap(by_start);
+	}
 };
 
 template <typename hash_type, typename iblt_type>
@@ -405,10 +1446,12 @@ class FileSynchronizer<hash_type, iblt_type>::Round1Info {
 	StrataEstimator<hash_type> estimator;
     //hash and length
     std::vector<std::pair<hash_type, size_t> > hashes; //hash and length
-  	//mapping from hash to position in file and length
-    std::map<hash_type, std::pair<size_t, size_t> > hashes_to_poslen;
+  	//mapping from hash to position in file and length, sorted by hash
+    ChunkIndex<hash_type> hashes_to_poslen;
     iblt_type* iblt;
 
+	Round1Info(): iblt(NULL) {}
+
   	~Round1Info() {
   		delete iblt;
   	}
@@ -421,8 +1464,9 @@ class FileSynchronizer<hash_type, iblt_type>::Round2Info {
 	std::vector<bool> chunk_exists;  //for each chunk B has, whether A has
 	std::vector<bool> hash_exists; //for each hash A has, whether B has (this is in sorted order)
 	std::vector<std::string> new_chunk_info; //length and contents of each chunk that A doesn't have
-	std::vector<uint32_t> existing_chunk_encoding; //index of chunk hash within client's 
-	std::string SHAHash;
+	std::vector<uint64_t> existing_chunk_encoding; //index of chunk hash within client's 
+	std::string packed_contents; //new chunks deflated against shared ones, or empty if sent as is
+	std::string SHAHash; //root of the Merkle tree over the chunks
 
 	size_t size_in_bits() { // in bits
 		size_t tot_bits = 0;
@@ -431,56 +1475,15 @@ class FileSynchronizer<hash_type, iblt_type>::Round2Info {
 		for(auto it = new_chunk_info.begin(); it != new_chunk_info.end(); ++it) {
 			tot_bits += it->size()*8;
 		}
-		tot_bits += existing_chunk_encoding.size() * sizeof(uint32_t)* 8;
+		tot_bits += existing_chunk_encoding.size() * sizeof(uint64_t)* 8;
 		return tot_bits;
 	}
 
-	void serialize(file_sync::Round2& rd2) {
-		for(auto it = chunk_exists.begin(); it != chunk_exists.end(); ++it) {
-			rd2.add_chunk_exists(*it);
-		}
-		
-		for(auto it = hash_exists.begin(); it != hash_exists.end(); ++it) {
-			rd2.add_hash_exists(*it);
-		}
-
-		for(auto it = new_chunk_info.begin(); it != new_chunk_info.end(); ++it) {
-			rd2.add_new_chunk_info(*it);
-		}
-
-		for(auto it = existing_chunk_encoding.begin(); it != existing_chunk_encoding.end(); ++it) {
-			rd2.add_existing_chunk_encoding(*it);
-		}
-		
-		rd2.set_shahash(SHAHash);
-	}
-
-	void deserialize(file_sync::Round2& rd2) {
-		for(int i = 0; i < rd2.chunk_exists_size(); ++i) {
-			chunk_exists.push_back(rd2.chunk_exists(i));
-		}
-	
-		for(int i = 0; i < rd2.hash_exists_size(); ++i) {
-			hash_exists.push_back(rd2.hash_exists(i));
-		}
-		
-		
-		for(int i = 0; i < rd2.new_chunk_info_size(); ++i) {
-			new_chunk_info.push_back(rd2.new_chunk_info(i));
-		}
-
-		for(int i = 0; i < rd2.existing_chunk_encoding_size(); ++i) {
-			existing_chunk_encoding.push_back(rd2.existing_chunk_encoding(i));
-		}
-
-		SHAHash = rd2.shahash(); 
-	}
-
 	void print_size_info() const {
 		std::cout << "Chunk exists has            " << chunk_exists.size() << " bools" << std::endl;
 		std::cout << "Hash exists has            " << hash_exists.size() << " bools" << std::endl;
 		std::cout << "New chunk info has          " << new_chunk_info.size() << " strings" << std::endl;
-		std::cout << "Existing chunk encoding has " << existing_chunk_encoding.size() << " uint32_ts" << std::endl;
+		std::cout << "Existing chunk encoding has " << existing_chunk_encoding.size() << " uint64_ts" << std::endl;
 	}
 };
 
@@ -1,5 +1,6 @@
 #include "file_sync.hpp"
 #include "file_sync.pb.h"
+#include "multilevel_sync.hpp"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -14,7 +15,46 @@ namespace po = boost::program_options;
 Json::Value info;
 Json::StyledWriter writer;
 
-void testFullProtocol(std::string& file1, std::string& file2, int avg_block_size) {
+void fillProtocolInfo(std::string& file1, std::string& file2, size_t avg_block_size, 
+                      size_t diff_est, size_t total_bytes_no_strata, size_t total_bytes);
+
+//IBLTs B fails to peel before giving up
+const int max_iblt_retries = 5;
+//scales the difference estimate before sizing the first IBLT; below 1 to exercise retries
+double iblt_scale = 1;
+
+// the adaptive mode: both parties chunk at a probe block size and B picks the block size from
+// the strata round of that first pass; returns the bytes that took
+template <typename fsync_type>
+size_t probeBlockSize(fsync_type& file_sync_A, fsync_type& file_sync_B, size_t& diff_est) {
+	std::string probe_encoding = file_sync_A.send_probe_encoding();
+	std::string reply = file_sync_B.receive_probe_encoding(probe_encoding);
+	file_sync_A.receive_probe_reply(reply, diff_est);
+	info["probe_difference_estimate"] = Json::Value((Json::UInt64) diff_est);
+	return probe_encoding.size() + reply.size();
+}
+
+// party A fetches the chunks it rebuilt wrong from B, descending B's Merkle tree to find them
+template <typename fsync_type>
+bool repairFile(fsync_type& file_sync_A, fsync_type& file_sync_B, const std::string& output_file,
+                size_t& repair_bytes) {
+	while( !file_sync_A.bad_chunks_found() ) {
+		std::string request = file_sync_A.send_tree_request();
+		std::string nodes = file_sync_B.send_tree_nodes(request);
+		repair_bytes += request.size() + nodes.size();
+		if( !file_sync_A.receive_tree_nodes(nodes) ) {
+			return false;
+		}
+	}
+	std::string request = file_sync_A.send_chunk_request();
+	std::string chunks = file_sync_B.send_chunks(request);
+	repair_bytes += request.size() + chunks.size();
+	return file_sync_A.receive_chunks(chunks, output_file);
+}
+
+// with adaptive, avg_block_size is the probe block size
+void testFullProtocol(std::string& file1, std::string& file2, size_t avg_block_size,
+                      const std::string& output_file, bool adaptive) {
 	typedef uint64_t hash_type;
 	typedef FileSynchronizer<hash_type> fsync_type;
 	
@@ -22,31 +62,106 @@ void testFullProtocol(std::string& file1, std::string& file2, int avg_block_size
 
 	//Determine estimated file difference
 	fsync_type file_sync_A(file1, avg_block_size), file_sync_B(file2, avg_block_size);
-	std::string strata_encoding = file_sync_A.send_strata_encoding();
-	int diff_est = file_sync_B.receive_strata_encoding(strata_encoding);
-	std::string iblt_encoding = file_sync_A.send_IBLT_encoding(diff_est);
-	std::string rd2_encoding = file_sync_B.receive_IBLT_encoding(iblt_encoding);
-	file_sync_A.receive_rd2_encoding(rd2_encoding);
+	size_t diff_est, strata_bytes;
+	if( adaptive ) {
+		strata_bytes = probeBlockSize(file_sync_A, file_sync_B, diff_est);
+	} else {
+		std::string strata_encoding = file_sync_A.send_strata_encoding();
+		diff_est = file_sync_B.receive_strata_encoding(strata_encoding);
+		strata_bytes = strata_encoding.size();
+	}
+	size_t total_bytes_no_strata = 0;
+	int iblt_retries = 0;
+	std::string rd2_encoding;
+	size_t iblt_estimate = diff_est * iblt_scale;
+	while( true ) {
+		std::string iblt_encoding = file_sync_A.send_IBLT_encoding(iblt_estimate);
+		total_bytes_no_strata += iblt_encoding.size();
+		if( file_sync_B.receive_IBLT_encoding(iblt_encoding, rd2_encoding) ) {
+			break;
+		}
+		if( ++iblt_retries > max_iblt_retries ) {
+			std::cerr << "Failed to peel after " << max_iblt_retries << " retries" << std::endl;
+			exit(1);
+		}
+		iblt_estimate = file_sync_B.retry_estimate();
+	}
+	size_t repair_bytes = 0;
+	if( !file_sync_A.receive_rd2_encoding(rd2_encoding, output_file)
+        && !(file_sync_A.needs_repair() && repairFile(file_sync_A, file_sync_B, output_file, repair_bytes)) ) {
+		std::cerr << "Failed to reconstruct " << file2 << std::endl;
+		exit(1);
+	}
 	
-	int total_bytes_no_strata = iblt_encoding.size() + rd2_encoding.size();
-	int total_bytes = total_bytes_no_strata + strata_encoding.size();
-	int file1_size = boost::filesystem::file_size(file1);
-	int file2_size = boost::filesystem::file_size(file2); 
-
-	std::vector<char> buf;
-	load_buffer_with_file(file1, buf);
-	std::string file1_string(buf.data(), file1_size);
-	buf.clear();
-	load_buffer_with_file(file2, buf);
-	std::string file2_string(buf.data(), file2_size);
-	buf.clear();
-	std::string file1_compressed = compress_string(file1_string);
-	std::string file2_compressed = compress_string(file2_string);
+	total_bytes_no_strata += rd2_encoding.size() + repair_bytes;
+	size_t total_bytes = total_bytes_no_strata + strata_bytes;
+	fillProtocolInfo(file1, file2, file_sync_B.avg_block_size, diff_est, total_bytes_no_strata, total_bytes);
+	info["iblt_retries"] = Json::Value(iblt_retries);
+	info["repair_bytes"] = Json::Value((Json::UInt64) repair_bytes);
+}
+
+void testMultiLevelProtocol(std::string& file1, std::string& file2, size_t avg_block_size, int num_levels,
+                            const std::string& output_file) {
+	typedef uint64_t hash_type;
+	typedef MultiLevelSynchronizer<hash_type> msync_type;
+
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	msync_type file_sync_A(file1, avg_block_size, num_levels), file_sync_B(file2, avg_block_size, num_levels);
+	size_t total_bytes_no_strata = 0, total_bytes = 0, diff_est = 0;
+	int levels_used = 0, iblt_retries = 0;
+	bool done = false;
+	while( !done ) {
+		std::string strata_encoding = file_sync_A.send_strata_encoding();
+		size_t level_diff_est = file_sync_B.receive_strata_encoding(strata_encoding);
+		total_bytes += strata_encoding.size();
+		std::string rd2_encoding;
+		size_t iblt_estimate = level_diff_est;
+		while( true ) {
+			std::string iblt_encoding = file_sync_A.send_IBLT_encoding(iblt_estimate);
+			total_bytes_no_strata += iblt_encoding.size();
+			total_bytes += iblt_encoding.size();
+			if( file_sync_B.receive_IBLT_encoding(iblt_encoding, rd2_encoding) ) {
+				break;
+			}
+			if( ++iblt_retries > max_iblt_retries ) {
+				std::cerr << "Failed to peel after " << max_iblt_retries << " retries" << std::endl;
+				exit(1);
+			}
+			iblt_estimate = file_sync_B.retry_estimate();
+		}
+		if( !file_sync_A.receive_rd2_encoding(rd2_encoding, output_file) ) {
+			std::cerr << "Failed to reconstruct " << file2 << std::endl;
+			exit(1);
+		}
+		done = file_sync_A.done();
+
+		if( levels_used == 0 ) {
+			diff_est = level_diff_est;
+		}
+		++levels_used;
+		total_bytes_no_strata += rd2_encoding.size();
+		total_bytes += rd2_encoding.size();
+	}
+	fillProtocolInfo(file1, file2, avg_block_size, diff_est, total_bytes_no_strata, total_bytes);
+	Json::Value levels(levels_used);
+	info["levels_used"] = levels;
+	info["iblt_retries"] = Json::Value(iblt_retries);
+}
+
+void fillProtocolInfo(std::string& file1, std::string& file2, size_t avg_block_size, 
+                      size_t diff_est, size_t total_bytes_no_strata, size_t total_bytes) {
+	//the files are mapped and compressed as a stream, so they need not fit in memory
+	MappedFile mf1(file1), mf2(file2);
+	size_t file1_size = mf1.size, file2_size = mf2.size;
+	size_t file1_compressed = compressed_size(mf1.data, mf1.size);
+	size_t file2_compressed = compressed_size(mf2.data, mf2.size);
 	
-	Json::Value block_size(avg_block_size);
-	Json::Value diff(diff_est), tot_no_strata(total_bytes_no_strata), tot_with_strata(total_bytes);
-	Json::Value f1_sz(file1_size), f2_sz(file2_size);
-	Json::Value f1_szc((int) file1_compressed.size()), f2_szc((int) file2_compressed.size());
+	Json::Value block_size((Json::UInt64) avg_block_size);
+	Json::Value diff((Json::UInt64) diff_est), tot_no_strata((Json::UInt64) total_bytes_no_strata);
+	Json::Value tot_with_strata((Json::UInt64) total_bytes);
+	Json::Value f1_sz((Json::UInt64) file1_size), f2_sz((Json::UInt64) file2_size);
+	Json::Value f1_szc((Json::UInt64) file1_compressed), f2_szc((Json::UInt64) file2_compressed);
 	info["block_size"] = block_size;
 	info["difference_estimate"] = diff;
 	info["total_bytes_no_strata"] = tot_no_strata;
@@ -87,21 +202,26 @@ void testRsync(std::string& file1, std::string& file2, int block_size) {
 
 
 int main(int argc, char* argv[]) {
-	std::string f1, f2;
+	std::string f1, f2, output_file;
 	double error_prob;
-	int block_changes, block_changes_size, file_len, avg_block_size;
-	bool use_rsync;
+	int block_changes, block_changes_size, num_levels;
+	size_t file_len, avg_block_size;
+	bool use_rsync, adaptive;
 	
 	po::options_description desc("Allowed options");
 	desc.add_options()
 		("help", "produce help message")
 		("f1", po::value<std::string>(&f1)->default_value("A/f1.txt"), "First file name")
 		("f2", po::value<std::string>(&f2)->default_value("B/f1.txt"), "Second file name")
-		("file-len", po::value<int>(&file_len)->default_value(100000), "File length")
+		("output", po::value<std::string>(&output_file)->default_value("tmp/temp.txt"), "Reconstructed file name")
+		("file-len", po::value<size_t>(&file_len)->default_value(100000), "File length")
 		("error-prob", po::value<double>(&error_prob), "random error probability")
 		("num-changes", po::value<int>(&block_changes), "number of block changes")
 		("change-size", po::value<int>(&block_changes_size)->default_value(5), "size of block changes")
-		("block-size", po::value<int>(&avg_block_size)->default_value(700), "avg block size")
+		("block-size", po::value<size_t>(&avg_block_size)->default_value(700), "avg block size")
+		("adaptive", po::value<bool>(&adaptive)->default_value(false), "pick the block size from a first pass")
+		("levels", po::value<int>(&num_levels)->default_value(1), "number of chunking levels")
+		("iblt-scale", po::value<double>(&iblt_scale)->default_value(1), "scale of the first IBLT relative to the estimate")
 		("rsync", po::value<bool>(&use_rsync)->default_value(false), "whether to include rsync data")
 	;
 
@@ -115,14 +235,14 @@ int main(int argc, char* argv[]) {
 	}
 
 	if(vm.count("error-prob")) {
-		Json::Value test_type("random"), file_length(file_len), error_probability(error_prob);
+		Json::Value test_type("random"), file_length((Json::UInt64) file_len), error_probability(error_prob);
 		info["test_type"] = test_type;
 		info["file_length"] = file_length;
 		info["error_prob"] = error_probability;
 		generate_random_file(f1, file_len);
 		generate_similar_file(f1, f2, 1-error_prob);
 	} else if( vm.count("num-changes") ) {
-		Json::Value test_type("block"), file_length(file_len), num_block_changes(block_changes);
+		Json::Value test_type("block"), file_length((Json::UInt64) file_len), num_block_changes(block_changes);
 		info["test_type"] = test_type;
 		info["file_length"] = file_length;
 		info["num_block_changes"] = num_block_changes;
@@ -136,7 +256,28 @@ int main(int argc, char* argv[]) {
 		info["file2"] = file2;
 	}
 
-	testFullProtocol(f1, f2, avg_block_size);
+	if( adaptive ) {
+		avg_block_size = FileSynchronizer<uint64_t>::get_probe_block_size(get_file_size(f1));
+		info["probe_block_size"] = Json::Value((Json::UInt64) avg_block_size);
+	}
+
+	if( num_levels > 1 ) {
+		size_t probe_bytes = 0;
+		if( adaptive ) {
+			//the levels are chunked at the block size picked by a probe of their own
+			FileSynchronizer<uint64_t> probe_A(f1, avg_block_size), probe_B(f2, avg_block_size);
+			size_t probe_diff;
+			probe_bytes = probeBlockSize(probe_A, probe_B, probe_diff);
+			avg_block_size = probe_B.avg_block_size;
+		}
+		testMultiLevelProtocol(f1, f2, avg_block_size, num_levels, output_file);
+		if( adaptive ) {
+			info["probe_bytes"] = Json::Value((Json::UInt64) probe_bytes);
+			info["total_bytes_with_strata"] = Json::Value(info["total_bytes_with_strata"].asUInt64() + probe_bytes);
+		}
+	} else {
+		testFullProtocol(f1, f2, avg_block_size, output_file, adaptive);
+	}
 
 	if( use_rsync ) {
 		testRsync(f1, f2, avg_block_size);
@@ -25,6 +25,172 @@ class FingerprintTester {
           "compared to theoretical " << (double) 1.0/avg_block_size << std::endl; 
 	}
 
+	// the original winnowing, which rescans the whole window whenever its minimum leaves it
+	size_t rescanWinnow(const std::string& filename, 
+                        std::vector<std::pair<hash_type, size_t> >& hashes) {
+		size_t w = 2*avg_block_size - 1;
+		std::vector<hash_type> h(w, (hash_type) (-1));
+		RollingHash<hash_type> hasher(f.kgrams);
+		size_t file_size = hasher.load_file(filename);
+		size_t min = 0;
+		for(size_t r = 1; r + w < file_size; ++r) {
+			h[r % w] = hasher.next_hash();
+			if( (min % w) == (r % w) ) {
+				for( size_t j = 1; j < w; ++j ) {
+					if( h[(r - j + w) % w] < h[min % w] ) {
+						min = r - j;
+					}
+				}
+				if( (min % w) == (r % w ))
+					min = r;
+				hashes.push_back(std::make_pair(h[min % w], min));
+			} else if( h[r % w] <= h[min % w] ) {
+				min = r;
+				hashes.push_back(std::make_pair(h[min % w], min));
+			}
+		}
+		return file_size;
+	}
+
+	// FastCDC chunks must cover the file, respect the size bounds and survive an insertion
+	void fastcdcTest(const std::string& f1, const std::string& f2) {
+		typedef Fingerprinter<hash_type> fp_type;
+		fp_type cdc(avg_block_size, FASTCDC);
+		typename fp_type::FastCDCParams params(avg_block_size);
+		std::vector<std::pair<hash_type, size_t> > hashes1, hashes2;
+		size_t file_size = cdc.digest_file(f1, hashes1);
+		cdc.digest_file(f2, hashes2);
+
+		size_t total_len = 0;
+		for(size_t i = 0; i < hashes1.size(); ++i) {
+			assert( hashes1[i].second <= params.max_size );
+			assert( i == hashes1.size() - 1 || hashes1[i].second > params.min_size );
+			total_len += hashes1[i].second;
+		}
+		assert( total_len == file_size );
+
+		std::unordered_set<hash_type> hash_set1, hash_set2, hash_intersection;
+		filterHashes(hashes1, hash_set1);
+		filterHashes(hashes2, hash_set2);
+		kh.set_intersection(hash_set1, hash_set2, hash_intersection);
+		std::cout << "FastCDC average chunk length " << (double) file_size/hashes1.size() 
+                  << " for block size " << avg_block_size << ", "
+                  << hash_intersection.size() << " of " << hashes1.size() 
+                  << " chunks shared with the similar file" << std::endl;
+	}
+
+	// digest computed the old way: fingerprint the whole file, then hash blocks from a second copy
+	void bufferDigest(Fingerprinter<hash_type>& fp, const std::string& filename, size_t overlap_len,
+                      std::vector<std::pair<hash_type, size_t> >& file_hashes) {
+		std::vector<std::pair<hash_type, size_t> > fp_hashes;
+		size_t file_size = fp.get_fingerprint(filename, fp_hashes);
+		fp_hashes.push_back(std::make_pair(-1, file_size));
+		std::vector<char> buf;
+		load_buffer_with_file(filename, buf);
+		size_t curr_pos = 0;
+		for(size_t i = 0; i < fp_hashes.size(); ++i) {
+			size_t curr_len = fp_hashes[i].second - curr_pos;
+			size_t len_plus_offset = (i == fp_hashes.size() - 1) ? curr_len : curr_len + overlap_len;
+			file_hashes.push_back(std::make_pair(
+                HashUtil::MurmurHash64A(&buf[curr_pos], len_plus_offset, 0), curr_len));
+			curr_pos += curr_len;
+		}
+	}
+
+	void streamingDigestTest(const std::string& filename) {
+		const ChunkingMethod methods[] = { WINNOWING, MODDING, FASTCDC };
+		for(size_t m = 0; m < 3; ++m) {
+			Fingerprinter<hash_type> fp(avg_block_size, methods[m]);
+			std::vector<std::pair<hash_type, size_t> > expected, actual;
+			bufferDigest(fp, filename, 3, expected);
+			fp.digest_file(filename, actual, 3);
+			assert( expected == actual );
+		}
+		std::cout << "Streaming digests match whole file digests for " << filename << std::endl;
+	}
+
+	// chunking on several threads must give exactly the sequential result, also when
+	// segments are shorter than a chunk
+	void parallelTest(const std::string& filename, size_t num_threads) {
+		const ChunkingMethod methods[] = { WINNOWING, MODDING, FASTCDC };
+		for(size_t m = 0; m < 3; ++m) {
+			Fingerprinter<hash_type> sequential(avg_block_size, methods[m]);
+			Fingerprinter<hash_type> parallel(avg_block_size, methods[m], num_threads);
+			parallel.min_parallel_size = 0;
+			std::vector<std::pair<hash_type, size_t> > expected, actual;
+			sequential.get_fingerprint(filename, expected);
+			parallel.get_fingerprint(filename, actual);
+			assert( expected == actual );
+
+			expected.clear();
+			actual.clear();
+			sequential.digest_file(filename, expected, 3);
+			parallel.digest_file(filename, actual, 3);
+			assert( expected == actual );
+		}
+		std::cout << "Chunking " << filename << " on " << num_threads 
+                  << " threads matches sequential chunking" << std::endl;
+	}
+
+	// the multi-lane kernel must agree with rolling one byte at a time, whatever the batch
+	// sizes, and both with hashing each k-gram from scratch
+	void rollingKernelTest(const std::string& filename) {
+		RollingHash<hash_type> scalar(f.kgrams), batched(f.kgrams);
+		size_t file_size = scalar.load_file(filename);
+		batched.load_file(filename);
+		std::vector<hash_type> out(file_size);
+		const size_t batch_sizes[] = { 1, 3, 9, 321, 4096, 65536 };
+		size_t pos = 0;
+		for(size_t b = 0; pos < file_size; ++b) {
+			size_t n = std::min(batch_sizes[b % 6], file_size - pos);
+			batched.next_hashes(n, out.data() + pos);
+			pos += n;
+		}
+		for(size_t i = 0; i < file_size; ++i) {
+			assert( out[i] == scalar.next_hash() );
+			if( i + 1 >= f.kgrams ) {
+				assert( out[i] == scalar.hash(scalar.buf.data() + i + 1 - f.kgrams, f.kgrams - 1) );
+			}
+		}
+		std::cout << "Multi-lane rolling hashes match for " << filename << std::endl;
+	}
+
+	// blocks digested with 128 bits are keyed by the low bits of their digest, and the
+	// parallel digest finds the same keys and key collisions as the streaming one
+	void digest128Test(const std::string& filename) {
+		Fingerprinter<hash_type> sequential(avg_block_size), parallel(avg_block_size, WINNOWING, 4);
+		sequential.digest = MURMUR128;
+		parallel.digest = MURMUR128;
+		parallel.min_parallel_size = 0;
+		std::vector<std::pair<hash_type, size_t> > expected, actual;
+		sequential.digest_file(filename, expected, 3);
+		parallel.digest_file(filename, actual, 3);
+		assert( expected == actual );
+		assert( sequential.key_collisions == parallel.key_collisions );
+
+		std::vector<char> buf;
+		load_buffer_with_file(filename, buf);
+		size_t curr_pos = 0;
+		for(size_t i = 0; i < expected.size(); ++i) {
+			size_t len = (i == expected.size() - 1) ? expected[i].second : expected[i].second + 3;
+			Hash128 full = HashUtil::MurmurHash3_x64_128(&buf[curr_pos], len, 0);
+			assert( expected[i].first == (hash_type) full.low );
+			(void) full;
+			curr_pos += expected[i].second;
+		}
+		std::cout << "128-bit digests of " << expected.size() << " blocks agree, "
+                  << sequential.key_collisions << " key collisions" << std::endl;
+	}
+
+	void winnowTest(const std::string& filename) {
+		std::vector<std::pair<hash_type, size_t> > expected, actual;
+		rescanWinnow(filename, expected);
+		f.winnow(filename, actual);
+		assert( expected == actual );
+		std::cout << "Winnowing picked the same " << actual.size() 
+                  << " fingerprints as rescanning for " << filename << std::endl;
+	}
+
 	// filters out just the first component of the pair<hash_type, size_t>
 	void filterHashes( std::vector<std::pair<hash_type, size_t> >& hashes, 
                        std::unordered_set<hash_type>& hash_set) {
@@ -84,6 +250,15 @@ class FingerprintTester {
 };
 
 
+// low entropy file that repeats the same short pattern, the worst case for rescanning
+void generate_periodic_file(const std::string& filename, size_t len, size_t period) {
+	FILE* fp = fopen(filename.c_str(), "w");
+	for(size_t i = 0; i < len; ++i) {
+		fputc('a' + (i % period), fp);
+	}
+	fclose(fp);
+}
+
 int main() {
 	typedef uint32_t hash_type;
     
@@ -96,10 +271,29 @@ int main() {
     generate_random_file(file1, file_len);
     FingerprintTester<hash_type> ft(avg_block_size);
 	ft.basicTest(file1);
+	ft.winnowTest(file1);
+	ft.rollingKernelTest(file1);
 	
     generate_similar_file(file1, file2, similarity);
 	ft.comparisonTest(file1, file2);
 	ft.fileDigest(file1);
 	ft.fileDigestComparison(file1, file2);
+	ft.fastcdcTest(file1, file2);
+
+	const std::string file3 = "tmp3.txt";
+	generate_periodic_file(file3, file_len, 7);
+	ft.winnowTest(file3);
+
+	const std::string file4 = "tmp4.txt";
+	generate_random_file(file4, 3*FileWindow::read_size + 12345);
+	ft.streamingDigestTest(file4);
+	ft.parallelTest(file4, 8);
+	ft.parallelTest(file1, 3);
+	ft.parallelTest(file3, 7);
+	ft.digest128Test(file4);
+
+	const std::string file5 = "tmp5.txt";
+	generate_random_file(file5, 20000);
+	ft.parallelTest(file5, 64);
 	return 1;
 }
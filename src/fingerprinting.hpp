@@ -4,28 +4,41 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <algorithm>
 #include <cstdlib>
+#include <deque>
+#include <unordered_map>
+#include <thread>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
 
 #include "hash_util.hpp"
 #include "IBLT_helpers.hpp"
 
-#define FINGERPRINT_DEBUG 1
+// checks that blocks digested with MURMUR64 that share a key have the same contents, which
+// keeps a copy of every block in memory; for debugging only, e.g. with -DFINGERPRINT_DEBUG=1
+#ifndef FINGERPRINT_DEBUG
+#define FINGERPRINT_DEBUG 0
+#endif
 
 template <typename hash_type = uint64_t>
 class RollingHash {
   public:
   	static const uint32_t p = 77711;
+	static const size_t num_lanes = 8;
   	size_t kgrams;
   	std::vector<char> buf;
   	size_t size;
   	size_t curr_pos;
   	hash_type last_hash;
+	hash_type pow_k; //p^kgrams, the weight of the byte leaving the k-gram
 
-  	RollingHash(size_t kgrams): kgrams(kgrams), size(0), curr_pos(0), last_hash(0) {}
+  	RollingHash(size_t kgrams): kgrams(kgrams), size(0), curr_pos(0), last_hash(0) {
+		pow_k = (hash_type) myPow(p, kgrams);
+	}
   	~RollingHash() {
   		cleanup();
   	}
@@ -53,18 +66,74 @@ class RollingHash {
 	}
 
 	hash_type next_hash() {
+		return next_hash(buf.data() + curr_pos);
+	}
+
+	// same as next_hash(), but reads the byte at curr_pos from curr instead of buf. The kgrams
+	// bytes before curr (all of them, at the start of the file) must also be readable
+	hash_type next_hash(const char* curr) {
 		hash_type ret;
 		if( curr_pos < kgrams )
-			ret = hash(buf.data(), curr_pos);
+			ret = hash(curr - curr_pos, curr_pos);
 		else
-			ret = hash(last_hash, buf[curr_pos-kgrams], buf[curr_pos]);
+			ret = hash(last_hash, *(curr - kgrams), *curr);
 		last_hash = ret;
 		++curr_pos;
 		return ret;
 	}
 
+	void next_hashes(size_t n, hash_type* out) {
+		next_hashes(buf.data() + curr_pos, n, out);
+	}
+
+	/* Same as n calls to next_hash(curr + i), storing the hashes in out. The range is split into
+	 * num_lanes contiguous lanes; every lane but the first starts from a k-gram hashed from
+	 * scratch, and the lanes are then rolled forward together. The lanes do not depend on each
+	 * other, so the multiply-subtract chains overlap (and can be vectorized) instead of every
+	 * byte waiting on the hash of the byte before it.
+	 */
+	void next_hashes(const char* curr, size_t n, hash_type* out) {
+		size_t i = 0;
+		// prefixes shorter than a k-gram, at the start of the file, are hashed one at a time
+		for(; i < n && curr_pos < kgrams; ++i) {
+			out[i] = next_hash(curr + i);
+		}
+		size_t lane_len = (n - i) / num_lanes;
+		if( lane_len >= 4*kgrams ) {
+			hash_type h[num_lanes];
+			const char* newc[num_lanes];
+			const char* prevc[num_lanes];
+			hash_type* lane_out[num_lanes];
+			for(size_t l = 0; l < num_lanes; ++l) {
+				newc[l] = curr + i + l*lane_len;
+				prevc[l] = newc[l] - kgrams;
+				lane_out[l] = out + i + l*lane_len;
+				h[l] = (l == 0) ? last_hash : hash(prevc[l], kgrams - 1);
+			}
+			for(size_t j = 0; j < lane_len; ++j) {
+				for(size_t l = 0; l < num_lanes; ++l) {
+					h[l] = h[l]*p - (hash_type) prevc[l][j] * pow_k + (hash_type) newc[l][j];
+					lane_out[l][j] = h[l];
+				}
+			}
+			i += num_lanes*lane_len;
+			curr_pos += num_lanes*lane_len;
+			last_hash = out[i - 1];
+		}
+		for(; i < n; ++i) {
+			out[i] = next_hash(curr + i);
+		}
+	}
+
+	// positions the hasher so that next_hash(curr) returns the hash for the byte at pos,
+	// without rolling over everything before it
+	void seek(const char* curr, size_t pos) {
+		curr_pos = pos;
+		last_hash = (pos < kgrams) ? 0 : hash(curr - kgrams, kgrams - 1);
+	}
+
 	// for first few hashes (before we have a full kgram)
-	hash_type hash(char* substr, size_t n) {
+	hash_type hash(const char* substr, size_t n) {
 		hash_type ret = 0;
 		assert( n <= kgrams - 1);
 		for(size_t i = 0; i <= n; ++i) {
@@ -76,10 +145,204 @@ class RollingHash {
 
 	// once we have full k-gram, can use faster method
 	hash_type hash(hash_type curr_hash, char prevc, char newc) {
-		return (hash_type) (curr_hash*p - prevc*myPow(p, kgrams) + newc);
+		return (hash_type) (curr_hash*p - (hash_type) prevc*pow_k + (hash_type) newc);
 	}
 };
 
+/** GearHash is the rolling hash behind FastCDC. Every byte shifts the hash left by one
+ ** and adds a random 64-bit value for that byte, so bit i only depends on the last i+1 bytes
+ ** and no byte ever has to be subtracted out. It can also be used as a Fingerprinter hasher_type.
+ **/
+template <typename hash_type = uint64_t>
+class GearHash {
+  public:
+	size_t kgrams;
+	std::vector<char> buf;
+	size_t size;
+	size_t curr_pos;
+	uint64_t last_hash;
+
+	struct gear_table {
+		uint64_t values[256];
+
+		//fixed seed, since both parties need the same table
+		gear_table() {
+			uint64_t x = 0x2545F4914F6CDD1DULL;
+			for(size_t i = 0; i < 256; ++i) {
+				//splitmix64
+				uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+				values[i] = z ^ (z >> 31);
+			}
+		}
+	};
+
+	GearHash(size_t kgrams): kgrams(kgrams), size(0), curr_pos(0), last_hash(0) {}
+
+	static const uint64_t* table() {
+		static const gear_table gt;
+		return gt.values;
+	}
+
+	static uint64_t roll(const uint64_t* gear, uint64_t curr_hash, char newc) {
+		return (curr_hash << 1) + gear[(unsigned char) newc];
+	}
+
+  	size_t load_file(const std::string& filename) {
+  		cleanup();
+  		size = load_buffer_with_file(filename, buf);
+  		return size;
+	}
+
+	void cleanup() {
+		buf.clear();
+		curr_pos = 0;
+		last_hash = 0;
+		size = 0;
+	}
+
+	hash_type next_hash() {
+		return next_hash(buf.data() + curr_pos);
+	}
+
+	// bytes more than 64 back have been shifted out, so only those need to be rolled over
+	void seek(const char* curr, size_t pos) {
+		size_t start = (pos < 64) ? 0 : pos - 64;
+		const uint64_t* gear = table();
+		curr_pos = pos;
+		last_hash = 0;
+		for(size_t i = start; i < pos; ++i) {
+			last_hash = roll(gear, last_hash, *(curr - (pos - i)));
+		}
+	}
+
+	hash_type next_hash(const char* curr) {
+		last_hash = roll(table(), last_hash, *curr);
+		++curr_pos;
+		return (hash_type) last_hash;
+	}
+
+	void next_hashes(size_t n, hash_type* out) {
+		next_hashes(buf.data() + curr_pos, n, out);
+	}
+
+	void next_hashes(const char* curr, size_t n, hash_type* out) {
+		const uint64_t* gear = table();
+		uint64_t h = last_hash;
+		for(size_t i = 0; i < n; ++i) {
+			h = roll(gear, h, curr[i]);
+			out[i] = (hash_type) h;
+		}
+		last_hash = h;
+		curr_pos += n;
+	}
+};
+
+/** Winnower selects fingerprints from a stream of hashes, one hash at a time. It keeps the
+ ** candidate minima of the last w hashes as (hash, index) pairs, with increasing indices and
+ ** strictly increasing hashes, so its front is always the rightmost minimal hash in the window.
+ ** Each hash is pushed and popped at most once. The slot before the first hash starts out as
+ ** the maximal hash.
+ **/
+template <typename hash_type>
+class Winnower {
+  public:
+	size_t w;
+	std::deque<std::pair<hash_type, size_t> > window;
+	size_t min; //index of minimal hash in window
+
+	Winnower(size_t w): w(w), min(0) {
+		window.push_back(std::make_pair((hash_type) (-1), 0));
+	}
+
+	// adds the hash with index r (starting from 1). Returns true and sets fingerprint
+	// when a new minimum is recorded, either because the previous one left the window
+	// or because the new hash is at least as small as it
+	bool push(hash_type next_hash, size_t r, std::pair<hash_type, size_t>& fingerprint) {
+		while( !window.empty() && window.back().first >= next_hash ) {
+			window.pop_back();
+		}
+		window.push_back(std::make_pair(next_hash, r));
+		while( window.front().second + w <= r ) {
+			window.pop_front();
+		}
+		if( min + w == r || window.front().second == r ) {
+			min = window.front().second;
+			fingerprint = window.front();
+			return true;
+		}
+		return false;
+	}
+};
+
+/** FileWindow reads a file front to back into a bounded buffer. Callers say which bytes they
+ ** still need, and everything before that is dropped before the next read.
+ **/
+class FileWindow {
+  public:
+	static const size_t read_size = 1 << 20;
+	FILE* fp;
+	std::vector<char> buf;
+	size_t base; //file offset of buf[0]
+	size_t file_size;
+
+	FileWindow(const std::string& filename): base(0) {
+		file_size = get_file_size(filename);
+		fp = fopen(filename.c_str(), "r");
+		if( !fp ) {
+			throw std::runtime_error("Unable to open file " + filename);
+		}
+	}
+
+	~FileWindow() {
+		fclose(fp);
+	}
+
+	size_t end() const {
+		return base + buf.size();
+	}
+
+	const char* at(size_t pos) const {
+		return buf.data() + (pos - base);
+	}
+
+	// makes sure the bytes before pos_end (or the end of the file) are buffered,
+	// discarding the ones before keep_from if more have to be read
+	void fill(size_t pos_end, size_t keep_from) {
+		if( pos_end > file_size ) {
+			pos_end = file_size;
+		}
+		if( pos_end <= end() ) {
+			return;
+		}
+		if( keep_from > base ) {
+			buf.erase(buf.begin(), buf.begin() + (keep_from - base));
+			base = keep_from;
+		}
+		size_t to_read = pos_end - end();
+		if( to_read < read_size ) {
+			to_read = read_size;
+		}
+		if( to_read > file_size - end() ) {
+			to_read = file_size - end();
+		}
+		size_t old_size = buf.size();
+		buf.resize(old_size + to_read);
+		size_t num_read = fread(buf.data() + old_size, 1, to_read, fp);
+		if( num_read != to_read ) {
+			throw std::runtime_error("File shrank while reading it");
+		}
+	}
+};
+
+enum ChunkingMethod { WINNOWING, MODDING, FASTCDC };
+
+// how blocks are hashed by digest_file. MURMUR128 keys blocks by the low bits of a 128-bit
+// digest and checks the full digests of blocks sharing a key while the file is digested, so
+// distinct blocks sharing a key are noticed without holding on to their contents
+enum DigestMethod { MURMUR64, MURMUR128 };
+
 /** Fingerprinter is used to generate sets of (hash, file_pos) pairs that are a small 
  ** representation of the file. It can further digest those pairs to create a 
  ** set of hashes that represents the file
@@ -89,45 +352,58 @@ class Fingerprinter {
   public:
 	const size_t kgrams = 10;
   	size_t avg_block_size;
-    std::vector<hash_type> h;
+	ChunkingMethod method;
+	DigestMethod digest;
+	size_t num_threads;
+	size_t min_parallel_size; //smaller files are always chunked on one thread
+	static const size_t hash_batch = 4096; //per-byte hashes are computed this many at a time
   	hasher_type hasher;
+	size_t key_collisions; //distinct blocks that got the same key, with MURMUR128
 	
-	Fingerprinter(size_t block_size): avg_block_size(block_size), hasher(kgrams) {}
+	Fingerprinter(size_t block_size): 
+                  avg_block_size(block_size), method(WINNOWING), digest(MURMUR64),
+                  num_threads(1), min_parallel_size(1 << 22), hasher(kgrams), key_collisions(0) {}
+
+	Fingerprinter(size_t block_size, ChunkingMethod method): 
+                  avg_block_size(block_size), method(method), digest(MURMUR64),
+                  num_threads(1), min_parallel_size(1 << 22), hasher(kgrams), key_collisions(0) {}
+
+	Fingerprinter(size_t block_size, ChunkingMethod method, size_t num_threads): 
+                  avg_block_size(block_size), method(method), digest(MURMUR64),
+                  num_threads(num_threads), min_parallel_size(1 << 22), hasher(kgrams), key_collisions(0) {}
+
+	bool use_threads(size_t file_size) const {
+		return num_threads > 1 && file_size >= min_parallel_size;
+	}
+
+	// number of per-byte hashes winnowing or modding look at
+	size_t num_hashes(size_t file_size) const {
+		size_t w = 2*avg_block_size - 1;
+		if( method == MODDING ) {
+			return file_size;
+		}
+		return (file_size > w) ? file_size - w - 1 : 0;
+	}
 
   	// uses winnowing to determine set of hashes for file
   	// returns the size of the hashed file
 	size_t winnow(const std::string& filename, 
                   std::vector<std::pair<hash_type, size_t> >& hashes) {
 		size_t w = 2*avg_block_size - 1;
-		
-		h.resize(w);
-
-		for(size_t i = 0; i < w; ++i) {
-			h[i] = (hash_type) (-1);
+		size_t file_size = hasher.load_file(filename);
+		if( file_size <= w ) {
+			return file_size;
 		}
 
-		size_t file_size = hasher.load_file(filename);
-		
-        int min = 0; //index of minimal hash in window
-		for(size_t r = 1; r < file_size - w; ++r) {
-			h[r % w] = hasher.next_hash();
-			if( (min % w) == (r % w) ) {
-				/* the previous minimum is no longer in this window. Scan h leftward
-				 * starting from r for the rightmost hash for the rightmost minimal hash. 
-				 * Note min starts with the index of the rightmost hash 
-				 */
-				for( size_t j = 1; j < w; ++j ) {
-					if( h[(r - j + w) % w] < h[min % w] ) {
-						min = r - j;
-					}
-				}
-				if( (min % w) == (r % w )) /*account for case where none smaller than new hash*/
-					min = r;
-				hashes.push_back(std::make_pair(h[min % w], min));
-			} else {
-				if( h[r % w] <= h[min % w] ) {
-					min = r;
-					hashes.push_back(std::make_pair(h[min % w], min));
+		Winnower<hash_type> winnower(w);
+		std::pair<hash_type, size_t> fingerprint;
+		std::vector<hash_type> batch(hash_batch);
+		for(size_t r = 1; r < file_size - w; r += hash_batch) {
+			size_t n = std::min((size_t) hash_batch, file_size - w - r);
+			hasher.next_hashes(n, batch.data());
+			for(size_t j = 0; j < n; ++j) {
+				if( winnower.push(batch[j], r + j, fingerprint) ) {
+					hashes.push_back(fingerprint);
 				}
 			}
 		}
@@ -138,18 +414,237 @@ class Fingerprinter {
                    std::vector<std::pair<hash_type, size_t> >& hashes) {
 		size_t p = avg_block_size;
 		size_t file_size = hasher.load_file(filename);
-		for(size_t i = 0; i < file_size; ++i) {
-			hash_type next_hash = hasher.next_hash();
-			if( next_hash % p == 0) {
-				hashes.push_back(std::make_pair(next_hash, i));
+		std::vector<hash_type> batch(hash_batch);
+		for(size_t i = 0; i < file_size; i += hash_batch) {
+			size_t n = std::min((size_t) hash_batch, file_size - i);
+			hasher.next_hashes(n, batch.data());
+			for(size_t j = 0; j < n; ++j) {
+				if( batch[j] % p == 0) {
+					hashes.push_back(std::make_pair(batch[j], i + j));
+				}
 			}
 		}
 		return file_size;
 	}
 
+	/* FastCDC content defined chunking with normalized chunk sizes. Cut points are searched
+	 * with a gear hash starting min_size bytes into each chunk, using a harder mask before
+	 * the average block size and an easier one after it, and chunks are cut at max_size.
+	 */
+	class FastCDCParams {
+	  public:
+		size_t min_size, normal_size, max_size;
+		uint64_t mask_s, mask_l;
+
+		FastCDCParams(size_t avg_block_size): 
+                      min_size(avg_block_size/4), 
+                      normal_size(avg_block_size), 
+                      max_size(8*avg_block_size) {
+			int bits = 0;
+			while( ((size_t) 2 << bits) <= avg_block_size ) {
+				++bits;
+			}
+			mask_s = top_bits(bits + 2);
+			mask_l = top_bits(bits > 2 ? bits - 2 : 1);
+		}
+
+		//gear hashes mix best in their high bits
+		static uint64_t top_bits(int n) {
+			return (n >= 64) ? (uint64_t) -1 : (((uint64_t) 1 << n) - 1) << (64 - n);
+		}
+
+		// returns the length of the chunk starting at data, given n bytes remain in the file
+		size_t cut(const uint64_t* gear, const char* data, size_t n, uint64_t& fp) const {
+			fp = 0;
+			if( n <= min_size ) {
+				return n;
+			}
+			size_t end = (n < max_size) ? n : max_size;
+			size_t normal = (end < normal_size) ? end : normal_size;
+			size_t i = min_size;
+			for(; i < normal; ++i) {
+				fp = GearHash<hash_type>::roll(gear, fp, data[i]);
+				if( !(fp & mask_s) ) {
+					return i + 1;
+				}
+			}
+			for(; i < end; ++i) {
+				fp = GearHash<hash_type>::roll(gear, fp, data[i]);
+				if( !(fp & mask_l) ) {
+					return i + 1;
+				}
+			}
+			return end;
+		}
+	};
+
+	size_t fastcdc(const std::string& filename, 
+                   std::vector<std::pair<hash_type, size_t> >& hashes) {
+		FastCDCParams params(avg_block_size);
+		const uint64_t* gear = GearHash<hash_type>::table();
+		size_t file_size = hasher.load_file(filename);
+		const char* data = hasher.buf.data();
+		size_t curr_pos = 0;
+		while( curr_pos < file_size ) {
+			uint64_t fp;
+			curr_pos += params.cut(gear, data + curr_pos, file_size - curr_pos, fp);
+			if( curr_pos < file_size ) { //end of file is not a cut point
+				hashes.push_back(std::make_pair((hash_type) fp, curr_pos));
+			}
+		}
+		return file_size;
+	}
+
+	/* The parallel chunker splits the file into one segment per thread. Winnowing and modding
+	 * decisions only depend on the last w hashes, so each thread first replays the w hashes
+	 * before its segment and then finds exactly the fingerprints the sequential pass would.
+	 * FastCDC cut points depend on where the previous chunk started, so each thread chains
+	 * chunks from the start of its segment, and the seams are resynchronized afterwards.
+	 */
+	void fingerprint_segment(const char* data, size_t begin, size_t end,
+                             std::vector<std::pair<hash_type, size_t> >& hashes) {
+		hasher_type seg_hasher(kgrams);
+		std::vector<hash_type> batch(hash_batch);
+		if( method == MODDING ) {
+			seg_hasher.seek(data + begin, begin);
+			for(size_t i = begin; i < end; i += hash_batch) {
+				size_t n = std::min((size_t) hash_batch, end - i);
+				seg_hasher.next_hashes(data + i, n, batch.data());
+				for(size_t j = 0; j < n; ++j) {
+					if( batch[j] % avg_block_size == 0 ) {
+						hashes.push_back(std::make_pair(batch[j], i + j));
+					}
+				}
+			}
+			return;
+		}
+
+		size_t w = 2*avg_block_size - 1;
+		size_t warm_start = (begin > w) ? begin - w : 0;
+		Winnower<hash_type> winnower(w);
+		std::pair<hash_type, size_t> fingerprint;
+		seg_hasher.seek(data + warm_start, warm_start);
+		for(size_t i = warm_start; i < begin; ++i) {
+			winnower.push(seg_hasher.next_hash(data + i), i + 1, fingerprint);
+		}
+		if( warm_start > 0 ) {
+			winnower.min = winnower.window.front().second;
+		}
+		for(size_t i = begin; i < end; i += hash_batch) {
+			size_t n = std::min((size_t) hash_batch, end - i);
+			seg_hasher.next_hashes(data + i, n, batch.data());
+			for(size_t j = 0; j < n; ++j) {
+				if( winnower.push(batch[j], i + j + 1, fingerprint) ) {
+					hashes.push_back(fingerprint);
+				}
+			}
+		}
+	}
+
+	// chains FastCDC chunks from begin until the first cut point at or past end
+	void fastcdc_segment(const char* data, size_t file_size, size_t begin, size_t end,
+                         std::vector<std::pair<hash_type, size_t> >& cuts) {
+		FastCDCParams params(avg_block_size);
+		const uint64_t* gear = GearHash<hash_type>::table();
+		size_t curr_pos = begin;
+		while( true ) {
+			uint64_t fp;
+			curr_pos += params.cut(gear, data + curr_pos, file_size - curr_pos, fp);
+			if( curr_pos >= file_size ) {
+				return;
+			}
+			cuts.push_back(std::make_pair((hash_type) fp, curr_pos));
+			if( curr_pos >= end ) {
+				return;
+			}
+		}
+	}
+
+	// joins the per-segment FastCDC chains. The true chain is followed cut by cut until it
+	// lands on a cut point the next segment also found, from where the two agree
+	void stitch_fastcdc(const char* data, size_t file_size, const std::vector<size_t>& seg_starts,
+                        std::vector<std::vector<std::pair<hash_type, size_t> > >& seg_cuts,
+                        std::vector<std::pair<hash_type, size_t> >& hashes) {
+		FastCDCParams params(avg_block_size);
+		const uint64_t* gear = GearHash<hash_type>::table();
+		size_t curr_pos = 0;
+		for(size_t t = 0; t < seg_cuts.size() && curr_pos < file_size; ++t) {
+			size_t seg_end = (t + 1 < seg_starts.size()) ? seg_starts[t + 1] : file_size;
+			std::vector<std::pair<hash_type, size_t> >& cuts = seg_cuts[t];
+			while( curr_pos < seg_end ) {
+				// the segment's chain starts at seg_starts[t] and passes through each of its cuts
+				bool on_chain = (curr_pos == seg_starts[t]);
+				size_t next_cut = 0;
+				if( !on_chain ) {
+					auto it = std::lower_bound(cuts.begin(), cuts.end(), curr_pos,
+                        [](const std::pair<hash_type, size_t>& c, size_t pos) { return c.second < pos; });
+					on_chain = (it != cuts.end() && it->second == curr_pos);
+					next_cut = (it - cuts.begin()) + 1;
+				}
+				if( on_chain ) {
+					hashes.insert(hashes.end(), cuts.begin() + next_cut, cuts.end());
+					// a chain that stops short of the segment end ran into the end of the file
+					curr_pos = (cuts.empty() || cuts.back().second < seg_end) ? file_size : cuts.back().second;
+					break;
+				}
+				uint64_t fp;
+				curr_pos += params.cut(gear, data + curr_pos, file_size - curr_pos, fp);
+				if( curr_pos < file_size ) {
+					hashes.push_back(std::make_pair((hash_type) fp, curr_pos));
+				}
+			}
+		}
+	}
+
+	void parallel_fingerprint(const char* data, size_t file_size,
+                              std::vector<std::pair<hash_type, size_t> >& hashes) {
+		size_t num_positions = (method == FASTCDC) ? file_size : num_hashes(file_size);
+		size_t seg_len = (num_positions + num_threads - 1) / num_threads;
+		std::vector<size_t> seg_starts;
+		for(size_t start = 0; start < num_positions; start += seg_len) {
+			seg_starts.push_back(start);
+		}
+		std::vector<std::vector<std::pair<hash_type, size_t> > > seg_hashes(seg_starts.size());
+		std::vector<std::thread> threads;
+		for(size_t t = 0; t < seg_starts.size(); ++t) {
+			size_t begin = seg_starts[t];
+			size_t end = (begin + seg_len < num_positions) ? begin + seg_len : num_positions;
+			threads.push_back(std::thread([this, data, file_size, begin, end, t, &seg_hashes]() {
+				if( method == FASTCDC ) {
+					fastcdc_segment(data, file_size, begin, end, seg_hashes[t]);
+				} else {
+					fingerprint_segment(data, begin, end, seg_hashes[t]);
+				}
+			}));
+		}
+		for(auto it = threads.begin(); it != threads.end(); ++it) {
+			it->join();
+		}
+
+		if( method == FASTCDC ) {
+			stitch_fastcdc(data, file_size, seg_starts, seg_hashes, hashes);
+		} else {
+			for(auto it = seg_hashes.begin(); it != seg_hashes.end(); ++it) {
+				hashes.insert(hashes.end(), it->begin(), it->end());
+			}
+		}
+	}
+
 	size_t get_fingerprint(const std::string& filename, 
                            std::vector<std::pair<hash_type, size_t> >& hashes) {
-		return winnow(filename, hashes);
+		if( use_threads(get_file_size(filename)) ) {
+			MappedFile mf(filename);
+			parallel_fingerprint(mf.data, mf.size, hashes);
+			return mf.size;
+		}
+		switch( method ) {
+			case MODDING:
+				return modding(filename, hashes);
+			case FASTCDC:
+				return fastcdc(filename, hashes);
+			default:
+				return winnow(filename, hashes);
+		}
 	}
 
 	size_t digest_file(const std::string& filename, 
@@ -157,52 +652,215 @@ class Fingerprinter {
 		return digest_file(filename, file_hashes, 0);
 	}
 
+	// key of a block, as used by digest_file. With MURMUR128 the full digest is stored in full
+	// too, for check_key
+	hash_type block_key(const char* data, size_t len, Hash128& full) const {
+		if( digest == MURMUR128 ) {
+			full = HashUtil::MurmurHash3_x64_128(data, len, 0);
+			return (hash_type) full.low;
+		}
+		return HashUtil::MurmurHash64A(data, len, 0);
+	}
+
+	// with 128-bit digests, two blocks with the same key but different digests are a collision
+	// of the (truncated) key, which is counted instead of comparing block contents
+	void check_key(std::unordered_map<hash_type, Hash128>& key_to_digest, 
+                   hash_type key, const Hash128& full) {
+		auto res = key_to_digest.insert(std::make_pair(key, full));
+		if( !res.second && res.first->second != full ) {
+			++key_collisions;
+		}
+	}
+
+#if FINGERPRINT_DEBUG
+	void check_collision(std::unordered_map<hash_type, std::string>& hash_to_string,
+                         const std::pair<hash_type, size_t>& curr_pair, const char* data) {
+		std::string curr_string(data, curr_pair.second);
+		if( hash_to_string.find(curr_pair.first) != hash_to_string.end() 
+            && hash_to_string[curr_pair.first] != curr_string) {
+			std::cout << "Uh oh, different contents have the same hash" \
+                      << "need to use a hash with more bytes" << std::endl;
+			std::cout << "Same hash for " << curr_string 
+                      << " and " << hash_to_string[curr_pair.first] << std::endl;
+			throw std::runtime_error("Hash collision");
+		}
+		hash_to_string[curr_pair.first] = curr_string;
+	}
+#endif
+
 	// processes a file, returning a set of hashes of blocks and the corresponding block lengths
 	size_t digest_file(const std::string& filename, 
                        std::vector<std::pair<hash_type, size_t> >& file_hashes, 
                        size_t overlap_len) {
-        std::vector<std::pair<hash_type, size_t> > fp_hashes;
-		size_t file_size = get_fingerprint(filename, fp_hashes);
-		fp_hashes.push_back(std::make_pair(-1, file_size)); // add placeholder for end of file
-		
-		std::vector<char> buf;
-		load_buffer_with_file(filename, buf);
-
-		std::pair<hash_type, size_t> curr_pair;
+		if( use_threads(get_file_size(filename)) ) {
+			return parallel_digest(filename, file_hashes, overlap_len);
+		}
+		return digest_stream(filename, overlap_len, 
+                             [&file_hashes](const std::pair<hash_type, size_t>& chunk) {
+                                 file_hashes.push_back(chunk);
+                             });
+	}
+
+	/* Same as digest_file, but passes each (hash, length) pair to emit as soon as the block is
+	 * known. The file is read once, front to back, and cut points and block hashes are found in
+	 * the same pass, so memory stays bounded by the read size plus the longest block.
+	 */
+	template <typename callback_type>
+	size_t digest_stream(const std::string& filename, size_t overlap_len, callback_type emit) {
+		FileWindow fw(filename);
+		size_t file_size = fw.file_size;
+		size_t hash_start = 0; //start of the first block that has not been hashed yet
+		std::deque<size_t> cuts; //cut points found, but not hashed yet
+		std::unordered_map<hash_type, Hash128> key_to_digest;
+		key_collisions = 0;
 #if FINGERPRINT_DEBUG
 		std::unordered_map<hash_type, std::string> hash_to_string;
 #endif
-		size_t i = 0;
-		size_t curr_pos = 0;
-		for(; i < fp_hashes.size(); ++i) {	
-			size_t curr_len = fp_hashes[i].second - curr_pos;
-			size_t len_plus_offset = 
-                (i == (fp_hashes.size() - 1)) 
-                    ? curr_len 
-                    : (curr_len + overlap_len);
-			curr_pair = std::make_pair(
-                            HashUtil::MurmurHash64A(&buf[curr_pos], len_plus_offset, 0),
-                            curr_len);
+
+		// hash every pending block whose bytes, plus overlap, are all buffered
+		auto hash_blocks = [&](bool at_eof) {
+			while( !cuts.empty() ) {
+				size_t curr_len = cuts.front() - hash_start;
+				size_t len_plus_offset = curr_len + overlap_len;
+				if( hash_start + len_plus_offset > file_size ) {
+					len_plus_offset = file_size - hash_start;
+				}
+				if( !at_eof && hash_start + len_plus_offset > fw.end() ) {
+					return;
+				}
+				Hash128 full;
+				std::pair<hash_type, size_t> curr_pair = std::make_pair(
+                            block_key(fw.at(hash_start), len_plus_offset, full), curr_len);
+				if( digest == MURMUR128 ) {
+					check_key(key_to_digest, curr_pair.first, full);
+				}
 #if FINGERPRINT_DEBUG
-			std::string curr_string(&buf[curr_pos], curr_len);
-			if( hash_to_string.find(curr_pair.first) != hash_to_string.end() 
-                && hash_to_string[curr_pair.first] != curr_string) {
-				std::cout << "Uh oh, different contents have the same hash" \
-                          << "need to use a hash with more bytes" << std::endl;
-				std::cout << "Same hash for " << curr_string 
-                          << " and " << hash_to_string[curr_pair.first] << std::endl;
-				exit(1);
-			}
-			hash_to_string[curr_pair.first] = curr_string;
+				else {
+					check_collision(hash_to_string, curr_pair, fw.at(hash_start));
+				}
 #endif
-			file_hashes.push_back(curr_pair);
-			curr_pos += curr_len;
+				emit(curr_pair);
+				hash_start = cuts.front();
+				cuts.pop_front();
+			}
+		};
+
+		hasher.cleanup();
+		if( method == FASTCDC ) {
+			FastCDCParams params(avg_block_size);
+			const uint64_t* gear = GearHash<hash_type>::table();
+			size_t curr_pos = 0;
+			while( curr_pos < file_size ) {
+				fw.fill(curr_pos + params.max_size, hash_start);
+				uint64_t fp;
+				curr_pos += params.cut(gear, fw.at(curr_pos), file_size - curr_pos, fp);
+				if( curr_pos < file_size ) {
+					cuts.push_back(curr_pos);
+					hash_blocks(false);
+				}
+			}
+		} else {
+			// both winnowing and modding look at one hash per byte; the hasher needs the
+			// kgrams bytes before the current one
+			size_t num_positions = num_hashes(file_size);
+			Winnower<hash_type> winnower(2*avg_block_size - 1);
+			std::pair<hash_type, size_t> fingerprint;
+			std::vector<hash_type> batch(hash_batch);
+			for(size_t i = 0; i < num_positions; i += hash_batch) {
+				size_t n = std::min((size_t) hash_batch, num_positions - i);
+				if( i + n > fw.end() ) {
+					size_t hasher_start = (i < kgrams) ? 0 : i - kgrams;
+					fw.fill(i + n, (hasher_start < hash_start) ? hasher_start : hash_start);
+				}
+				hasher.next_hashes(fw.at(i), n, batch.data());
+				for(size_t j = 0; j < n; ++j) {
+					if( method == MODDING ) {
+						if( batch[j] % avg_block_size == 0 ) {
+							cuts.push_back(i + j);
+						}
+					} else if( winnower.push(batch[j], i + j + 1, fingerprint) ) {
+						cuts.push_back(fingerprint.second);
+					}
+				}
+				if( !cuts.empty() ) {
+					hash_blocks(false);
+				}
+			}
 		}
-		buf.clear();
+
+		// the last block ends at the end of the file and so gets no overlap
+		cuts.push_back(file_size);
+		fw.fill(file_size, hash_start);
+		hash_blocks(true);
 		hasher.cleanup();
 		return file_size;
 	}
 
+	// digest_file for large files: cut points are found by parallel_fingerprint over a mapping
+	// of the file, and the blocks are then hashed in parallel as well
+	size_t parallel_digest(const std::string& filename, 
+                           std::vector<std::pair<hash_type, size_t> >& file_hashes, 
+                           size_t overlap_len) {
+		MappedFile mf(filename);
+		return digest_buffer(mf.data, mf.size, file_hashes, overlap_len);
+	}
+
+	// digest_file for contents already in memory, using num_threads threads
+	size_t digest_buffer(const char* data, size_t size,
+                         std::vector<std::pair<hash_type, size_t> >& file_hashes, 
+                         size_t overlap_len) {
+		std::vector<std::pair<hash_type, size_t> > cuts;
+		parallel_fingerprint(data, size, cuts);
+		cuts.push_back(std::make_pair(-1, size)); // add placeholder for end of file
+
+		size_t first = file_hashes.size();
+		file_hashes.resize(first + cuts.size());
+		//only kept until the keys are checked
+		std::vector<Hash128> digests(digest == MURMUR128 ? cuts.size() : 0);
+		size_t per_thread = (cuts.size() + num_threads - 1) / num_threads;
+		std::vector<std::thread> threads;
+		for(size_t begin = 0; begin < cuts.size(); begin += per_thread) {
+			size_t end = (begin + per_thread < cuts.size()) ? begin + per_thread : cuts.size();
+			threads.push_back(std::thread([this, data, size, &cuts, &file_hashes, &digests, first,
+                                           begin, end, overlap_len]() {
+				for(size_t i = begin; i < end; ++i) {
+					size_t curr_pos = (i == 0) ? 0 : cuts[i - 1].second;
+					size_t curr_len = cuts[i].second - curr_pos;
+					size_t len_plus_offset = curr_len + overlap_len;
+					if( curr_pos + len_plus_offset > size ) {
+						len_plus_offset = size - curr_pos;
+					}
+					Hash128 full;
+					file_hashes[first + i] = std::make_pair(
+                            block_key(data + curr_pos, len_plus_offset, full), curr_len);
+					if( digest == MURMUR128 ) {
+						digests[i] = full;
+					}
+				}
+			}));
+		}
+		for(auto it = threads.begin(); it != threads.end(); ++it) {
+			it->join();
+		}
+		if( digest == MURMUR128 ) {
+			std::unordered_map<hash_type, Hash128> key_to_digest;
+			key_collisions = 0;
+			for(size_t i = 0; i < cuts.size(); ++i) {
+				check_key(key_to_digest, file_hashes[first + i].first, digests[i]);
+			}
+			return size;
+		}
+#if FINGERPRINT_DEBUG
+		std::unordered_map<hash_type, std::string> hash_to_string;
+		size_t curr_pos = 0;
+		for(size_t i = first; i < file_hashes.size(); ++i) {
+			check_collision(hash_to_string, file_hashes[i], data + curr_pos);
+			curr_pos += file_hashes[i].second;
+		}
+#endif
+		return size;
+	}
+
 	// TODO: implement
 	size_t two_way_min(const std::string& filename, 
                        std::vector<std::pair<hash_type, size_t> >& hashes) {
@@ -0,0 +1,219 @@
+#ifndef _FLAT_INDEX
+#define _FLAT_INDEX
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/** ChunkIndex maps the hash of each distinct chunk of a file to the position and length of its
+ ** first occurrence. The entries are kept in one vector sorted by hash, so iterating the index
+ ** visits the hashes in sorted order and the i-th smallest hash is found by position.
+ **/
+template <typename hash_type>
+class ChunkIndex {
+  public:
+	typedef std::pair<hash_type, std::pair<size_t, size_t> > entry_type; //hash, (position, length)
+	typedef typename std::vector<entry_type>::const_iterator const_iterator;
+
+	std::vector<entry_type> entries;
+
+	// indexes the (hash, length) pairs of a file, given in file order
+	void build(const std::vector<std::pair<hash_type, size_t> >& hashes) {
+		entries.clear();
+		entries.reserve(hashes.size());
+		size_t curr_pos = 0;
+		for(auto it = hashes.begin(); it != hashes.end(); ++it) {
+			entries.push_back(std::make_pair(it->first, std::make_pair(curr_pos, it->second)));
+			curr_pos += it->second;
+		}
+		//stable, so the first occurrence of a repeated hash stays in front
+		std::stable_sort(entries.begin(), entries.end(),
+                         [](const entry_type& a, const entry_type& b) { return a.first < b.first; });
+		entries.erase(std::unique(entries.begin(), entries.end(),
+                                  [](const entry_type& a, const entry_type& b) { return a.first == b.first; }),
+                      entries.end());
+		entries.shrink_to_fit();
+	}
+
+	const_iterator find(hash_type hash) const {
+		const_iterator it = std::lower_bound(entries.begin(), entries.end(), hash,
+                                             [](const entry_type& e, hash_type h) { return e.first < h; });
+		return (it != entries.end() && it->first == hash) ? it : entries.end();
+	}
+
+	// position and length of an indexed hash; throws std::runtime_error for any other hash,
+	// which may come from a malformed message
+	const std::pair<size_t, size_t>& at(hash_type hash) const {
+		const_iterator it = find(hash);
+		if( it == entries.end() ) {
+			throw std::runtime_error("Chunk hash is not indexed");
+		}
+		return it->second;
+	}
+
+	// entry with the i-th smallest hash
+	const entry_type& entry(size_t i) const {
+		return entries[i];
+	}
+
+	const_iterator begin() const { return entries.begin(); }
+	const_iterator end() const { return entries.end(); }
+	size_t size() const { return entries.size(); }
+	void clear() { entries.clear(); }
+
+	bool operator==(const ChunkIndex& other) const {
+		return entries == other.entries;
+	}
+};
+
+/** FlatHashTable is an open addressing hash table with linear probing, holding its slots in a
+ ** single vector instead of allocating a node per element. Keys are integers; slot_type is
+ ** either the key itself (FlatHashSet) or a (key, value) pair (FlatHashMap).
+ **/
+template <typename key_type, typename slot_type>
+class FlatHashTable {
+  public:
+	std::vector<slot_type> slots;
+	std::vector<uint8_t> used;
+	size_t num_entries;
+
+	FlatHashTable(): num_entries(0) {}
+
+	static const key_type& slot_key(const key_type& slot) { return slot; }
+	template <typename value_type>
+	static const key_type& slot_key(const std::pair<key_type, value_type>& slot) { return slot.first; }
+
+	static size_t hash(key_type key) {
+		uint64_t k = (uint64_t) key;
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+
+	// index of the slot holding key, or of the free slot where it would go
+	size_t probe(key_type key) const {
+		size_t mask = slots.size() - 1;
+		size_t i = hash(key) & mask;
+		while( used[i] && !(slot_key(slots[i]) == key) ) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	// slot index of key, or slots.size() if absent
+	size_t find_slot(key_type key) const {
+		if( slots.empty() ) {
+			return 0;
+		}
+		size_t i = probe(key);
+		return used[i] ? i : slots.size();
+	}
+
+	// slot index of key, inserting new_slot if it is absent
+	size_t insert_slot(key_type key, const slot_type& new_slot) {
+		reserve(num_entries + 1);
+		size_t i = probe(key);
+		if( !used[i] ) {
+			slots[i] = new_slot;
+			used[i] = 1;
+			++num_entries;
+		}
+		return i;
+	}
+
+	// grows the table so that n entries keep it at most 3/4 full
+	void reserve(size_t n) {
+		size_t capacity = slots.empty() ? 16 : slots.size();
+		while( 4*n > 3*capacity ) {
+			capacity *= 2;
+		}
+		if( capacity == slots.size() ) {
+			return;
+		}
+		std::vector<slot_type> old_slots(capacity);
+		std::vector<uint8_t> old_used(capacity, 0);
+		old_slots.swap(slots);
+		old_used.swap(used);
+		for(size_t i = 0; i < old_slots.size(); ++i) {
+			if( old_used[i] ) {
+				size_t j = probe(slot_key(old_slots[i]));
+				slots[j] = old_slots[i];
+				used[j] = 1;
+			}
+		}
+	}
+
+	size_t count(key_type key) const {
+		return find_slot(key) != slots.size();
+	}
+
+	size_t size() const { return num_entries; }
+	bool empty() const { return num_entries == 0; }
+
+	void clear() {
+		slots.clear();
+		used.clear();
+		num_entries = 0;
+	}
+
+	class const_iterator {
+	  public:
+		const FlatHashTable* table;
+		size_t i;
+
+		const_iterator(const FlatHashTable* table, size_t i): table(table), i(i) {
+			skip_free();
+		}
+
+		void skip_free() {
+			while( i < table->slots.size() && !table->used[i] ) {
+				++i;
+			}
+		}
+
+		const slot_type& operator*() const { return table->slots[i]; }
+		const slot_type* operator->() const { return &table->slots[i]; }
+		const_iterator& operator++() { ++i; skip_free(); return *this; }
+		bool operator==(const const_iterator& other) const { return i == other.i; }
+		bool operator!=(const const_iterator& other) const { return i != other.i; }
+	};
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, slots.size()); }
+
+	const_iterator find(key_type key) const {
+		return const_iterator(this, find_slot(key));
+	}
+};
+
+template <typename key_type>
+class FlatHashSet: public FlatHashTable<key_type, key_type> {
+  public:
+	typedef FlatHashTable<key_type, key_type> table_type;
+
+	// returns whether key was newly inserted
+	bool insert(key_type key) {
+		size_t n = table_type::num_entries;
+		table_type::insert_slot(key, key);
+		return table_type::num_entries != n;
+	}
+};
+
+template <typename key_type, typename value_type>
+class FlatHashMap: public FlatHashTable<key_type, std::pair<key_type, value_type> > {
+  public:
+	typedef FlatHashTable<key_type, std::pair<key_type, value_type> > table_type;
+
+	value_type& operator[](key_type key) {
+		size_t i = table_type::insert_slot(key, std::make_pair(key, value_type()));
+		return table_type::slots[i].second;
+	}
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include "flat_index.hpp"
+#include "parallel.hpp"
+
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "IBLT_helpers.hpp"
+
+typedef uint64_t key_type;
+
+// the flat tables must hold exactly what the node based containers hold
+void testFlatHashTables(size_t num_keys) {
+	keyGenerator<key_type> kg(1);
+	FlatHashSet<key_type> flat_set;
+	FlatHashMap<key_type, size_t> flat_map;
+	std::unordered_set<key_type> expected_set;
+	std::unordered_map<key_type, size_t> expected_map;
+	for(size_t i = 0; i < num_keys; ++i) {
+		key_type key = kg.generate_key() % (num_keys/2); //plenty of repeats
+		bool inserted = flat_set.insert(key);
+		bool expected_inserted = expected_set.insert(key).second;
+		assert( inserted == expected_inserted );
+		(void) inserted;
+		(void) expected_inserted;
+		flat_map[key] += i;
+		expected_map[key] += i;
+	}
+	assert( flat_set.size() == expected_set.size() );
+	assert( flat_map.size() == expected_map.size() );
+	size_t num_iterated = 0;
+	for(auto it = flat_set.begin(); it != flat_set.end(); ++it, ++num_iterated) {
+		assert( expected_set.count(*it) );
+	}
+	assert( num_iterated == expected_set.size() );
+	for(auto it = expected_map.begin(); it != expected_map.end(); ++it) {
+		assert( flat_map.count(it->first) && flat_map[it->first] == it->second );
+		assert( flat_map.find(it->first)->second == it->second );
+	}
+	assert( !flat_set.count(num_keys) && flat_set.find(num_keys) == flat_set.end() );
+	std::cout << "Flat hash tables with " << flat_set.size() << " keys passed" << std::endl;
+}
+
+// the sorted index must agree with a map filled the way index_chunks used to
+void testChunkIndex(size_t num_chunks) {
+	keyGenerator<key_type> kg(2);
+	std::vector<std::pair<key_type, size_t> > hashes;
+	std::map<key_type, std::pair<size_t, size_t> > expected;
+	size_t curr_pos = 0;
+	for(size_t i = 0; i < num_chunks; ++i) {
+		key_type hash = kg.generate_key() % (num_chunks/2);
+		size_t len = 1 + kg.generate_key() % 1000;
+		hashes.push_back(std::make_pair(hash, len));
+		if( expected.find(hash) == expected.end() ) {
+			expected[hash] = std::make_pair(curr_pos, len);
+		}
+		curr_pos += len;
+	}
+
+	ChunkIndex<key_type> index;
+	index.build(hashes);
+	assert( index.size() == expected.size() );
+	size_t i = 0;
+	for(auto it = expected.begin(); it != expected.end(); ++it, ++i) {
+		assert( index.entry(i).first == it->first && index.entry(i).second == it->second );
+		assert( index.at(it->first) == it->second );
+	}
+	assert( index.find(num_chunks) == index.end() );
+	bool thrown = false;
+	try {
+		index.at(num_chunks);
+	} catch( std::runtime_error& e ) {
+		thrown = true;
+	}
+	assert( thrown );
+	(void) thrown;
+	std::cout << "Chunk index with " << index.size() << " hashes passed" << std::endl;
+}
+
+// sorting and passes over ranges on any number of threads must match doing them on one
+void testParallelPasses() {
+	keyGenerator<key_type> kg(3);
+	size_t sizes[] = {0, 1, 2, 3, 17, 1000, 100000};
+	size_t thread_counts[] = {1, 2, 3, 8, 16};
+	for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+		for(size_t j = 0; j < sizeof(thread_counts)/sizeof(thread_counts[0]); ++j) {
+			std::vector<std::pair<key_type, size_t> > entries;
+			for(size_t k = 0; k < sizes[i]; ++k) {
+				entries.push_back(std::make_pair(kg.generate_key() % 100, k));
+			}
+			std::vector<std::pair<key_type, size_t> > expected(entries);
+			std::sort(expected.begin(), expected.end());
+			parallel_sort(entries.begin(), entries.end(), thread_counts[j], 1);
+			assert( entries == expected );
+
+			std::vector<int> visits(sizes[i], 0);
+			parallel_for(sizes[i], thread_counts[j], 1, [&](size_t begin, size_t end) {
+				for(size_t k = begin; k < end; ++k) {
+					++visits[k];
+				}
+			});
+			assert( std::count(visits.begin(), visits.end(), 1) == (int) sizes[i] );
+		}
+	}
+	std::cout << "Parallel sorts and passes passed" << std::endl;
+}
+
+int main() {
+	testFlatHashTables(1000000);
+	testChunkIndex(1000000);
+	testParallelPasses();
+	return 1;
+}
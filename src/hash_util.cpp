@@ -2,6 +2,8 @@
 // Pulled from lookup3.c by Bob Jenkins
 #include "hash_util.hpp"
 
+#include <string.h>
+
 #define rot(x,k) (((x)<<(k)) | ((x)>>(32-(k))))
 #define mix(a,b,c)                              \
     {                                           \
@@ -530,6 +532,95 @@ uint64_t HashUtil::MurmurHash64A ( const void * key, int len, unsigned int seed
     return h;
 } 
 
+//-----------------------------------------------------------------------------
+// MurmurHash3 was written by Austin Appleby, and is placed in the public
+// domain. The author hereby disclaims copyright to this source code.
+
+static inline uint64_t rotl64(uint64_t x, int8_t r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+Hash128 HashUtil::MurmurHash3_x64_128(const void *buf, size_t length, uint32_t seed)
+{
+    const uint8_t * data = (const uint8_t*)buf;
+    const size_t nblocks = length / 16;
+
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+    for(size_t i = 0; i < nblocks; i++)
+    {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i*16, 8);
+        memcpy(&k2, data + i*16 + 8, 8);
+
+        k1 *= c1; k1 = rotl64(k1,31); k1 *= c2; h1 ^= k1;
+
+        h1 = rotl64(h1,27); h1 += h2; h1 = h1*5+0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2,33); k2 *= c1; h2 ^= k2;
+
+        h2 = rotl64(h2,31); h2 += h1; h2 = h2*5+0x38495ab5;
+    }
+
+    const uint8_t * tail = data + nblocks*16;
+
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+
+    switch(length & 15)
+    {
+    case 15: k2 ^= ((uint64_t)tail[14]) << 48;
+    case 14: k2 ^= ((uint64_t)tail[13]) << 40;
+    case 13: k2 ^= ((uint64_t)tail[12]) << 32;
+    case 12: k2 ^= ((uint64_t)tail[11]) << 24;
+    case 11: k2 ^= ((uint64_t)tail[10]) << 16;
+    case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;
+    case  9: k2 ^= ((uint64_t)tail[ 8]) << 0;
+             k2 *= c2; k2 = rotl64(k2,33); k2 *= c1; h2 ^= k2;
+
+    case  8: k1 ^= ((uint64_t)tail[ 7]) << 56;
+    case  7: k1 ^= ((uint64_t)tail[ 6]) << 48;
+    case  6: k1 ^= ((uint64_t)tail[ 5]) << 40;
+    case  5: k1 ^= ((uint64_t)tail[ 4]) << 32;
+    case  4: k1 ^= ((uint64_t)tail[ 3]) << 24;
+    case  3: k1 ^= ((uint64_t)tail[ 2]) << 16;
+    case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;
+    case  1: k1 ^= ((uint64_t)tail[ 0]) << 0;
+             k1 *= c1; k1 = rotl64(k1,31); k1 *= c2; h1 ^= k1;
+    };
+
+    h1 ^= length; h2 ^= length;
+
+    h1 += h2;
+    h2 += h1;
+
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+
+    h1 += h2;
+    h2 += h1;
+
+    Hash128 ret;
+    ret.low = h1;
+    ret.high = h2;
+    return ret;
+}
+
 // SuperFastHash aka Hsieh Hash, License: GPL 2.0
 uint32_t HashUtil::SuperFastHash(const void *buf, size_t len)
 {
@@ -624,4 +715,29 @@ std::string HashUtil::SHA1Hash(const char* inbuf, size_t in_length)
     EVP_MD_CTX_cleanup(&mdctx);
 
     return std::string((char*)md_value, (size_t)md_len);
-}
\ No newline at end of file
+}
+
+SHA1Stream::SHA1Stream()
+{
+    mdctx = EVP_MD_CTX_create();
+    EVP_DigestInit_ex(mdctx, EVP_sha1(), NULL);
+}
+
+SHA1Stream::~SHA1Stream()
+{
+    EVP_MD_CTX_destroy(mdctx);
+}
+
+void SHA1Stream::update(const char* inbuf, size_t in_length)
+{
+    EVP_DigestUpdate(mdctx, (const void*) inbuf, in_length);
+}
+
+std::string SHA1Stream::final_hash()
+{
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    EVP_DigestFinal_ex(mdctx, md_value, &md_len);
+    return std::string((char*)md_value, (size_t)md_len);
+}
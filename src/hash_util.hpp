@@ -9,6 +9,19 @@
 #include <assert.h>
 #include <iostream>
 
+// 128-bit digest, e.g. of a file block
+struct Hash128 {
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(const Hash128& other) const {
+        return low == other.low && high == other.high;
+    }
+    bool operator!=(const Hash128& other) const {
+        return !(*this == other);
+    }
+};
+
 class HashUtil {
 public:
     // Bob Jenkins Hash
@@ -26,6 +39,10 @@ public:
     static uint32_t MurmurHash(const std::string &s, uint32_t seed = 0);
     static uint64_t MurmurHash64A ( const void * key, int len, unsigned int seed );
 
+    // MurmurHash3, 128-bit version for 64-bit platforms. Hashes 16 bytes per round
+    // on two independent lanes
+    static Hash128 MurmurHash3_x64_128(const void *buf, size_t length, uint32_t seed = 0);
+
     // SuperFastHash
     static uint32_t SuperFastHash(const void *buf, size_t len);
     static uint32_t SuperFastHash(const std::string &s);
@@ -41,6 +58,23 @@ private:
     HashUtil();
 };
 
+// SHA1 of data that is passed in pieces, e.g. while it is being written out
+class SHA1Stream {
+public:
+    SHA1Stream();
+    ~SHA1Stream();
+
+    void update(const char* inbuf, size_t in_length);
+    // digest of everything passed to update, in the format of HashUtil::SHA1Hash
+    std::string final_hash();
+
+private:
+    EVP_MD_CTX* mdctx;
+
+    SHA1Stream(const SHA1Stream&);
+    SHA1Stream& operator=(const SHA1Stream&);
+};
+
 template <size_t key_bits, typename hash_type>
 class MurmurHashing {
   public:
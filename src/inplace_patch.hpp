@@ -0,0 +1,263 @@
+#ifndef _INPLACE_PATCH
+#define _INPLACE_PATCH
+
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "hash_util.hpp"
+
+/** InPlacePatch turns a file into the counterparty's version without writing a new copy. It is
+ ** passed the reconstruction chunk by chunk, like a chunk writer, and records a copy for every
+ ** local chunk and a write for every new chunk. Copies that stay where they are cost nothing.
+ **
+ ** A copy must not run after another copy has overwritten the region it reads, so plan() orders
+ ** the copies topologically by these conflicts. Cycles of copies (e.g. two swapped chunks) are
+ ** broken by reading one copy of the cycle into a scratch buffer before anything is written, and
+ ** writing it once all other copies are done; new chunks are written last, and the file is then
+ ** cut to its new size. The reads are chunks of the old file, so any two of them are either
+ ** disjoint or the same.
+ **
+ ** The file is inconsistent while the patch is applied, so an interrupted patch leaves it
+ ** neither in the old nor in the new version.
+ **/
+class InPlacePatch {
+  public:
+	struct Op {
+		size_t src_pos; //position in the old file, for copies
+		size_t dst_pos;
+		size_t len;
+		const std::string* data; //contents of a new chunk, or NULL for a copy
+	};
+
+	static const size_t max_io_size = 1 << 20; //largest run of copies done by one read and write
+
+	std::vector<Op> ops; //in order of dst_pos
+	size_t new_size;
+	std::vector<size_t> order; //copies that move, in a safe order
+	std::vector<size_t> scratch_copies; //copies read ahead to break cycles
+	size_t scratch_bytes;
+	size_t bytes_written;
+
+	InPlacePatch(): new_size(0), scratch_bytes(0), bytes_written(0) {}
+
+	void add_local(size_t pos, size_t len) {
+		Op op = {pos, new_size, len, NULL};
+		ops.push_back(op);
+		new_size += len;
+	}
+
+	// data has to stay valid until the patch is applied
+	void add_literal(const std::string& data) {
+		Op op = {0, new_size, data.size(), &data};
+		ops.push_back(op);
+		new_size += data.size();
+	}
+
+	bool moves(const Op& op) const {
+		return !op.data && op.src_pos != op.dst_pos;
+	}
+
+	// SHA1 of the patched file, given the contents of the old one
+	std::string final_hash(const char* src) const {
+		SHA1Stream sha;
+		for(auto it = ops.begin(); it != ops.end(); ++it) {
+			sha.update(it->data ? it->data->data() : src + it->src_pos, it->len);
+		}
+		return sha.final_hash();
+	}
+
+	// orders the copies; returns false if breaking cycles needs more than max_scratch bytes
+	bool plan(size_t max_scratch) {
+		std::vector<size_t> copies;
+		for(size_t i = 0; i < ops.size(); ++i) {
+			if( moves(ops[i]) ) {
+				copies.push_back(i);
+			}
+		}
+		//copies sorted by the region they read
+		std::vector<size_t> by_src(copies);
+		std::sort(by_src.begin(), by_src.end(),
+                  [this](size_t a, size_t b) { return ops[a].src_pos < ops[b].src_pos; });
+
+		//an edge from j to i if i overwrites what j reads, so j has to go first
+		std::vector<std::vector<size_t> > succ(ops.size());
+		std::vector<size_t> num_pred(ops.size(), 0);
+		for(auto it = copies.begin(); it != copies.end(); ++it) {
+			const Op& op = ops[*it];
+			//reads do not partially overlap, so their ends are sorted as well
+			auto j = std::lower_bound(by_src.begin(), by_src.end(), op.dst_pos,
+                                      [this](size_t k, size_t pos) { return ops[k].src_pos + ops[k].len <= pos; });
+			for(; j != by_src.end() && ops[*j].src_pos < op.dst_pos + op.len; ++j) {
+				if( *j != *it ) {
+					succ[*j].push_back(*it);
+					++num_pred[*it];
+				}
+			}
+		}
+
+		order.clear();
+		scratch_copies.clear();
+		scratch_bytes = 0;
+		std::vector<bool> done(ops.size(), false);
+		std::vector<size_t> ready;
+		for(auto it = copies.begin(); it != copies.end(); ++it) {
+			if( num_pred[*it] == 0 ) {
+				ready.push_back(*it);
+			}
+		}
+		size_t num_done = 0;
+		auto next_cut = copies.begin();
+		while( num_done < copies.size() ) {
+			size_t curr;
+			if( !ready.empty() ) {
+				curr = ready.back();
+				ready.pop_back();
+				order.push_back(curr);
+			} else {
+				//every remaining copy waits on another, so read one of them ahead
+				while( done[*next_cut] ) {
+					++next_cut;
+				}
+				curr = *next_cut;
+				scratch_copies.push_back(curr);
+				scratch_bytes += ops[curr].len;
+				if( scratch_bytes > max_scratch ) {
+					return false;
+				}
+			}
+			done[curr] = true;
+			++num_done;
+			for(auto it = succ[curr].begin(); it != succ[curr].end(); ++it) {
+				if( !done[*it] && --num_pred[*it] == 0 ) {
+					ready.push_back(*it);
+				}
+			}
+		}
+		return true;
+	}
+
+	// applies the planned patch to fd, which holds the old file
+	bool apply(int fd) {
+		std::vector<char> scratch(scratch_bytes);
+		size_t scratch_pos = 0;
+		for(auto it = scratch_copies.begin(); it != scratch_copies.end(); ++it) {
+			if( !pread_all(fd, &scratch[scratch_pos], ops[*it].len, ops[*it].src_pos) ) {
+				return false;
+			}
+			scratch_pos += ops[*it].len;
+		}
+
+		//consecutive copies that are adjacent both in the old and the new file are done together
+		std::vector<char> buf;
+		size_t run_src = 0, run_dst = 0, run_len = 0;
+		for(auto it = order.begin(); it != order.end(); ++it) {
+			const Op& op = ops[*it];
+			if( run_len > 0 && run_len + op.len <= max_io_size ) {
+				if( op.src_pos == run_src + run_len && op.dst_pos == run_dst + run_len ) {
+					run_len += op.len;
+					continue;
+				}
+				if( op.src_pos + op.len == run_src && op.dst_pos + op.len == run_dst ) {
+					run_src = op.src_pos;
+					run_dst = op.dst_pos;
+					run_len += op.len;
+					continue;
+				}
+			}
+			if( !copy(fd, run_src, run_dst, run_len, buf) ) {
+				return false;
+			}
+			run_src = op.src_pos;
+			run_dst = op.dst_pos;
+			run_len = op.len;
+		}
+		if( !copy(fd, run_src, run_dst, run_len, buf) ) {
+			return false;
+		}
+
+		scratch_pos = 0;
+		for(auto it = scratch_copies.begin(); it != scratch_copies.end(); ++it) {
+			if( !pwrite_all(fd, &scratch[scratch_pos], ops[*it].len, ops[*it].dst_pos) ) {
+				return false;
+			}
+			scratch_pos += ops[*it].len;
+		}
+		for(auto it = ops.begin(); it != ops.end(); ++it) {
+			if( it->data && !pwrite_all(fd, it->data->data(), it->len, it->dst_pos) ) {
+				return false;
+			}
+		}
+		return ftruncate(fd, new_size) == 0;
+	}
+
+	// writes the patched file as a new copy to out_fd instead, reading the old one from src_fd
+	bool write_copy(int src_fd, int out_fd) {
+		std::vector<char> buf;
+		for(auto it = ops.begin(); it != ops.end(); ++it) {
+			if( it->data ) {
+				if( !pwrite_all(out_fd, it->data->data(), it->len, it->dst_pos) ) {
+					return false;
+				}
+			} else {
+				buf.resize(it->len);
+				if( !pread_all(src_fd, buf.data(), it->len, it->src_pos)
+                    || !pwrite_all(out_fd, buf.data(), it->len, it->dst_pos) ) {
+					return false;
+				}
+			}
+		}
+		return ftruncate(out_fd, new_size) == 0;
+	}
+
+	// the whole run is read before any of it is written, so it may overlap itself
+	bool copy(int fd, size_t src_pos, size_t dst_pos, size_t len, std::vector<char>& buf) {
+		if( len == 0 ) {
+			return true;
+		}
+		buf.resize(len);
+		if( !pread_all(fd, buf.data(), len, src_pos) || !pwrite_all(fd, buf.data(), len, dst_pos) ) {
+			return false;
+		}
+		return true;
+	}
+
+	static bool pread_all(int fd, char* data, size_t len, size_t pos) {
+		while( len > 0 ) {
+			ssize_t res = pread(fd, data, len, pos);
+			if( res < 0 && errno == EINTR ) {
+				continue;
+			}
+			if( res <= 0 ) {
+				return false;
+			}
+			data += res;
+			len -= res;
+			pos += res;
+		}
+		return true;
+	}
+
+	bool pwrite_all(int fd, const char* data, size_t len, size_t pos) {
+		while( len > 0 ) {
+			ssize_t res = pwrite(fd, data, len, pos);
+			if( res < 0 && errno == EINTR ) {
+				continue;
+			}
+			if( res < 0 ) {
+				return false;
+			}
+			data += res;
+			len -= res;
+			pos += res;
+			bytes_written += res;
+		}
+		return true;
+	}
+};
+
+#endif
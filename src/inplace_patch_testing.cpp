@@ -0,0 +1,186 @@
+#include "file_sync.hpp"
+#include "inplace_patch.hpp"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "IBLT_helpers.hpp"
+
+typedef uint64_t hash_type;
+typedef FileSynchronizer<hash_type> fsync_type;
+
+void write_contents(const std::string& file, const std::string& contents) {
+	FILE* fp = fopen(file.c_str(), "w");
+	assert( fp );
+	fwrite(contents.data(), 1, contents.size(), fp);
+	fclose(fp);
+}
+
+// rebuilds new_chunks, each either a chunk of the old file or new contents, over the old file
+bool patch_file(const std::string& file, const std::string& old_contents,
+                const std::vector<std::pair<size_t, size_t> >& old_chunks,
+                const std::vector<int>& new_chunks, const std::vector<std::string>& literals,
+                size_t max_scratch, InPlacePatch& patch) {
+	write_contents(file, old_contents);
+	for(size_t i = 0, lit = 0; i < new_chunks.size(); ++i) {
+		if( new_chunks[i] >= 0 ) {
+			patch.add_local(old_chunks[new_chunks[i]].first, old_chunks[new_chunks[i]].second);
+		} else {
+			patch.add_literal(literals[lit++]);
+		}
+	}
+	if( !patch.plan(max_scratch) ) {
+		return false;
+	}
+	int fd = open(file.c_str(), O_RDWR);
+	assert( fd >= 0 );
+	bool applied = patch.apply(fd);
+	close(fd);
+	return applied;
+}
+
+// chunks of the old file are moved around, repeated, dropped and mixed with new ones
+void testPatchMoves(size_t num_chunks) {
+	keyGenerator<uint64_t> kg(3);
+	std::string old_contents;
+	std::vector<std::pair<size_t, size_t> > old_chunks;
+	for(size_t i = 0; i < num_chunks; ++i) {
+		size_t len = 1 + kg.generate_key() % 200;
+		old_chunks.push_back(std::make_pair(old_contents.size(), len));
+		for(size_t j = 0; j < len; ++j) {
+			old_contents.push_back('a' + kg.generate_key() % 26);
+		}
+	}
+
+	std::vector<int> new_chunks;
+	std::vector<std::string> literals;
+	std::string expected;
+	for(size_t i = 0; i < num_chunks; ++i) {
+		if( kg.generate_key() % 10 == 0 ) {
+			literals.push_back(std::string(1 + kg.generate_key() % 100, '#'));
+			new_chunks.push_back(-1);
+			expected += literals.back();
+		} else {
+			new_chunks.push_back(kg.generate_key() % num_chunks);
+			expected += old_contents.substr(old_chunks[new_chunks.back()].first, old_chunks[new_chunks.back()].second);
+		}
+	}
+
+	const std::string file = "tmp/inplace.txt";
+	InPlacePatch patch;
+	bool patched = patch_file(file, old_contents, old_chunks, new_chunks, literals, (size_t) -1, patch);
+	assert( patched );
+	(void) patched;
+	assert( read_contents(file) == expected );
+	assert( patch.scratch_bytes > 0 );
+	assert( patch.final_hash(old_contents.data()) == HashUtil::SHA1Hash(expected.data(), expected.size()) );
+
+	//without scratch space the cycles cannot be broken, but a new copy can still be written
+	InPlacePatch no_scratch;
+	patched = patch_file(file, old_contents, old_chunks, new_chunks, literals, 0, no_scratch);
+	assert( !patched );
+	const std::string copy_file = "tmp/inplace_copy.txt";
+	int src_fd = open(file.c_str(), O_RDONLY), out_fd = open(copy_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool copied = no_scratch.write_copy(src_fd, out_fd);
+	assert( copied );
+	(void) copied;
+	close(src_fd);
+	close(out_fd);
+	assert( read_contents(copy_file) == expected );
+	std::cout << "In place patch of " << num_chunks << " chunks with " << patch.scratch_bytes
+              << " bytes of scratch passed" << std::endl;
+}
+
+// inserting or removing data shifts the rest of the file, which needs no scratch space and
+// leaves the chunks in front of the change alone
+void testPatchShift(size_t num_chunks, size_t chunk_len) {
+	std::string old_contents;
+	std::vector<std::pair<size_t, size_t> > old_chunks;
+	for(size_t i = 0; i < num_chunks; ++i) {
+		old_chunks.push_back(std::make_pair(old_contents.size(), chunk_len));
+		old_contents += std::string(chunk_len, 'a' + i % 26);
+	}
+	const std::string file = "tmp/inplace.txt";
+	for(int removed = 0; removed < 2; ++removed) {
+		std::vector<int> new_chunks;
+		std::vector<std::string> literals;
+		for(size_t i = 0; i < num_chunks; ++i) {
+			if( i == num_chunks/2 ) {
+				if( removed ) {
+					continue;
+				}
+				literals.push_back(std::string(chunk_len + 1, '#'));
+				new_chunks.push_back(-1);
+			}
+			new_chunks.push_back(i);
+		}
+		std::string expected = old_contents;
+		if( removed ) {
+			expected.erase((num_chunks/2)*chunk_len, chunk_len);
+		} else {
+			expected.insert((num_chunks/2)*chunk_len, literals[0]);
+		}
+
+		InPlacePatch patch;
+		bool patched = patch_file(file, old_contents, old_chunks, new_chunks, literals, 0, patch);
+		assert( patched );
+		(void) patched;
+		assert( read_contents(file) == expected );
+		assert( patch.bytes_written <= expected.size() - (num_chunks/2)*chunk_len );
+	}
+	std::cout << "In place shifts of " << num_chunks << " chunks passed" << std::endl;
+}
+
+// B's file has two regions swapped and a few blocks changed; A patches its own file into B's
+void testSyncInPlace(const std::string& file1, const std::string& file2, size_t avg_block_size) {
+	generate_random_file(file1, 100000);
+	std::string contents = read_contents(file1);
+	std::string swapped = contents.substr(60000, 30000) + contents.substr(30000, 30000)
+                          + contents.substr(0, 30000) + contents.substr(90000);
+	write_contents(file2, swapped);
+	std::string changed_file = file2 + ".changed";
+	generate_block_changed_file(file2, changed_file, 10, 5);
+	std::string expected = read_contents(changed_file);
+
+	fsync_type file_sync_A(file1, avg_block_size), file_sync_B(changed_file, avg_block_size);
+	size_t diff_est = file_sync_B.receive_strata_encoding(file_sync_A.send_strata_encoding());
+	//an IBLT far too small for the difference has to be retried with B's larger estimate
+	std::string rd2_encoding;
+	bool peeled = file_sync_B.receive_IBLT_encoding(file_sync_A.send_IBLT_encoding(diff_est/8 + 1), rd2_encoding);
+	assert( !peeled );
+	(void) peeled;
+	while( !file_sync_B.receive_IBLT_encoding(file_sync_A.send_IBLT_encoding(file_sync_B.retry_estimate()), rd2_encoding) ) {
+		assert( file_sync_B.retry_estimate() < 8*diff_est );
+	}
+	bool patched = file_sync_A.receive_rd2_encoding_in_place(rd2_encoding);
+	assert( patched );
+	(void) patched;
+	assert( read_contents(file1) == expected );
+
+	//naming my own file, or a link to it, as the output patches it rather than truncating it
+	std::string link_file = file1 + ".link";
+	unlink(link_file.c_str());
+	int linked = link(file1.c_str(), link_file.c_str());
+	assert( linked == 0 );
+	(void) linked;
+	fsync_type file_sync_C(file1, avg_block_size), file_sync_D(file2, avg_block_size);
+	diff_est = file_sync_D.receive_strata_encoding(file_sync_C.send_strata_encoding());
+	while( !file_sync_D.receive_IBLT_encoding(file_sync_C.send_IBLT_encoding(diff_est), rd2_encoding) ) {
+		diff_est = file_sync_D.retry_estimate();
+	}
+	patched = file_sync_C.receive_rd2_encoding(rd2_encoding, link_file);
+	assert( patched );
+	assert( read_contents(file1) == swapped );
+	std::cout << "In place file synchronization passed" << std::endl;
+}
+
+int main() {
+	testPatchMoves(2000);
+	testPatchShift(100, 64);
+	testSyncInPlace("tmp/inplace_A.txt", "tmp/inplace_B.txt", 100);
+	return 1;
+}
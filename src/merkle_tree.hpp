@@ -0,0 +1,175 @@
+#ifndef _MERKLE_TREE
+#define _MERKLE_TREE
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hash_util.hpp"
+#include "parallel.hpp"
+
+/** MerkleTree hashes a file chunk by chunk. Each leaf is the SHA1 of a chunk and each inner node
+ ** the SHA1 of its two children, with a prefix byte telling leaves and inner nodes apart. A node
+ ** left without a sibling at the end of a level is carried up as it is. Node i of a level has
+ ** nodes 2i and 2i+1 of the level below as children, so the nodes some levels below a node form
+ ** a contiguous range.
+ **
+ ** The leaves are independent, so they are hashed on several threads. Two parties with trees
+ ** over the same number of chunks find the chunks they differ in with MerkleDescent, by only
+ ** comparing the nodes below the nodes that already differ.
+ **/
+class MerkleTree {
+  public:
+	static const size_t digest_size = 20;
+
+	size_t num_threads;
+	size_t min_parallel_size; //fewer bytes are always hashed on one thread
+	std::vector<std::string> levels; //digests of each level, from the leaves up to the root
+
+	MerkleTree(): num_threads(1), min_parallel_size(1 << 22), levels(1) {}
+
+	// hashes num_chunks chunks, where chunk(i) gives the position and length of the i-th chunk
+	template <typename chunk_func>
+	void build(size_t num_chunks, chunk_func chunk, size_t num_threads) {
+		levels.assign(1, std::string(num_chunks*digest_size, '\0'));
+		size_t total_size = 0;
+		for(size_t i = 0; i < num_chunks; ++i) {
+			total_size += chunk(i).second;
+		}
+		parallel_for(num_chunks, (total_size >= min_parallel_size) ? num_threads : 1, 1,
+                     [this, &chunk](size_t begin, size_t end) {
+			for(size_t i = begin; i < end; ++i) {
+				std::pair<const char*, size_t> c = chunk(i);
+				set_leaf(i, c.first, c.second);
+			}
+		});
+		build_levels();
+	}
+
+	// replaces the digest of leaf i; build_levels() has to be called before the tree is used
+	void set_leaf(size_t i, const char* data, size_t len) {
+		SHA1Stream sha;
+		sha.update("\0", 1);
+		sha.update(data, len);
+		levels[0].replace(i*digest_size, digest_size, sha.final_hash());
+	}
+
+	void build_levels() {
+		levels.resize(1);
+		while( level_size(levels.size() - 1) > 1 ) {
+			const std::string& below = levels.back();
+			size_t num_below = below.size() / digest_size;
+			std::string level;
+			for(size_t i = 0; i + 1 < num_below; i += 2) {
+				SHA1Stream sha;
+				sha.update("\1", 1);
+				sha.update(below.data() + i*digest_size, 2*digest_size);
+				level += sha.final_hash();
+			}
+			if( num_below % 2 ) {
+				level.append(below, (num_below - 1)*digest_size, digest_size);
+			}
+			levels.push_back(level);
+		}
+	}
+
+	size_t num_leaves() const {
+		return level_size(0);
+	}
+
+	size_t level_size(size_t level) const {
+		return levels[level].size() / digest_size;
+	}
+
+	std::string node(size_t level, size_t i) const {
+		return levels[level].substr(i*digest_size, digest_size);
+	}
+
+	// the digest of a tree without chunks is the SHA1 of nothing
+	std::string root() const {
+		return num_leaves() > 0 ? node(levels.size() - 1, 0) : HashUtil::SHA1Hash("", 0);
+	}
+
+	// range of the nodes at to_level below node i at level
+	std::pair<size_t, size_t> nodes_below(size_t level, size_t i, size_t to_level) const {
+		size_t shift = level - to_level;
+		return std::make_pair(i << shift, std::min((i + 1) << shift, level_size(to_level)));
+	}
+
+	// the digests at to_level below each of the given nodes at level, one after the other;
+	// returns false if a node is not in the tree
+	bool get_nodes_below(size_t level, const std::vector<size_t>& nodes, size_t to_level,
+                         std::string& digests) const {
+		if( level >= levels.size() || to_level > level ) {
+			return false;
+		}
+		for(auto it = nodes.begin(); it != nodes.end(); ++it) {
+			if( *it >= level_size(level) ) {
+				return false;
+			}
+			std::pair<size_t, size_t> range = nodes_below(level, *it, to_level);
+			digests.append(levels[to_level], range.first*digest_size, (range.second - range.first)*digest_size);
+		}
+		return true;
+	}
+};
+
+/** MerkleDescent narrows the chunks in which my tree differs from the counterparty's, given that
+ ** their roots differ. Each round asks for the nodes up to levels_per_round levels below the
+ ** nodes that still differ, so a single bad chunk among n is found in about
+ ** log2(n)/levels_per_round rounds with 2^levels_per_round digests each.
+ **/
+class MerkleDescent {
+  public:
+	const MerkleTree* tree;
+	size_t levels_per_round;
+	size_t level; //of the nodes that differ
+	std::vector<size_t> differing;
+
+	MerkleDescent(): tree(NULL), levels_per_round(4), level(0) {}
+
+	void start(const MerkleTree& my_tree) {
+		tree = &my_tree;
+		level = my_tree.levels.size() - 1;
+		differing.assign(my_tree.num_leaves() > 0 ? 1 : 0, 0);
+	}
+
+	// whether differing holds the chunks that differ
+	bool done() const {
+		return level == 0;
+	}
+
+	size_t next_level() const {
+		return level > levels_per_round ? level - levels_per_round : 0;
+	}
+
+	// compares the counterparty's digests at next_level() below the differing nodes with mine.
+	// Returns false if they are malformed, or if all nodes below a differing node agree
+	bool receive(const std::string& digests) {
+		size_t to_level = next_level();
+		std::string mine;
+		if( !tree->get_nodes_below(level, differing, to_level, mine) || mine.size() != digests.size() ) {
+			return false;
+		}
+		std::vector<size_t> next_differing;
+		size_t pos = 0;
+		for(auto it = differing.begin(); it != differing.end(); ++it) {
+			std::pair<size_t, size_t> range = tree->nodes_below(level, *it, to_level);
+			size_t num_before = next_differing.size();
+			for(size_t i = range.first; i < range.second; ++i, pos += MerkleTree::digest_size) {
+				if( digests.compare(pos, MerkleTree::digest_size, mine, pos, MerkleTree::digest_size) != 0 ) {
+					next_differing.push_back(i);
+				}
+			}
+			if( next_differing.size() == num_before ) {
+				return false;
+			}
+		}
+		differing.swap(next_differing);
+		level = to_level;
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,155 @@
+#include "file_sync.hpp"
+#include "merkle_tree.hpp"
+
+#include <unistd.h>
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "IBLT_helpers.hpp"
+
+typedef FileSynchronizer<uint64_t> fsync_type;
+
+// a tree over contents cut into chunks of chunk_len bytes
+void build_tree(const std::string& contents, size_t chunk_len, size_t num_threads, MerkleTree& tree) {
+	tree.min_parallel_size = 0;
+	size_t num_chunks = (contents.size() + chunk_len - 1) / chunk_len;
+	tree.build(num_chunks, [&](size_t i) {
+		return std::make_pair(contents.data() + i*chunk_len, std::min(chunk_len, contents.size() - i*chunk_len));
+	}, num_threads);
+}
+
+// hashing on several threads gives the same tree, and changing any chunk changes the root
+void testBuild() {
+	std::string contents(100003, '\0');
+	keyGenerator<uint64_t> kg(8);
+	for(size_t i = 0; i < contents.size(); ++i) {
+		contents[i] = (char) kg.generate_key();
+	}
+	size_t chunk_lens[] = {1, 7, 100, 100003, 200000};
+	for(size_t i = 0; i < sizeof(chunk_lens)/sizeof(chunk_lens[0]); ++i) {
+		MerkleTree sequential, parallel;
+		build_tree(contents, chunk_lens[i], 1, sequential);
+		build_tree(contents, chunk_lens[i], 5, parallel);
+		assert( sequential.levels == parallel.levels );
+		assert( parallel.level_size(parallel.levels.size() - 1) == 1 );
+
+		std::string changed = contents;
+		changed[kg.generate_key() % changed.size()] ^= 1;
+		build_tree(changed, chunk_lens[i], 5, parallel);
+		assert( sequential.root() != parallel.root() );
+	}
+	MerkleTree empty;
+	empty.build(0, [](size_t i) { return std::make_pair((const char*) NULL, (size_t) 0); }, 4);
+	assert( empty.root() == HashUtil::SHA1Hash("", 0) );
+	std::cout << "Merkle trees built on several threads match" << std::endl;
+}
+
+// the descent finds exactly the leaves that differ
+void testDescent() {
+	keyGenerator<uint64_t> kg(9);
+	size_t sizes[] = {1, 2, 3, 17, 1000, 100000};
+	for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+		std::string mine(sizes[i], 'a'), theirs(sizes[i], 'a');
+		std::set<size_t> changed;
+		for(size_t j = 0; j < 1 + sizes[i]/20000; ++j) {
+			size_t pos = kg.generate_key() % sizes[i];
+			theirs[pos] = 'b';
+			changed.insert(pos);
+		}
+		MerkleTree my_tree, cp_tree;
+		build_tree(mine, 1, 2, my_tree);
+		build_tree(theirs, 1, 2, cp_tree);
+		MerkleDescent descent;
+		descent.start(my_tree);
+		size_t rounds = 0;
+		while( !descent.done() ) {
+			std::string digests;
+			bool found = cp_tree.get_nodes_below(descent.level, descent.differing, descent.next_level(), digests);
+			assert( found );
+			(void) found;
+			bool received = descent.receive(digests);
+			assert( received );
+			(void) received;
+			++rounds;
+		}
+		assert( std::set<size_t>(descent.differing.begin(), descent.differing.end()) == changed );
+		assert( rounds <= (my_tree.levels.size() + descent.levels_per_round - 2) / descent.levels_per_round );
+	}
+
+	//digests that agree everywhere below a differing node are rejected
+	std::string contents(1000, 'a');
+	MerkleTree tree;
+	build_tree(contents, 10, 1, tree);
+	MerkleDescent descent;
+	descent.start(tree);
+	std::string digests;
+	bool found = tree.get_nodes_below(descent.level, descent.differing, descent.next_level(), digests);
+	assert( found );
+	(void) found;
+	bool received = descent.receive(digests);
+	assert( !received );
+	(void) received;
+	std::cout << "Merkle descents found the differing leaves" << std::endl;
+}
+
+// A's file changes after it was fingerprinted, so some chunks it rebuilds from it are wrong;
+// only those are fetched again
+void testRepair(const std::string& file1, const std::string& file2, size_t avg_block_size) {
+	generate_random_file(file1, 200000);
+	generate_block_changed_file(file1, file2, 10, 5);
+	fsync_type file_sync_A(file1, avg_block_size), file_sync_B(file2, avg_block_size);
+
+	std::string contents = read_contents(file1);
+	contents[1000] ^= 1;
+	contents[150000] ^= 1;
+	FILE* fp = fopen(file1.c_str(), "w");
+	assert( fp );
+	size_t num_written = fwrite(contents.data(), 1, contents.size(), fp);
+	assert( num_written == contents.size() );
+	(void) num_written;
+	fclose(fp);
+
+	size_t diff_est = file_sync_B.receive_strata_encoding(file_sync_A.send_strata_encoding());
+	std::string rd2_encoding;
+	while( !file_sync_B.receive_IBLT_encoding(file_sync_A.send_IBLT_encoding(diff_est), rd2_encoding) ) {
+		diff_est = file_sync_B.retry_estimate();
+	}
+	std::string output_file = "tmp/merkle_out.txt";
+	unlink(output_file.c_str());
+	bool rebuilt = file_sync_A.receive_rd2_encoding(rd2_encoding, output_file);
+	assert( !rebuilt );
+	(void) rebuilt;
+	assert( file_sync_A.needs_repair() );
+	//nothing is written before the file checks out
+	assert( access(output_file.c_str(), F_OK) != 0 );
+
+	size_t repair_bytes = 0;
+	while( !file_sync_A.bad_chunks_found() ) {
+		std::string request = file_sync_A.send_tree_request();
+		std::string nodes = file_sync_B.send_tree_nodes(request);
+		repair_bytes += request.size() + nodes.size();
+		bool received = file_sync_A.receive_tree_nodes(nodes);
+		assert( received );
+		(void) received;
+	}
+	size_t num_bad_chunks = file_sync_A.descent.differing.size();
+	assert( num_bad_chunks >= 1 && num_bad_chunks <= 2 );
+	std::string request = file_sync_A.send_chunk_request();
+	std::string chunks = file_sync_B.send_chunks(request);
+	repair_bytes += request.size() + chunks.size();
+	rebuilt = file_sync_A.receive_chunks(chunks, output_file);
+	assert( rebuilt );
+	assert( !file_sync_A.needs_repair() );
+	assert( read_contents(output_file) == read_contents(file2) );
+	std::cout << "Repaired " << num_bad_chunks << " bad chunks with " << repair_bytes << " bytes" << std::endl;
+}
+
+int main() {
+	testBuild();
+	testDescent();
+	testRepair("tmp/merkle_A.txt", "tmp/merkle_B.txt", 500);
+	return 1;
+}
@@ -0,0 +1,219 @@
+#ifndef _MULTILEVEL_SYNC
+#define _MULTILEVEL_SYNC
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chunk_writer.hpp"
+#include "file_sync.hpp"
+#include "flat_index.hpp"
+#include "hash_util.hpp"
+
+/** MultiLevelSynchronizer synchronizes a file over a hierarchy of block sizes. Every level
+ ** runs the FileSynchronizer protocol: the first on the whole file with the coarse block size,
+ ** and each further level only on the chunks that differed on the level above, concatenated
+ ** and chunked with a block size split_factor times smaller. Changed regions thus end up being
+ ** sent at fine granularity, while only the first level's IBLT covers the whole file.
+ **
+ ** A level takes the usual three messages. When party B answers the IBLT it decides whether
+ ** to descend; if so, its new chunks are sent as lengths only, and their contents become B's
+ ** next level. Party A's next level holds the chunks of A that B does not have. Once
+ ** receive_rd2_encoding has taken the last level, A has rebuilt B's file in the given output
+ ** file and done() is true.
+ **/
+template <typename hash_type = uint32_t>
+class MultiLevelSynchronizer {
+  public:
+	typedef FileSynchronizer<hash_type> fsync_type;
+	typedef typename fsync_type::Round2Info rd2_type;
+
+	//first byte of round 2 messages
+	static const char FINAL_LEVEL = 'F';
+	static const char DESCEND = 'D';
+	//finer levels would not find shared chunks worth their hashes
+	static const size_t min_block_size = 32;
+
+	size_t num_levels;
+	size_t split_factor;
+	std::vector<fsync_type*> levels; //levels so far, the current one last
+	std::vector<rd2_type> cp_rd2s; //round 2 info received for each level
+	bool rebuilt; //A has rebuilt B's file from the last level
+
+	MultiLevelSynchronizer(const std::string& filename, size_t avg_block_size,
+                           size_t num_levels, size_t split_factor = 8):
+                           num_levels(num_levels), split_factor(split_factor), rebuilt(false) {
+		levels.push_back(new fsync_type(filename, avg_block_size));
+	}
+
+	~MultiLevelSynchronizer() {
+		for(auto it = levels.begin(); it != levels.end(); ++it) {
+			delete *it;
+		}
+	}
+
+	fsync_type& curr_level() {
+		return *levels.back();
+	}
+
+	std::string send_strata_encoding() {
+		return curr_level().send_strata_encoding();
+	}
+
+	size_t receive_strata_encoding(const std::string& strata_encoding) {
+		return curr_level().receive_strata_encoding(strata_encoding);
+	}
+
+	std::string send_IBLT_encoding(size_t diff_estimate) {
+		return curr_level().send_IBLT_encoding(diff_estimate);
+	}
+
+	// party B: peels the IBLT and answers with the round 2 info of the current level, or returns
+	// false if A has to send an IBLT sized for retry_estimate() instead
+	bool receive_IBLT_encoding(const std::string& iblt_encoding, std::string& rd2_encoding) {
+		fsync_type& level = curr_level();
+		if( !level.decode_IBLT(iblt_encoding) ) {
+			return false;
+		}
+
+		std::vector<char> new_contents;
+		for(auto it = level.my_rd2.new_chunk_info.begin(); it != level.my_rd2.new_chunk_info.end(); ++it) {
+			new_contents.insert(new_contents.end(), it->begin(), it->end());
+		}
+		size_t next_block_size = level.avg_block_size / split_factor;
+		bool descend = levels.size() < num_levels
+                       && next_block_size >= min_block_size
+                       && new_contents.size() >= 2*next_block_size
+                       && !level.cp_distinct_keys.empty(); //A has something to match against
+		if( !descend ) {
+			rd2_encoding = FINAL_LEVEL + level.send_rd2_encoding();
+			return true;
+		}
+
+		for(auto it = level.my_rd2.new_chunk_info.begin(); it != level.my_rd2.new_chunk_info.end(); ++it) {
+			*it = encode_length(it->size());
+		}
+		//A needs the lengths before it can unpack anything
+		level.my_rd2.packed_contents.clear();
+		rd2_encoding = DESCEND + level.send_rd2_encoding();
+		levels.push_back(new fsync_type(new_contents, next_block_size));
+		return true;
+	}
+
+	size_t retry_estimate() {
+		return curr_level().retry_estimate();
+	}
+
+	// whether B's file has been rebuilt, or B descended to another level
+	bool done() const {
+		return rebuilt;
+	}
+
+	// party A: starts the next level if B descended to one, and otherwise rebuilds B's file in
+	// output_file. Returns false if the file could not be rebuilt
+	bool receive_rd2_encoding(const std::string& rd2_encoding, const std::string& output_file) {
+		if( rd2_encoding.empty() || (rd2_encoding[0] != DESCEND && rd2_encoding[0] != FINAL_LEVEL) ) {
+			std::cerr << "Malformed round 2 encoding" << std::endl;
+			return false;
+		}
+		fsync_type& level = curr_level();
+		cp_rd2s.push_back(rd2_type());
+		fsync_type::decode_rd2(rd2_encoding.substr(1), cp_rd2s.back());
+		if( rd2_encoding[0] == DESCEND ) {
+			std::vector<char> distinct_contents;
+			get_distinct_contents(level, cp_rd2s.back(), distinct_contents);
+			levels.push_back(new fsync_type(distinct_contents, level.avg_block_size / split_factor));
+			return true;
+		}
+
+		//each level supplies the new chunks of the level above it
+		std::string cp_contents;
+		for(size_t l = levels.size(); l-- > 0; ) {
+			if( l + 1 < levels.size() ) {
+				fill_new_chunks(cp_contents, cp_rd2s[l]);
+			}
+			if( l == 0 ) {
+				rebuilt = levels[0]->reconstruct_file(cp_rd2s[0], output_file);
+			} else if( !rebuild(*levels[l], cp_rd2s[l], cp_contents) ) {
+				return false;
+			}
+		}
+		return rebuilt;
+	}
+
+	// the counterparty's contents of a level below the first; false if they do not check out
+	static bool rebuild(fsync_type& level, rd2_type& cp_rd2, std::string& cp_contents) {
+		//levels below the first are always in memory
+		StringChunkWriter writer(level.contents.data());
+		if( !level.reconstruct(cp_rd2, level.contents.data(), writer) ) {
+			return false;
+		}
+		cp_contents.swap(writer.contents);
+		return true;
+	}
+
+	// my chunks that the counterparty does not have, in file order
+	static void get_distinct_contents(fsync_type& level, const rd2_type& cp_rd2,
+                                      std::vector<char>& distinct_contents) {
+		//hash_exists follows the order of my sorted hashes
+		FlatHashSet<hash_type> cp_has;
+		auto it1 = cp_rd2.hash_exists.begin();
+		auto it2 = level.my_rd1.hashes_to_poslen.begin();
+		for(; it1 != cp_rd2.hash_exists.end(); ++it1, ++it2) {
+			if( *it1 ) {
+				cp_has.insert(it2->first);
+			}
+		}
+
+		std::vector<char> buf;
+		level.load_contents(buf);
+		size_t curr_pos = 0;
+		for(auto it = level.my_rd1.hashes.begin(); it != level.my_rd1.hashes.end(); ++it) {
+			if( !cp_has.count(it->first) ) {
+				distinct_contents.insert(distinct_contents.end(),
+                                         buf.begin() + curr_pos, buf.begin() + curr_pos + it->second);
+			}
+			curr_pos += it->second;
+		}
+	}
+
+	// replaces the lengths sent for new chunks with their contents, which follow one another
+	// in the counterparty's contents of the next level
+	static void fill_new_chunks(const std::string& contents, rd2_type& cp_rd2) {
+		size_t curr_pos = 0;
+		for(auto it = cp_rd2.new_chunk_info.begin(); it != cp_rd2.new_chunk_info.end(); ++it) {
+			size_t len = decode_length(*it);
+			if( len > contents.size() - curr_pos ) {
+				throw std::runtime_error("New chunks are longer than the level below them");
+			}
+			*it = contents.substr(curr_pos, len);
+			curr_pos += len;
+		}
+		if( curr_pos != contents.size() ) {
+			throw std::runtime_error("New chunks are shorter than the level below them");
+		}
+	}
+
+	// lengths are sent as varints
+	static std::string encode_length(size_t len) {
+		std::string res;
+		Round2Codec<rd2_type>::put_varint(len, res);
+		return res;
+	}
+
+	static size_t decode_length(const std::string& encoding) {
+		size_t pos = 0;
+		uint64_t len = Round2Codec<rd2_type>::get_varint(encoding, pos);
+		if( pos != encoding.size() ) {
+			throw std::runtime_error("Round 2 message has a malformed varint");
+		}
+		return len;
+	}
+
+  private:
+	MultiLevelSynchronizer(const MultiLevelSynchronizer&);
+	MultiLevelSynchronizer& operator=(const MultiLevelSynchronizer&);
+};
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef _PARALLEL
+#define _PARALLEL
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** Data-parallel passes over arrays. The work is split into one contiguous range per thread,
+ ** with no range shorter than min_per_thread items, so small inputs stay on the calling thread.
+ **/
+
+inline size_t parallel_ranges(size_t n, size_t num_threads, size_t min_per_thread) {
+	size_t max_ranges = n / std::max(min_per_thread, (size_t) 1);
+	return std::max(std::min(num_threads, max_ranges), (size_t) 1);
+}
+
+// calls func(begin, end) for ranges covering [0, n), the first of them on the calling thread
+template <typename func_type>
+void parallel_for(size_t n, size_t num_threads, size_t min_per_thread, func_type func) {
+	size_t num_ranges = parallel_ranges(n, num_threads, min_per_thread);
+	size_t per_range = (n + num_ranges - 1) / num_ranges;
+	std::vector<std::thread> threads;
+	for(size_t begin = per_range; begin < n; begin += per_range) {
+		threads.push_back(std::thread(func, begin, std::min(begin + per_range, n)));
+	}
+	func((size_t) 0, std::min(per_range, n));
+	for(auto it = threads.begin(); it != threads.end(); ++it) {
+		it->join();
+	}
+}
+
+// sorts each range on its own thread, then merges neighbouring ranges pairwise
+template <typename iterator, typename compare>
+void parallel_sort(iterator first, iterator last, size_t num_threads, size_t min_per_thread, compare comp) {
+	size_t n = last - first;
+	size_t num_ranges = parallel_ranges(n, num_threads, min_per_thread);
+	size_t per_range = (n + num_ranges - 1) / num_ranges;
+	std::vector<size_t> bounds;
+	for(size_t begin = 0; begin < n; begin += per_range) {
+		bounds.push_back(begin);
+	}
+	bounds.push_back(n);
+	num_ranges = bounds.size() - 1;
+	parallel_for(num_ranges, num_ranges, 1, [&](size_t begin, size_t end) {
+		for(size_t i = begin; i < end; ++i) {
+			std::sort(first + bounds[i], first + bounds[i+1], comp);
+		}
+	});
+	for(size_t width = 1; width < num_ranges; width *= 2) {
+		size_t num_merges = (num_ranges - 1) / (2*width) + 1;
+		parallel_for(num_merges, num_merges, 1, [&](size_t begin, size_t end) {
+			for(size_t m = begin; m < end; ++m) {
+				size_t i = 2*width*m;
+				if( i + width < num_ranges ) {
+					std::inplace_merge(first + bounds[i], first + bounds[i + width],
+                                       first + bounds[std::min(i + 2*width, num_ranges)], comp);
+				}
+			}
+		});
+	}
+}
+
+template <typename iterator>
+void parallel_sort(iterator first, iterator last, size_t num_threads, size_t min_per_thread) {
+	parallel_sort(first, last, num_threads, min_per_thread, std::less<typename std::iterator_traits<iterator>::value_type>());
+}
+
+/** StageThread runs tasks on a thread of its own, one after the other in the order they were
+ ** queued, so a producer can hand work on to the next stage of a pipeline and go on. At most
+ ** max_queued tasks wait at a time; queueing more blocks until one is taken. An exception from
+ ** a task skips the tasks after it and is thrown again by wait().
+ **/
+class StageThread {
+  public:
+	StageThread(size_t max_queued = 16): max_queued(max_queued), busy(false), stopping(false),
+                                         thread(&StageThread::loop, this) {}
+
+	// runs the tasks still queued before returning
+	~StageThread() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		thread.join();
+	}
+
+	void run(const std::function<void()>& task) {
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return tasks.size() < max_queued; });
+		tasks.push_back(task);
+		changed.notify_all();
+	}
+
+	// blocks until the queued tasks have run
+	void wait() {
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return tasks.empty() && !busy; });
+		if( error ) {
+			std::exception_ptr e = error;
+			error = std::exception_ptr();
+			std::rethrow_exception(e);
+		}
+	}
+
+  private:
+	size_t max_queued;
+	std::deque<std::function<void()> > tasks;
+	bool busy; //running a task taken off tasks
+	bool stopping;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::thread thread;
+
+	void loop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while( true ) {
+			changed.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if( tasks.empty() ) {
+				return;
+			}
+			std::function<void()> task = tasks.front();
+			tasks.pop_front();
+			busy = true;
+			bool skip = (bool) error;
+			changed.notify_all();
+			lock.unlock();
+			std::exception_ptr task_error;
+			if( !skip ) {
+				try {
+					task();
+				} catch( ... ) {
+					task_error = std::current_exception();
+				}
+			}
+			lock.lock();
+			if( task_error ) {
+				error = task_error;
+			}
+			busy = false;
+			changed.notify_all();
+		}
+	}
+
+	StageThread(const StageThread&);
+	StageThread& operator=(const StageThread&);
+};
+
+/** WorkerPool runs tasks on a fixed number of threads, in no particular order. Tasks still
+ ** queued when it goes away are run first. An exception from a task is reported and dropped.
+ **/
+class WorkerPool {
+  public:
+	WorkerPool(size_t num_threads): stopping(false) {
+		for(size_t i = 0; i < std::max(num_threads, (size_t) 1); ++i) {
+			threads.push_back(std::thread(&WorkerPool::loop, this));
+		}
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		for(auto it = threads.begin(); it != threads.end(); ++it) {
+			it->join();
+		}
+	}
+
+	void run(const std::function<void()>& task) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(task);
+		}
+		changed.notify_one();
+	}
+
+	size_t size() const {
+		return threads.size();
+	}
+
+  private:
+	std::deque<std::function<void()> > tasks;
+	bool stopping;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::vector<std::thread> threads;
+
+	void loop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while( true ) {
+			changed.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if( tasks.empty() ) {
+				return;
+			}
+			std::function<void()> task = tasks.front();
+			tasks.pop_front();
+			lock.unlock();
+			try {
+				task();
+			} catch( std::exception& e ) {
+				std::cerr << "Worker task failed: " << e.what() << std::endl;
+			}
+			lock.lock();
+		}
+	}
+
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+};
+
+#endif
@@ -0,0 +1,123 @@
+#include "file_sync.hpp"
+#include "compression.hpp"
+#include "parallel.hpp"
+
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "IBLT_helpers.hpp"
+
+typedef FileSynchronizer<uint64_t> fsync_type;
+
+// everything written up to a sync flush can be inflated as soon as it arrives
+void testStreams() {
+	keyGenerator<uint64_t> kg(10);
+	std::string dictionary(5000, '\0');
+	for(size_t i = 0; i < dictionary.size(); ++i) {
+		dictionary[i] = 'a' + kg.generate_key() % 4;
+	}
+	DeflateStream deflater(dictionary);
+	InflateStream inflater(dictionary);
+	std::string sent, received;
+	for(size_t i = 0; i < 50; ++i) {
+		std::string piece = i % 7 == 0 ? std::string() : dictionary.substr(kg.generate_key() % 4000, kg.generate_key() % 100000);
+		for(size_t j = 0; j < piece.size(); j += 1 + kg.generate_key() % 50) {
+			piece[j] = 'a' + kg.generate_key() % 26;
+		}
+		sent += piece;
+		std::string frame = deflater.write(piece, i + 1 < 50 ? Z_SYNC_FLUSH : Z_FINISH);
+		bool finished = inflater.write(frame, received);
+		assert( finished == (i + 1 == 50) );
+		(void) finished;
+		assert( received == sent );
+	}
+	std::cout << "Streams of " << sent.size() << " bytes inflated frame by frame" << std::endl;
+}
+
+// tasks run in order on the stage, and one that throws skips the rest until wait()
+void testStage() {
+	StageThread stage(2);
+	std::vector<size_t> order;
+	for(size_t i = 0; i < 100; ++i) {
+		stage.run([i, &order]() { order.push_back(i); });
+	}
+	stage.wait();
+	assert( order.size() == 100 );
+	for(size_t i = 0; i < order.size(); ++i) {
+		assert( order[i] == i );
+	}
+
+	stage.run([]() { throw std::runtime_error("stage failed"); });
+	stage.run([&order]() { order.push_back(100); });
+	bool thrown = false;
+	try {
+		stage.wait();
+	} catch( std::runtime_error& e ) {
+		thrown = true;
+	}
+	assert( thrown && order.size() == 100 );
+	(void) thrown;
+	stage.run([&order]() { order.push_back(100); });
+	stage.wait();
+	assert( order.size() == 101 );
+	std::cout << "Stage tasks ran in order" << std::endl;
+}
+
+// pipelined parties rebuild the same file as sequential ones, with round 2 taken frame by
+// frame, in about as many bytes
+void testPipelinedSync(const std::string& file1, const std::string& file2, size_t num_changes) {
+	generate_random_file(file1, 500000);
+	generate_block_changed_file(file1, file2, num_changes, 1000);
+	std::string output_file = "tmp/pipeline_out.txt";
+
+	fsync_type sequential_A(file1, 500), sequential_B(file2, 500);
+	size_t diff_est = sequential_B.receive_strata_encoding(sequential_A.send_strata_encoding());
+	std::string rd2_encoding;
+	while( !sequential_B.receive_IBLT_encoding(sequential_A.send_IBLT_encoding(diff_est), rd2_encoding) ) {
+		diff_est = sequential_B.retry_estimate();
+	}
+
+	fsync_type file_sync_A(file1, 500), file_sync_B(file2, 500);
+	file_sync_A.pipelined = file_sync_B.pipelined = true;
+	diff_est = file_sync_B.receive_strata_encoding(file_sync_A.send_strata_encoding());
+	std::vector<std::string> frames;
+	while( true ) {
+		std::string iblt_encoding = file_sync_A.send_IBLT_encoding(diff_est);
+		//hashing the keys ahead builds the same IBLT
+		assert( iblt_encoding == sequential_A.send_IBLT_encoding(diff_est) );
+		if( file_sync_B.receive_IBLT_encoding(iblt_encoding, [&frames](const std::string& frame) {
+			frames.push_back(frame);
+		}) ) {
+			break;
+		}
+		assert( frames.empty() );
+		diff_est = file_sync_B.retry_estimate();
+	}
+
+	size_t frame_bytes = 0;
+	for(size_t i = 0; i < frames.size(); ++i) {
+		bool last = file_sync_A.receive_rd2_frame(frames[i]);
+		assert( last == (i + 1 == frames.size()) );
+		(void) last;
+		frame_bytes += frames[i].size();
+	}
+	unlink(output_file.c_str());
+	bool rebuilt = file_sync_A.finish_rd2_frames(output_file);
+	assert( rebuilt );
+	(void) rebuilt;
+	assert( read_contents(output_file) == read_contents(file2) );
+	assert( frame_bytes <= rd2_encoding.size() + rd2_encoding.size() / 10 + 64 );
+	std::cout << "Pipelined round 2 of " << num_changes << " changes in " << frames.size() << " frames of "
+              << frame_bytes << " bytes, " << rd2_encoding.size() << " bytes in one message" << std::endl;
+}
+
+int main() {
+	testStreams();
+	testStage();
+	testPipelinedSync("tmp/pipeline_A.txt", "tmp/pipeline_B.txt", 10);
+	testPipelinedSync("tmp/pipeline_A.txt", "tmp/pipeline_B.txt", 300);
+	return 1;
+}
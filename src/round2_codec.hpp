@@ -0,0 +1,368 @@
+#ifndef _ROUND2_CODEC
+#define _ROUND2_CODEC
+
+#include <stdint.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/** Bit streams for the round 2 codec. Bits are packed starting from the least significant bit
+ ** of each byte.
+ **/
+class BitWriter {
+  public:
+	std::string bytes;
+	uint64_t acc;
+	int num_bits; //bits in acc not yet flushed to bytes
+
+	BitWriter(): acc(0), num_bits(0) {}
+
+	// writes the low num_value_bits bits of value
+	void put(uint64_t value, int num_value_bits) {
+		while( num_value_bits > 32 ) {
+			put(value & 0xffffffff, 32);
+			value >>= 32;
+			num_value_bits -= 32;
+		}
+		if( num_value_bits < 64 ) {
+			value &= ((uint64_t) 1 << num_value_bits) - 1;
+		}
+		acc |= value << num_bits;
+		num_bits += num_value_bits;
+		while( num_bits >= 8 ) {
+			bytes.push_back((char) (acc & 0xff));
+			acc >>= 8;
+			num_bits -= 8;
+		}
+	}
+
+	// Elias gamma code of value >= 1, which takes 2*floor(log2(value)) + 1 bits
+	void put_gamma(uint64_t value) {
+		int len = floor_log2(value);
+		put(0, len);
+		put(1, 1);
+		put(value, len);
+	}
+
+	std::string& finish() {
+		if( num_bits > 0 ) {
+			bytes.push_back((char) acc);
+			acc = 0;
+			num_bits = 0;
+		}
+		return bytes;
+	}
+
+	static int floor_log2(uint64_t value) {
+		int res = 0;
+		while( value >>= 1 ) {
+			++res;
+		}
+		return res;
+	}
+
+	static size_t gamma_bits(uint64_t value) {
+		return 2*floor_log2(value) + 1;
+	}
+};
+
+class BitReader {
+  public:
+	const unsigned char* data;
+	size_t num_bytes;
+	size_t bit_pos;
+
+	BitReader(const char* data, size_t num_bytes):
+              data((const unsigned char*) data), num_bytes(num_bytes), bit_pos(0) {}
+
+	bool get_bit() {
+		if( bit_pos >= 8*num_bytes ) {
+			throw std::runtime_error("Round 2 message is truncated");
+		}
+		bool res = (data[bit_pos/8] >> (bit_pos % 8)) & 1;
+		++bit_pos;
+		return res;
+	}
+
+	size_t bits_left() const {
+		return 8*num_bytes - bit_pos;
+	}
+
+	uint64_t get(int num_value_bits) {
+		uint64_t res = 0;
+		for(int i = 0; i < num_value_bits; ++i) {
+			res |= (uint64_t) get_bit() << i;
+		}
+		return res;
+	}
+
+	uint64_t get_gamma() {
+		int len = 0;
+		while( !get_bit() ) {
+			if( ++len >= 64 ) {
+				throw std::runtime_error("Round 2 message has a malformed gamma code");
+			}
+		}
+		return ((uint64_t) 1 << len) | get(len);
+	}
+};
+
+/** Round2Codec encodes the round 2 message of the file synchronization protocol.
+ **
+ ** chunk_exists and hash_exists are written either one bit per flag or, when it is shorter and
+ ** it usually is for files that mostly agree, as gamma coded run lengths. An index in
+ ** existing_chunk_encoding following a chunk that exists picks among the chunks starting with
+ ** the same bytes, and is almost always 0; these are sent as gamma coded runs of zeros, so a
+ ** stretch of unchanged chunks costs a few bits in total. Any other index points into the
+ ** counterparty's sorted hashes, which are uniformly distributed, and is sent in as many bits
+ ** as the largest such index needs. Lengths of new chunks follow as varints, then their
+ ** contents, either as they are or packed into one deflated stream, and the Merkle root of the
+ ** file. Everything before the contents is the layout, which can also be sent ahead on its own.
+ **
+ ** Decoding throws std::runtime_error on malformed messages, and before allocating for more
+ ** flags or new chunk contents than the message can account for.
+ **/
+template <typename rd2_type>
+class Round2Codec {
+  public:
+	//runs make flags cheap, so their number cannot be bounded by the message size alone
+	static const uint64_t max_flags = (uint64_t) 1 << 28;
+	//most deflate expands its input by
+	static const uint64_t max_inflate_ratio = 1032;
+
+	// everything up to the contents of the new chunks: which chunks exist and where to find
+	// them, and the lengths of the new ones
+	static std::string encode_layout(const rd2_type& rd2) {
+		std::string res;
+		put_varint(rd2.chunk_exists.size(), res);
+		put_varint(rd2.hash_exists.size(), res);
+
+		//flags and indices into the sorted hashes, then the runs of the other indices
+		BitWriter bits, runs;
+		put_flags(rd2.chunk_exists, bits);
+		put_flags(rd2.hash_exists, bits);
+		int index_bits = index_width(rd2.hash_exists.size());
+		size_t zero_run = 0;
+		bool last_chunk_exists = false;
+		auto index = rd2.existing_chunk_encoding.begin();
+		for(auto it = rd2.chunk_exists.begin(); it != rd2.chunk_exists.end(); ++it) {
+			if( !*it ) {
+				last_chunk_exists = false;
+				continue;
+			}
+			if( index == rd2.existing_chunk_encoding.end() ) {
+				throw std::runtime_error("Round 2 info has fewer chunk indices than existing chunks");
+			}
+			if( !last_chunk_exists ) {
+				bits.put(*index, index_bits);
+			} else if( *index == 0 ) {
+				++zero_run;
+			} else {
+				runs.put_gamma(zero_run + 1);
+				runs.put_gamma(*index);
+				zero_run = 0;
+			}
+			last_chunk_exists = true;
+			++index;
+		}
+		if( zero_run > 0 ) {
+			runs.put_gamma(zero_run + 1);
+		}
+		put_varint(bits.finish().size(), res);
+		put_varint(runs.finish().size(), res);
+		res += bits.bytes;
+		res += runs.bytes;
+
+		for(auto it = rd2.new_chunk_info.begin(); it != rd2.new_chunk_info.end(); ++it) {
+			put_varint(it->size(), res);
+		}
+		return res;
+	}
+
+	static std::string encode(const rd2_type& rd2) {
+		std::string res = encode_layout(rd2);
+		put_varint(rd2.packed_contents.size(), res);
+		if( rd2.packed_contents.empty() ) {
+			for(auto it = rd2.new_chunk_info.begin(); it != rd2.new_chunk_info.end(); ++it) {
+				res += *it;
+			}
+		} else {
+			res += rd2.packed_contents;
+		}
+		put_varint(rd2.SHAHash.size(), res);
+		res += rd2.SHAHash;
+		return res;
+	}
+
+	// reads what encode_layout wrote; the new chunks get their lengths, to be filled in later,
+	// which may add up to no more than max_new_bytes. Returns the position right after the layout
+	static size_t decode_layout(const std::string& encoding, rd2_type& rd2, uint64_t max_new_bytes) {
+		size_t pos = 0;
+		size_t num_chunks = get_varint(encoding, pos);
+		size_t num_hashes = get_varint(encoding, pos);
+		size_t num_bit_bytes = get_varint(encoding, pos);
+		size_t num_run_bytes = get_varint(encoding, pos);
+		check_size(encoding, pos, num_bit_bytes);
+		BitReader bits(encoding.data() + pos, num_bit_bytes);
+		pos += num_bit_bytes;
+		check_size(encoding, pos, num_run_bytes);
+		BitReader runs(encoding.data() + pos, num_run_bytes);
+		pos += num_run_bytes;
+
+		get_flags(bits, num_chunks, rd2.chunk_exists);
+		get_flags(bits, num_hashes, rd2.hash_exists);
+		int index_bits = index_width(num_hashes);
+		size_t zero_run = 0; //zeros left in the current run
+		bool in_run = false; //whether the current run ends in a nonzero index
+		size_t num_new_chunks = 0;
+		bool last_chunk_exists = false;
+		for(auto it = rd2.chunk_exists.begin(); it != rd2.chunk_exists.end(); ++it) {
+			if( !*it ) {
+				++num_new_chunks;
+				last_chunk_exists = false;
+				continue;
+			}
+			if( !last_chunk_exists ) {
+				rd2.existing_chunk_encoding.push_back(bits.get(index_bits));
+			} else {
+				if( !in_run ) {
+					zero_run = runs.get_gamma() - 1;
+					in_run = true;
+				}
+				if( zero_run > 0 ) {
+					--zero_run;
+					rd2.existing_chunk_encoding.push_back(0);
+				} else {
+					rd2.existing_chunk_encoding.push_back(runs.get_gamma());
+					in_run = false;
+				}
+			}
+			last_chunk_exists = true;
+		}
+
+		//every length takes a byte, so there are no more of them than the message has room for
+		check_size(encoding, pos, num_new_chunks);
+		std::vector<uint64_t> new_chunk_sizes(num_new_chunks);
+		uint64_t new_bytes = 0;
+		for(size_t i = 0; i < num_new_chunks; ++i) {
+			new_chunk_sizes[i] = get_varint(encoding, pos);
+			if( new_chunk_sizes[i] > max_new_bytes - new_bytes ) {
+				throw std::runtime_error("Round 2 message has more new chunk contents than it can hold");
+			}
+			new_bytes += new_chunk_sizes[i];
+		}
+		for(size_t i = 0; i < num_new_chunks; ++i) {
+			rd2.new_chunk_info.push_back(std::string(new_chunk_sizes[i], '\0'));
+		}
+		return pos;
+	}
+
+	// the new chunks follow the layout in encoding, as they are or deflated, so their contents
+	// cannot be longer than what deflate makes of the whole message
+	static void decode(const std::string& encoding, rd2_type& rd2) {
+		size_t pos = decode_layout(encoding, rd2, (uint64_t) encoding.size() * max_inflate_ratio);
+		size_t packed_size = get_varint(encoding, pos);
+		if( packed_size > 0 ) {
+			//the contents are filled in once the receiver has unpacked them
+			check_size(encoding, pos, packed_size);
+			rd2.packed_contents = encoding.substr(pos, packed_size);
+			pos += packed_size;
+		} else {
+			for(auto it = rd2.new_chunk_info.begin(); it != rd2.new_chunk_info.end(); ++it) {
+				check_size(encoding, pos, it->size());
+				it->assign(encoding, pos, it->size());
+				pos += it->size();
+			}
+		}
+		size_t sha_size = get_varint(encoding, pos);
+		check_size(encoding, pos, sha_size);
+		rd2.SHAHash = encoding.substr(pos, sha_size);
+	}
+
+	// bits for an index into num_hashes sorted hashes
+	static int index_width(size_t num_hashes) {
+		return num_hashes > 1 ? BitWriter::floor_log2(num_hashes - 1) + 1 : 0;
+	}
+
+	static void put_flags(const std::vector<bool>& flags, BitWriter& bits) {
+		std::vector<size_t> runs;
+		size_t run_bits = 1;
+		for(size_t i = 0; i < flags.size(); ) {
+			size_t j = i;
+			while( j < flags.size() && flags[j] == flags[i] ) {
+				++j;
+			}
+			runs.push_back(j - i);
+			run_bits += BitWriter::gamma_bits(j - i);
+			i = j;
+		}
+		bool use_runs = run_bits < flags.size();
+		bits.put(use_runs, 1);
+		if( !use_runs ) {
+			for(auto it = flags.begin(); it != flags.end(); ++it) {
+				bits.put(*it, 1);
+			}
+			return;
+		}
+		//runs alternate between set and unset flags, starting with the first flag
+		bits.put(flags[0], 1);
+		for(auto it = runs.begin(); it != runs.end(); ++it) {
+			bits.put_gamma(*it);
+		}
+	}
+
+	static void get_flags(BitReader& bits, uint64_t num_flags, std::vector<bool>& flags) {
+		if( num_flags > max_flags ) {
+			throw std::runtime_error("Round 2 message has too many flags");
+		}
+		if( !bits.get_bit() ) {
+			if( num_flags > bits.bits_left() ) {
+				throw std::runtime_error("Round 2 message is truncated");
+			}
+			flags.reserve(num_flags);
+			for(size_t i = 0; i < num_flags; ++i) {
+				flags.push_back(bits.get_bit());
+			}
+			return;
+		}
+		bool value = bits.get_bit();
+		while( flags.size() < num_flags ) {
+			uint64_t run = bits.get_gamma();
+			if( run > num_flags - flags.size() ) {
+				throw std::runtime_error("Round 2 message has a run past its flags");
+			}
+			flags.insert(flags.end(), run, value);
+			value = !value;
+		}
+	}
+
+	static void put_varint(uint64_t value, std::string& res) {
+		while( value >= 0x80 ) {
+			res.push_back((char) ((value & 0x7f) | 0x80));
+			value >>= 7;
+		}
+		res.push_back((char) value);
+	}
+
+	static uint64_t get_varint(const std::string& encoding, size_t& pos) {
+		uint64_t value = 0;
+		for(int shift = 0; shift < 64; shift += 7) {
+			check_size(encoding, pos, 1);
+			unsigned char c = encoding[pos++];
+			value |= (uint64_t) (c & 0x7f) << shift;
+			if( !(c & 0x80) ) {
+				return value;
+			}
+		}
+		throw std::runtime_error("Round 2 message has a malformed varint");
+	}
+
+	static void check_size(const std::string& encoding, size_t pos, size_t len) {
+		if( pos > encoding.size() || len > encoding.size() - pos ) {
+			throw std::runtime_error("Round 2 message is truncated");
+		}
+	}
+};
+
+#endif
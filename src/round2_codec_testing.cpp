@@ -0,0 +1,163 @@
+#include "file_sync.hpp"
+#include "round2_codec.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "IBLT_helpers.hpp"
+
+typedef FileSynchronizer<uint64_t>::Round2Info rd2_type;
+typedef Round2Codec<rd2_type> codec_type;
+
+bool same_rd2(const rd2_type& a, const rd2_type& b) {
+	return a.chunk_exists == b.chunk_exists && a.hash_exists == b.hash_exists
+           && a.new_chunk_info == b.new_chunk_info
+           && a.existing_chunk_encoding == b.existing_chunk_encoding
+           && a.packed_contents == b.packed_contents && a.SHAHash == b.SHAHash;
+}
+
+// a round 2 message for num_chunks chunks, each new or not following the chunk before it with
+// probability 1/change_rate
+void fill_rd2(rd2_type& rd2, size_t num_chunks, size_t change_rate, keyGenerator<uint64_t>& kg) {
+	size_t num_hashes = num_chunks + kg.generate_key() % 100;
+	bool last_chunk_exists = false;
+	for(size_t i = 0; i < num_chunks; ++i) {
+		bool exists = kg.generate_key() % change_rate != 0;
+		rd2.chunk_exists.push_back(exists);
+		if( !exists ) {
+			rd2.new_chunk_info.push_back(std::string(kg.generate_key() % 300, 'a' + i % 26));
+		} else if( last_chunk_exists ) {
+			rd2.existing_chunk_encoding.push_back(kg.generate_key() % change_rate == 0 ? 1 + kg.generate_key() % 3 : 0);
+		} else {
+			rd2.existing_chunk_encoding.push_back(kg.generate_key() % num_hashes);
+		}
+		last_chunk_exists = exists;
+	}
+	for(size_t i = 0; i < num_hashes; ++i) {
+		rd2.hash_exists.push_back(kg.generate_key() % change_rate != 0);
+	}
+	rd2.SHAHash = HashUtil::SHA1Hash("round 2", 7);
+}
+
+// messages of every density survive a round trip, and mostly unchanged ones take little space
+void testRoundTrip() {
+	keyGenerator<uint64_t> kg(4);
+	size_t sizes[] = {0, 1, 2, 17, 1000, 100000};
+	size_t rates[] = {1, 2, 10, 1000};
+	for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+		for(size_t j = 0; j < sizeof(rates)/sizeof(rates[0]); ++j) {
+			rd2_type rd2, decoded;
+			fill_rd2(rd2, sizes[i], rates[j], kg);
+			std::string encoding = codec_type::encode(rd2);
+			codec_type::decode(encoding, decoded);
+			assert( same_rd2(rd2, decoded) );
+		}
+	}
+
+	rd2_type unchanged;
+	fill_rd2(unchanged, 100000, 100000, kg);
+	size_t metadata_bytes = codec_type::encode(unchanged).size();
+	assert( metadata_bytes < 1000 );
+	std::cout << "Round 2 codec round trips passed, " << metadata_bytes
+              << " bytes for 100000 mostly unchanged chunks" << std::endl;
+}
+
+// cutting a message short must be noticed rather than read past its end
+void testTruncated() {
+	keyGenerator<uint64_t> kg(5);
+	rd2_type rd2;
+	fill_rd2(rd2, 1000, 10, kg);
+	std::string encoding = codec_type::encode(rd2);
+	for(size_t len = 0; len < encoding.size(); len += 1 + len/8) {
+		rd2_type decoded;
+		bool thrown = false;
+		try {
+			codec_type::decode(encoding.substr(0, len), decoded);
+		} catch( std::runtime_error& e ) {
+			thrown = true;
+		}
+		assert( thrown );
+		(void) thrown;
+	}
+	std::cout << "Truncated round 2 messages rejected" << std::endl;
+}
+
+// whether decoding encoding throws, as it should, rather than allocating what it announces
+bool refused(const std::string& encoding) {
+	rd2_type decoded;
+	try {
+		codec_type::decode(encoding, decoded);
+	} catch( std::runtime_error& e ) {
+		return true;
+	}
+	return false;
+}
+
+// a few bytes announcing far more flags or new chunk contents than they hold are refused
+void testOversized() {
+	//2^40 chunks, and 2^20 of them flagged one bit each in a single byte
+	std::string many_chunks, many_bits;
+	codec_type::put_varint((uint64_t) 1 << 40, many_chunks);
+	codec_type::put_varint((uint64_t) 1 << 20, many_bits);
+	std::string flags;
+	codec_type::put_varint(0, flags);
+	codec_type::put_varint(1, flags);
+	codec_type::put_varint(0, flags);
+	flags.push_back('\0');
+	assert( refused(many_chunks + flags) );
+	assert( refused(many_bits + flags) );
+
+	//one new chunk of 2^60 bytes
+	rd2_type rd2;
+	rd2.chunk_exists.push_back(false);
+	rd2.new_chunk_info.push_back("a");
+	std::string layout = codec_type::encode_layout(rd2);
+	layout.resize(layout.size() - 1);
+	codec_type::put_varint((uint64_t) 1 << 60, layout);
+	codec_type::put_varint(0, layout);
+	assert( refused(layout) );
+	std::cout << "Oversized round 2 messages refused" << std::endl;
+}
+
+// indices and lengths past 32 bits, as in files of more than 4GB or 2^32 chunks
+void testWideValues() {
+	keyGenerator<uint64_t> kg(7);
+	std::vector<std::pair<uint64_t, int> > values;
+	BitWriter bits;
+	for(int width = 1; width <= 64; ++width) {
+		uint64_t value = kg.generate_key() >> (64 - width);
+		values.push_back(std::make_pair(value, width));
+		bits.put(value, width);
+		bits.put_gamma(value | 1);
+	}
+	std::string varints;
+	codec_type::put_varint((uint64_t) -1, varints);
+	codec_type::put_varint((uint64_t) 1 << 40, varints);
+
+	std::string& encoding = bits.finish();
+	BitReader reader(encoding.data(), encoding.size());
+	for(auto it = values.begin(); it != values.end(); ++it) {
+		uint64_t value = reader.get(it->second);
+		uint64_t gamma = reader.get_gamma();
+		assert( value == it->first && gamma == (it->first | 1) );
+		(void) value;
+		(void) gamma;
+	}
+	size_t pos = 0;
+	uint64_t first = codec_type::get_varint(varints, pos);
+	uint64_t second = codec_type::get_varint(varints, pos);
+	assert( first == (uint64_t) -1 && second == (uint64_t) 1 << 40 );
+	(void) first;
+	(void) second;
+	assert( codec_type::index_width((size_t) 1 << 40) == 40 );
+	std::cout << "Round 2 codec 64-bit values passed" << std::endl;
+}
+
+int main() {
+	testRoundTrip();
+	testTruncated();
+	testOversized();
+	testWideValues();
+	return 1;
+}
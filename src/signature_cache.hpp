@@ -0,0 +1,187 @@
+#ifndef _SIGNATURE_CACHE
+#define _SIGNATURE_CACHE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/** SignatureCache is a directory of chunk signatures, one EstimatorSnapshot per file. An entry
+ ** is named after the device and inode of the file it describes, and the snapshot itself
+ ** records the file's size and modification time, so a file that changed or was replaced
+ ** never matches a stale entry. Entries are touched on every hit, and once the directory grows
+ ** past max_bytes the least recently used ones are removed. The directory is listed once, when
+ ** the cache is first used; after that the entries are tracked in memory, so neither hits nor
+ ** misses scan it. Entries written there by others are only seen by a cache made after them.
+ **
+ ** Threads may share a cache. Each entry can be locked, so sessions opening the same file at once
+ ** wait for the first to fingerprint it and then load its snapshot.
+ **/
+class SignatureCache {
+  public:
+	std::string cache_dir;
+	size_t max_bytes;
+	std::atomic<size_t> hits, misses;
+
+	SignatureCache(const std::string& cache_dir, size_t max_bytes = (size_t) 1 << 30):
+                   cache_dir(cache_dir), max_bytes(max_bytes), hits(0), misses(0), loaded(false),
+                   total_bytes(0) {
+		if( mkdir(cache_dir.c_str(), 0755) != 0 && errno != EEXIST ) {
+			std::cerr << "Unable to create signature cache " << cache_dir << std::endl;
+		}
+	}
+
+	// path of the entry for filename, or the empty string if the file cannot be found.
+	// Signatures made with other block sizes or key widths are kept in separate entries
+	std::string entry_path(const std::string& filename, size_t avg_block_size, size_t hash_bytes) const {
+		struct stat st;
+		if( stat(filename.c_str(), &st) != 0 ) {
+			return std::string();
+		}
+		char name[96];
+		snprintf(name, sizeof(name), "%llx-%llx-%zu-%zu.sig",
+                 (unsigned long long) st.st_dev, (unsigned long long) st.st_ino,
+                 avg_block_size, hash_bytes);
+		return cache_dir + "/" + name;
+	}
+
+	// holds an entry's mutex until it goes away, and keeps the mutex from being dropped meanwhile
+	class EntryLock {
+	  public:
+		EntryLock(const std::shared_ptr<std::mutex>& entry_mutex): entry_mutex(entry_mutex), lock(*entry_mutex) {}
+
+	  private:
+		std::shared_ptr<std::mutex> entry_mutex; //outlives lock
+		std::unique_lock<std::mutex> lock;
+	};
+
+	// holds off other threads locking the same entry until the lock is released
+	EntryLock lock_entry(const std::string& path) {
+		std::shared_ptr<std::mutex> entry_mutex;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::shared_ptr<std::mutex>& m = entry_mutexes[path];
+			if( !m ) {
+				m.reset(new std::mutex);
+			}
+			entry_mutex = m;
+		}
+		return EntryLock(entry_mutex);
+	}
+
+	// number of entries that have a mutex
+	size_t num_entry_mutexes() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return entry_mutexes.size();
+	}
+
+	// marks an entry as recently used
+	void touch(const std::string& path) {
+		utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+		std::lock_guard<std::mutex> lock(mutex);
+		load_entries();
+		auto it = entries.find(path);
+		if( it != entries.end() ) {
+			lru.splice(lru.end(), lru, it->second.first);
+		}
+	}
+
+	// takes note of an entry just written, then removes the least recently used entries until
+	// the cache fits in max_bytes, along with their mutexes unless some thread holds or waits
+	// for one
+	void add(const std::string& path) {
+		struct stat st;
+		if( stat(path.c_str(), &st) != 0 ) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		load_entries();
+		auto it = entries.find(path);
+		if( it != entries.end() ) {
+			total_bytes -= it->second.second;
+			lru.splice(lru.end(), lru, it->second.first);
+			it->second.second = st.st_size;
+		} else {
+			entries[path] = std::make_pair(lru.insert(lru.end(), path), (size_t) st.st_size);
+		}
+		total_bytes += st.st_size;
+
+		while( total_bytes > max_bytes && !lru.empty() ) {
+			std::string oldest = lru.front();
+			unlink(oldest.c_str());
+			total_bytes -= entries[oldest].second;
+			entries.erase(oldest);
+			lru.pop_front();
+			drop_entry_mutex(oldest);
+		}
+	}
+
+  private:
+	std::mutex mutex;
+	//one per entry locked since it was last evicted
+	std::map<std::string, std::shared_ptr<std::mutex> > entry_mutexes;
+	bool loaded; //whether the directory has been listed
+	std::list<std::string> lru; //entries, least recently used first
+	//each entry's place in lru, and its size
+	std::map<std::string, std::pair<std::list<std::string>::iterator, size_t> > entries;
+	size_t total_bytes; //of all entries
+
+	// lists the entries in the directory, oldest first, the first time it is called; called
+	// with mutex held
+	void load_entries() {
+		if( loaded ) {
+			return;
+		}
+		loaded = true;
+		DIR* dir = opendir(cache_dir.c_str());
+		if( !dir ) {
+			return;
+		}
+		std::vector<std::pair<int64_t, std::pair<std::string, size_t> > > found; //mtime, path, size
+		struct dirent* ent;
+		while( (ent = readdir(dir)) != NULL ) {
+			std::string name(ent->d_name);
+			if( name.size() < 4 || name.compare(name.size() - 4, 4, ".sig") != 0 ) {
+				continue;
+			}
+			std::string path = cache_dir + "/" + name;
+			struct stat st;
+			if( stat(path.c_str(), &st) != 0 ) {
+				continue;
+			}
+			int64_t mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+			found.push_back(std::make_pair(mtime, std::make_pair(path, (size_t) st.st_size)));
+		}
+		closedir(dir);
+
+		std::sort(found.begin(), found.end());
+		for(auto it = found.begin(); it != found.end(); ++it) {
+			const std::string& path = it->second.first;
+			entries[path] = std::make_pair(lru.insert(lru.end(), path), it->second.second);
+			total_bytes += it->second.second;
+		}
+	}
+
+	// a mutex only referenced from the map is neither held nor waited for, and no thread can
+	// get to it without taking mutex first, which the caller holds
+	void drop_entry_mutex(const std::string& path) {
+		auto it = entry_mutexes.find(path);
+		if( it != entry_mutexes.end() && it->second.use_count() == 1 ) {
+			entry_mutexes.erase(it);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "file_sync.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "IBLT_helpers.hpp"
+
+typedef uint64_t hash_type;
+typedef FileSynchronizer<hash_type> fsync_type;
+
+std::string estimator_image(StrataEstimator<hash_type>& estimator) {
+	std::string image(estimator.snapshot_bytes(), '\0');
+	estimator.write_snapshot(&image[0]);
+	return image;
+}
+
+// a snapshot written by one synchronizer restores the same estimator and chunks in the next
+void testRoundTrip(const std::string& file, const std::string& snapshot_file, size_t avg_block_size) {
+	remove(snapshot_file.c_str());
+	fsync_type fresh(file, avg_block_size, snapshot_file);
+	fsync_type restored(file, avg_block_size, snapshot_file);
+
+	assert( restored.my_rd1.hashes == fresh.my_rd1.hashes );
+	assert( restored.my_rd1.hashes_to_poslen == fresh.my_rd1.hashes_to_poslen );
+	assert( restored.overlap == fresh.overlap );
+	assert( estimator_image(restored.my_rd1.estimator) == estimator_image(fresh.my_rd1.estimator) );
+
+	//keys made with another digest are not taken from the snapshot
+	fsync_type other_digest(file, avg_block_size, snapshot_file, MURMUR64);
+	fsync_type direct(file, avg_block_size, MURMUR64);
+	assert( other_digest.my_rd1.hashes == direct.my_rd1.hashes );
+	assert( other_digest.my_rd1.hashes != fresh.my_rd1.hashes );
+	std::cout << "Snapshot round trip with " << fresh.my_rd1.hashes.size() << " chunks passed" << std::endl;
+}
+
+// a snapshot whose chunk count is off, even by a multiple that wraps around the size of its
+// records, is not restored
+void testForgedCount(const std::string& file, const std::string& snapshot_file, size_t avg_block_size) {
+	remove(snapshot_file.c_str());
+	fsync_type fresh(file, avg_block_size, snapshot_file);
+	MappedFile mf(snapshot_file);
+	std::string image(mf.data, mf.size);
+	typedef EstimatorSnapshot<hash_type> snapshot_type;
+	snapshot_type::header hdr;
+	memcpy(&hdr, image.data(), sizeof(hdr));
+	uint64_t forged[] = {hdr.num_chunks + ((uint64_t) 1 << 60), hdr.num_chunks + 1};
+	for(size_t i = 0; i < sizeof(forged)/sizeof(forged[0]); ++i) {
+		snapshot_type::header bad = hdr;
+		bad.num_chunks = forged[i];
+		std::string bad_image = image;
+		memcpy(&bad_image[0], &bad, sizeof(bad));
+		snapshot_type snapshot;
+		snapshot.avg_block_size = avg_block_size;
+		StrataEstimator<hash_type> estimator;
+		snapshot_type::chunk_list hashes;
+		bool restored = snapshot.restore(bad_image.data(), bad_image.size(), estimator, hashes);
+		assert( !restored );
+		(void) restored;
+	}
+	std::cout << "Snapshots with forged chunk counts refused" << std::endl;
+}
+
+// after the file changes, the incrementally updated estimator must equal one built from scratch
+void testIncrementalUpdate(const std::string& file, 
+                           const std::string& new_file, 
+                           const std::string& snapshot_file, 
+                           size_t avg_block_size) {
+	remove(snapshot_file.c_str());
+	{
+		fsync_type original(file, avg_block_size, snapshot_file);
+	}
+	rename(new_file.c_str(), file.c_str());
+
+	fsync_type updated(file, avg_block_size, snapshot_file);
+	fsync_type rebuilt(file, avg_block_size);
+	assert( updated.my_rd1.hashes == rebuilt.my_rd1.hashes );
+	assert( estimator_image(updated.my_rd1.estimator) == estimator_image(rebuilt.my_rd1.estimator) );
+
+	//the refreshed snapshot should now be picked up as is
+	fsync_type restored(file, avg_block_size, snapshot_file);
+	assert( estimator_image(restored.my_rd1.estimator) == estimator_image(rebuilt.my_rd1.estimator) );
+	std::cout << "Incremental estimator update passed" << std::endl;
+}
+
+// unchanged files are served from the cache, changed ones are fingerprinted again, and the
+// least recently used entries are evicted once the cache is full
+void testSignatureCache(const std::string& file, const std::string& other_file,
+                        const std::string& cache_dir, size_t avg_block_size) {
+	SignatureCache cache(cache_dir);
+	std::string entry = cache.entry_path(file, avg_block_size, sizeof(hash_type));
+	std::string other_entry = cache.entry_path(other_file, avg_block_size, sizeof(hash_type));
+	remove(entry.c_str());
+	remove(other_entry.c_str());
+
+	fsync_type fresh(file, avg_block_size, cache);
+	fsync_type cached(file, avg_block_size, cache);
+	assert( cache.misses == 1 && cache.hits == 1 );
+	assert( cached.my_rd1.hashes == fresh.my_rd1.hashes );
+	assert( estimator_image(cached.my_rd1.estimator) == estimator_image(fresh.my_rd1.estimator) );
+
+	generate_random_file(file, 100000);
+	fsync_type changed(file, avg_block_size, cache);
+	fsync_type rebuilt(file, avg_block_size);
+	assert( cache.misses == 2 );
+	assert( changed.my_rd1.hashes == rebuilt.my_rd1.hashes );
+
+	//room for a single entry: adding another file evicts the first
+	struct stat st;
+	stat(entry.c_str(), &st);
+	cache.max_bytes = st.st_size;
+	fsync_type other(other_file, avg_block_size, cache);
+	assert( stat(entry.c_str(), &st) != 0 );
+	assert( stat(other_entry.c_str(), &st) == 0 );
+	//the evicted entry's mutex goes with it
+	assert( cache.num_entry_mutexes() == 1 );
+
+	//a cache over the same directory finds the entries already there, and evicts them first
+	SignatureCache reopened(cache_dir, cache.max_bytes);
+	fsync_type again(file, avg_block_size, reopened);
+	assert( reopened.misses == 1 );
+	assert( stat(entry.c_str(), &st) == 0 );
+	assert( stat(other_entry.c_str(), &st) != 0 );
+	std::cout << "Signature cache passed" << std::endl;
+}
+
+int main() {
+	const std::string file1 = "tmp/snapshot.txt";
+	const std::string file2 = "tmp/snapshot_changed.txt";
+	const std::string snapshot_file = "tmp/snapshot.snap";
+	const size_t avg_block_size = 100;
+
+	generate_random_file(file1, 100000);
+	testRoundTrip(file1, snapshot_file, avg_block_size);
+	testForgedCount(file1, snapshot_file, avg_block_size);
+
+	generate_block_changed_file(file1, file2, 20, 5);
+	testIncrementalUpdate(file1, file2, snapshot_file, avg_block_size);
+
+	const std::string file3 = "tmp/snapshot_other.txt";
+	generate_random_file(file3, 50000);
+	testSignatureCache(file1, file3, "tmp/sigcache", avg_block_size);
+	return 1;
+}
@@ -0,0 +1,473 @@
+#ifndef _SYNC_SERVER
+#define _SYNC_SERVER
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file_sync.hpp"
+#include "parallel.hpp"
+#include "signature_cache.hpp"
+#include "sync_session.hpp"
+#include "transport.hpp"
+
+/** SyncServer serves the files under root_dir to many clients at once, each one syncing the file
+ ** it names in its first request (see sync_session.hpp). One thread runs an epoll loop that does
+ ** all socket I/O without blocking, and gathers each connection's framed requests. A complete
+ ** request goes to a worker pool, since opening a file (fingerprinting it), peeling an IBLT and
+ ** encoding round 2 take far longer than moving the bytes. A client waits for the reply to each
+ ** request, so a connection has at most one request with the workers at a time and its session
+ ** is only touched by one thread at once; nothing more is read from it until that request is
+ ** handled, and nothing past the end of the next request. Replies are queued by the workers, or
+ ** by the stage thread sending pipelined frames, and the loop is woken through an eventfd to
+ ** send them.
+ **
+ ** Sessions of the same file share its signatures and estimator through cache: only the first
+ ** session to open a file fingerprints it, and the others load the snapshot it leaves behind.
+ **/
+template <typename hash_type>
+class SyncServer {
+  public:
+	typedef FileSynchronizer<hash_type> fsync_type;
+	typedef SyncServerSession<hash_type> session_type;
+	typedef Round2Codec<typename fsync_type::Round2Info> codec_type;
+
+	std::string root_dir;
+	SignatureCache& cache;
+	bool pipelined; //send round 2 in frames as it is determined
+	uint64_t max_message_size; //longer requests drop the connection as soon as their header is in
+	size_t threads_per_session; //threads a session hashes with
+	std::atomic<size_t> sessions_done, sessions_failed;
+
+	SyncServer(const std::string& root_dir, SignatureCache& cache, size_t num_workers, bool pipelined = false):
+               root_dir(root_dir), cache(cache), pipelined(pipelined), max_message_size((uint64_t) 1 << 28),
+               threads_per_session(std::max(std::thread::hardware_concurrency() / std::max(num_workers, (size_t) 1), (size_t) 1)),
+               sessions_done(0), sessions_failed(0), listen_fd(-1), stopping(false),
+               workers(new WorkerPool(num_workers)) {
+		epoll_fd = epoll_create1(0);
+		event_fd = eventfd(0, EFD_NONBLOCK);
+		if( epoll_fd < 0 || event_fd < 0 ) {
+			std::cerr << "Unable to set up event loop: " << strerror(errno) << std::endl;
+		} else {
+			watch(event_fd, EPOLLIN, EPOLL_CTL_ADD);
+		}
+	}
+
+	~SyncServer() {
+		workers.reset(); //finishes the requests in hand, whose replies go nowhere
+		for(auto it = connections.begin(); it != connections.end(); ++it) {
+			close(it->first);
+		}
+		if( listen_fd >= 0 ) {
+			close(listen_fd);
+		}
+		close(event_fd);
+		close(epoll_fd);
+	}
+
+	// listens on the loopback interface at port, or at a free port if port is 0
+	bool listen(uint16_t& port) {
+		listen_fd = listen_loopback(port);
+		if( listen_fd < 0 || !set_nonblocking(listen_fd) ) {
+			return false;
+		}
+		watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+		return true;
+	}
+
+	// serves clients until stop() is called
+	void run() {
+		std::vector<struct epoll_event> events(256);
+		while( !stopping ) {
+			int num_events = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+			if( num_events < 0 && errno != EINTR ) {
+				std::cerr << "Unable to wait for events: " << strerror(errno) << std::endl;
+				return;
+			}
+			for(int i = 0; i < num_events; ++i) {
+				int fd = events[i].data.fd;
+				if( fd == listen_fd ) {
+					accept_clients();
+				} else if( fd == event_fd ) {
+					uint64_t count;
+					while( read(event_fd, &count, sizeof(count)) > 0 ) {}
+					std::vector<int> ready;
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						ready.swap(woken);
+					}
+					for(auto it = ready.begin(); it != ready.end(); ++it) {
+						service(*it, false);
+					}
+				} else {
+					service(fd, (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0);
+				}
+			}
+		}
+	}
+
+	// makes run() return; may be called from any thread
+	void stop() {
+		stopping = true;
+		uint64_t one = 1;
+		if( write(event_fd, &one, sizeof(one)) < 0 ) {
+			std::cerr << "Unable to wake event loop" << std::endl;
+		}
+	}
+
+	size_t num_connections() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return connections.size();
+	}
+
+  private:
+	class Connection {
+	  public:
+		int fd;
+		std::string in; //received bytes not yet taken as requests, from in_pos on
+		size_t in_pos;
+		uint32_t events; //what it is watched for, none if it is not
+		std::unique_ptr<fsync_type> sync;
+		std::unique_ptr<session_type> session;
+		//shared with the workers, under the server's mutex
+		std::string out; //replies not yet sent, from out_pos on
+		size_t out_pos;
+		bool busy; //a request is with the workers
+		bool failed; //drop without waiting for the client
+		bool at_end; //the client has closed its side
+
+		Connection(int fd): fd(fd), in_pos(0), events(EPOLLIN), out_pos(0), busy(false), failed(false), at_end(false) {}
+	};
+
+	int listen_fd, epoll_fd, event_fd;
+	std::atomic<bool> stopping;
+	mutable std::mutex mutex;
+	std::map<int, std::unique_ptr<Connection> > connections; //owned by the loop
+	std::vector<int> woken; //connections with replies or finished requests
+	std::unique_ptr<WorkerPool> workers;
+
+	static bool set_nonblocking(int fd) {
+		int flags = fcntl(fd, F_GETFL);
+		if( flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0 ) {
+			std::cerr << "Unable to make socket nonblocking: " << strerror(errno) << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	void watch(int fd, uint32_t events, int op) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.fd = fd;
+		if( epoll_ctl(epoll_fd, op, fd, &ev) != 0 ) {
+			std::cerr << "Unable to watch socket: " << strerror(errno) << std::endl;
+		}
+	}
+
+	void accept_clients() {
+		while( true ) {
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+			if( fd < 0 ) {
+				if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+					std::cerr << "Unable to accept connection: " << strerror(errno) << std::endl;
+				}
+				if( errno != EINTR ) {
+					return;
+				}
+				continue;
+			}
+			set_no_delay(fd);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				connections[fd].reset(new Connection(fd));
+			}
+			watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+		}
+	}
+
+	// reads what the client sent, sends what is queued for it, hands its next request to the
+	// workers and closes it once it is done
+	void service(int fd, bool readable) {
+		Connection* conn;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = connections.find(fd);
+			if( it == connections.end() ) {
+				return;
+			}
+			conn = it->second.get();
+		}
+		//only the loop sets busy, so it cannot become set in between
+		if( readable && !is_busy(*conn) ) {
+			receive(*conn);
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		send(*conn);
+		if( conn->failed ) {
+			if( !conn->busy ) {
+				drop(conn, lock);
+			}
+			return;
+		}
+		if( conn->busy ) {
+			return;
+		}
+		std::string request;
+		if( next_request(*conn, request) ) {
+			conn->busy = true;
+			watch(*conn);
+			lock.unlock();
+			workers->run([this, conn, request]() { handle(conn, request); });
+		} else if( conn->failed || (conn->at_end && conn->out_pos == conn->out.size()) ) {
+			drop(conn, lock);
+		}
+	}
+
+	bool is_busy(const Connection& conn) const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return conn.busy;
+	}
+
+	// reads what the client sent, up to the end of its next request
+	void receive(Connection& conn) {
+		char buf[1 << 16];
+		while( true ) {
+			uint64_t len;
+			if( get_length(conn, len) ) {
+				if( len > max_message_size ) {
+					std::lock_guard<std::mutex> lock(mutex);
+					conn.failed = true;
+					return;
+				}
+				if( conn.in.size() - conn.in_pos - FrameTransport::header_size >= len ) {
+					return;
+				}
+			}
+			ssize_t res = read(conn.fd, buf, sizeof(buf));
+			if( res > 0 ) {
+				conn.in.append(buf, res);
+			} else if( res == 0 ) {
+				std::lock_guard<std::mutex> lock(mutex);
+				conn.at_end = true;
+				return;
+			} else if( errno == EINTR ) {
+				continue;
+			} else {
+				if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+					std::lock_guard<std::mutex> lock(mutex);
+					conn.failed = true;
+				}
+				return;
+			}
+		}
+	}
+
+	// whether the header of the next request is in, and the length it gives; one longer than
+	// max_message_size is reported
+	bool get_length(const Connection& conn, uint64_t& len) const {
+		if( conn.in.size() - conn.in_pos < FrameTransport::header_size ) {
+			return false;
+		}
+		len = FrameTransport::get_header(conn.in.data() + conn.in_pos);
+		if( len > max_message_size ) {
+			std::cerr << "Request of " << len << " bytes is longer than allowed" << std::endl;
+		}
+		return true;
+	}
+
+	// takes the next complete request off conn.in, if there is one; called with the mutex held
+	bool next_request(Connection& conn, std::string& request) {
+		uint64_t len;
+		if( !get_length(conn, len) ) {
+			return false;
+		}
+		if( len > max_message_size ) {
+			conn.failed = true;
+			return false;
+		}
+		if( conn.in.size() - conn.in_pos - FrameTransport::header_size < len ) {
+			return false;
+		}
+		request.assign(conn.in, conn.in_pos + FrameTransport::header_size, len);
+		conn.in_pos += FrameTransport::header_size + len;
+		if( conn.in_pos == conn.in.size() ) {
+			conn.in.clear();
+			conn.in_pos = 0;
+		} else if( conn.in_pos > (1 << 20) ) {
+			conn.in.erase(0, conn.in_pos);
+			conn.in_pos = 0;
+		}
+		return true;
+	}
+
+	// sends what it can of conn.out without blocking; called with the mutex held
+	void send(Connection& conn) {
+		while( conn.out_pos < conn.out.size() ) {
+			ssize_t res = ::send(conn.fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+			if( res > 0 ) {
+				conn.out_pos += res;
+			} else if( res < 0 && errno == EINTR ) {
+				continue;
+			} else {
+				if( res < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) {
+					conn.failed = true;
+				}
+				break;
+			}
+		}
+		if( conn.out_pos == conn.out.size() ) {
+			conn.out.clear();
+			conn.out_pos = 0;
+		}
+		watch(conn);
+	}
+
+	// watches conn for what it waits on: requests until the client closes its side, except while
+	// one is with the workers, and room to send while replies are queued; called with the mutex
+	// held
+	void watch(Connection& conn) {
+		uint32_t events = (conn.at_end || conn.failed || conn.busy ? 0 : EPOLLIN)
+                          | (conn.out.empty() || conn.failed ? 0 : EPOLLOUT);
+		if( events != conn.events ) {
+			watch(conn.fd, events, conn.events == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+			conn.events = events;
+		}
+	}
+
+	// closes conn, which no worker holds any more
+	void drop(Connection* conn, std::unique_lock<std::mutex>& lock) {
+		int fd = conn->fd;
+		bool done = conn->session && conn->session->done;
+		if( conn->events != 0 ) {
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		}
+		connections.erase(fd);
+		lock.unlock();
+		close(fd);
+		if( done ) {
+			++sessions_done;
+		} else {
+			++sessions_failed;
+		}
+	}
+
+	// queues a reply to conn and wakes the loop to send it; called from the workers
+	bool reply(Connection* conn, const std::string& message) {
+		char header[FrameTransport::header_size];
+		FrameTransport::put_header(message.size(), header);
+		std::lock_guard<std::mutex> lock(mutex);
+		conn->out.append(header, sizeof(header));
+		conn->out += message;
+		wake(conn->fd);
+		return !conn->failed;
+	}
+
+	// called with the mutex held
+	void wake(int fd) {
+		woken.push_back(fd);
+		uint64_t one = 1;
+		if( write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN ) {
+			std::cerr << "Unable to wake event loop" << std::endl;
+		}
+	}
+
+	// runs on a worker; conn stays open while it is busy, and may be dropped as soon as it is not
+	void handle(Connection* conn, const std::string& request) {
+		bool res = false;
+		try {
+			if( !conn->session ) {
+				res = open(*conn, request) && reply(conn, std::string(1, sync_message::opened));
+			} else {
+				res = conn->session->handle(request, [this, conn](const std::string& message) {
+					return reply(conn, message);
+				});
+			}
+		} catch( std::exception& e ) {
+			//e.g. the file went away while it was fingerprinted; only this session fails
+			std::cerr << "Session failed: " << e.what() << std::endl;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		conn->busy = false;
+		conn->failed = conn->failed || !res;
+		wake(conn->fd);
+	}
+
+	// sets up the session for the file the client asks for; it has to be a regular file within
+	// root_dir, named without going up a directory, and stay within root_dir once symbolic links
+	// are followed
+	bool open(Connection& conn, const std::string& request) {
+		if( request.empty() || request[0] != sync_message::open ) {
+			std::cerr << "Request before a file is opened" << std::endl;
+			return false;
+		}
+		size_t pos = 1;
+		size_t avg_block_size;
+		try {
+			avg_block_size = codec_type::get_varint(request, pos);
+		} catch( std::exception& e ) {
+			std::cerr << "Malformed open request" << std::endl;
+			return false;
+		}
+		std::string name = request.substr(pos);
+		if( name.empty() || name[0] == '/' || ("/" + name + "/").find("/../") != std::string::npos
+            || name.find('\0') != std::string::npos ) {
+			std::cerr << "Refusing to serve " << name << std::endl;
+			return false;
+		}
+		if( avg_block_size < MIN_ADAPTIVE_BLOCK_SIZE ) {
+			std::cerr << "Block size " << avg_block_size << " is too small" << std::endl;
+			return false;
+		}
+		std::string path;
+		struct stat st;
+		if( !resolve(name, path) || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ) {
+			std::cerr << "No file " << name << " to serve" << std::endl;
+			return false;
+		}
+		conn.sync.reset(new fsync_type(path, avg_block_size, cache));
+		conn.sync->num_threads = threads_per_session;
+		conn.sync->pipelined = pipelined;
+		conn.session.reset(new session_type(*conn.sync, pipelined));
+		return true;
+	}
+
+	// the path of name under root_dir with all symbolic links followed, if it is within root_dir
+	bool resolve(const std::string& name, std::string& path) const {
+		char* root = realpath(root_dir.c_str(), NULL);
+		char* resolved = realpath((root_dir + "/" + name).c_str(), NULL);
+		bool res = false;
+		if( root && resolved ) {
+			std::string prefix(root);
+			if( prefix.empty() || prefix[prefix.size() - 1] != '/' ) {
+				prefix += '/';
+			}
+			path = resolved;
+			res = path.compare(0, prefix.size(), prefix) == 0;
+		}
+		free(root);
+		free(resolved);
+		return res;
+	}
+
+	SyncServer(const SyncServer&);
+	SyncServer& operator=(const SyncServer&);
+};
+
+#endif
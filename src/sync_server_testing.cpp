@@ -0,0 +1,166 @@
+#include "sync_server.hpp"
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "IBLT_helpers.hpp"
+
+namespace po = boost::program_options;
+typedef FileSynchronizer<uint64_t> fsync_type;
+
+std::string open_request(size_t avg_block_size, const std::string& name) {
+	std::string request(1, sync_message::open);
+	Round2Codec<fsync_type::Round2Info>::put_varint(avg_block_size, request);
+	return request + name;
+}
+
+// a client that sends request, or only connects if it is empty, and should then be dropped
+bool misbehave(uint16_t port, const std::string& request) {
+	int fd = connect_loopback(port);
+	if( fd < 0 ) {
+		return false;
+	}
+	FrameTransport transport(fd);
+	std::string reply;
+	bool dropped = request.empty() || (transport.send(request) && !transport.receive(reply));
+	close(fd);
+	return dropped;
+}
+
+// a client that announces a request longer than the server takes, and should be dropped before
+// it sends any of it
+bool announce_oversized(uint16_t port, uint64_t max_message_size) {
+	int fd = connect_loopback(port);
+	if( fd < 0 ) {
+		return false;
+	}
+	char header[FrameTransport::header_size];
+	FrameTransport::put_header(max_message_size + 1, header);
+	FrameTransport transport(fd);
+	std::string reply;
+	bool dropped = write(fd, header, sizeof(header)) == (ssize_t) sizeof(header) && !transport.receive(reply);
+	close(fd);
+	return dropped;
+}
+
+// many clients at once each sync their own version of one of a few files with a single server,
+// which fingerprints each file once, while clients that misbehave are dropped without harm
+void testServer(size_t num_files, size_t num_clients, size_t num_workers, size_t file_len,
+                size_t avg_block_size, bool pipelined) {
+	std::string root_dir = "tmp/server_root", client_dir = "tmp/server_clients";
+	mkdir(root_dir.c_str(), 0755);
+	mkdir(client_dir.c_str(), 0755);
+	//a link within root_dir to a file outside of it
+	std::string outside_file = "tmp/server_outside.txt", link = root_dir + "/outside.txt";
+	generate_random_file(outside_file, file_len);
+	unlink(link.c_str());
+	int linked = symlink("../server_outside.txt", link.c_str());
+	assert( linked == 0 );
+	(void) linked;
+	SignatureCache cache("tmp/server_cache");
+	std::vector<std::string> names;
+	for(size_t i = 0; i < num_files; ++i) {
+		names.push_back("file" + std::to_string(i) + ".txt");
+		generate_random_file(root_dir + "/" + names[i], file_len);
+		std::string entry = cache.entry_path(root_dir + "/" + names[i], avg_block_size, sizeof(uint64_t));
+		remove(entry.c_str());
+	}
+	std::vector<std::string> client_files, output_files;
+	for(size_t i = 0; i < num_clients; ++i) {
+		client_files.push_back(client_dir + "/" + std::to_string(i) + ".txt");
+		output_files.push_back(client_dir + "/" + std::to_string(i) + ".out");
+		generate_block_changed_file(root_dir + "/" + names[i % num_files], client_files[i], 1 + i % 20, 100);
+		unlink(output_files[i].c_str());
+	}
+
+	SyncServer<uint64_t> server(root_dir, cache, num_workers, pipelined);
+	uint16_t port = 0;
+	bool listening = server.listen(port);
+	assert( listening );
+	(void) listening;
+	std::thread server_thread([&server]() { server.run(); });
+
+	std::vector<char> synced(num_clients, 0);
+	std::vector<std::thread> clients;
+	for(size_t i = 0; i < num_clients; ++i) {
+		clients.push_back(std::thread([&, i]() {
+			fsync_type sync(client_files[i], avg_block_size);
+			sync.num_threads = 1;
+			sync.pipelined = pipelined;
+			int fd = connect_loopback(port);
+			if( fd < 0 ) {
+				return;
+			}
+			FrameTransport transport(fd);
+			SyncClient<uint64_t> client(sync, transport);
+			synced[i] = client.open(names[i % num_files]) && client.run(output_files[i]);
+			close(fd);
+		}));
+	}
+	size_t num_bad = 0;
+	num_bad += misbehave(port, std::string());
+	num_bad += misbehave(port, open_request(avg_block_size, "../server_root/" + names[0]));
+	num_bad += misbehave(port, open_request(1, names[0]));
+	num_bad += misbehave(port, open_request(avg_block_size, "missing.txt"));
+	num_bad += misbehave(port, open_request(avg_block_size, "outside.txt"));
+	num_bad += misbehave(port, std::string(1, sync_message::strata));
+	num_bad += announce_oversized(port, server.max_message_size);
+	assert( num_bad == 7 );
+	for(auto it = clients.begin(); it != clients.end(); ++it) {
+		it->join();
+	}
+
+	//the server counts a session once it has seen the client go away
+	for(size_t i = 0; i < 1000 && server.sessions_done + server.sessions_failed < num_clients + num_bad; ++i) {
+		usleep(10000);
+	}
+	server.stop();
+	server_thread.join();
+	for(size_t i = 0; i < num_clients; ++i) {
+		assert( synced[i] );
+		assert( read_contents(output_files[i]) == read_contents(root_dir + "/" + names[i % num_files]) );
+	}
+	assert( server.sessions_done == num_clients && server.sessions_failed == num_bad );
+	assert( server.num_connections() == 0 );
+	assert( cache.misses == num_files && cache.hits == num_clients - num_files );
+	std::cout << "Server synced " << num_clients << " clients of " << num_files << " files with "
+              << num_workers << " workers" << (pipelined ? ", pipelined" : "") << ", dropped "
+              << num_bad << " bad clients" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	size_t num_files, num_clients, num_workers, file_len, avg_block_size;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("files", po::value<size_t>(&num_files)->default_value(4), "number of files served")
+		("clients", po::value<size_t>(&num_clients)->default_value(200), "number of concurrent clients")
+		("workers", po::value<size_t>(&num_workers)->default_value(4), "server worker threads")
+		("file-len", po::value<size_t>(&file_len)->default_value(100000), "File length")
+		("block-size", po::value<size_t>(&avg_block_size)->default_value(700), "avg block size")
+	;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if(vm.count("help")) {
+		std::cout << desc << "\n";
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	testServer(num_files, num_clients, num_workers, file_len, avg_block_size, false);
+	testServer(num_files, num_clients, num_workers, file_len, avg_block_size, true);
+	return 1;
+}
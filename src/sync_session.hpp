@@ -0,0 +1,254 @@
+#ifndef _SYNC_SESSION
+#define _SYNC_SESSION
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "file_sync.hpp"
+#include "transport.hpp"
+
+/** The file synchronization protocol as messages between a client, party A, which rebuilds the
+ ** server's version of a file over its own, and a server, party B. Each message starts with a
+ ** byte telling what it is:
+ **
+ **   client                                  server
+ **   'O' block size and file name      ->    (only to servers of many files)
+ **                                     <-    'A' file opened
+ **   'S' strata estimator              ->
+ **                                     <-    'E' difference estimate
+ **   'I' IBLT                          ->
+ **                                     <-    'R' estimate to retry with, or
+ **                                     <-    'M' round 2, or 'F' round 2 frames up to the last
+ **   'T' tree request                  ->    (only if the rebuilt file does not check out)
+ **                                     <-    'N' tree nodes
+ **   'C' chunk request                 ->
+ **                                     <-    'K' chunks
+ **   'D' done                          ->
+ **/
+namespace sync_message {
+	const char open = 'O', opened = 'A', strata = 'S', estimate = 'E', iblt = 'I', retry = 'R', rd2 = 'M', rd2_frame = 'F',
+               tree_request = 'T', tree_nodes = 'N', chunk_request = 'C', chunks = 'K', done = 'D';
+}
+
+/** SyncServerSession answers the requests of one client with my version of the file. It does not
+ ** read or write anything itself, so the same session runs over a blocking transport or in an
+ ** event loop.
+ **/
+template <typename hash_type>
+class SyncServerSession {
+  public:
+	typedef FileSynchronizer<hash_type> fsync_type;
+	typedef Round2Codec<typename fsync_type::Round2Info> codec_type;
+	typedef std::function<bool(const std::string&)> reply_func;
+
+	fsync_type& sync;
+	bool pipelined; //send round 2 in frames as it is determined
+	bool done; //the client is done
+
+	SyncServerSession(fsync_type& sync, bool pipelined = false): sync(sync), pipelined(pipelined), done(false) {}
+
+	// handles one request, passing the replies to reply. Returns false if the request is
+	// malformed or a reply could not be sent, after which the session should be dropped
+	bool handle(const std::string& request, const reply_func& reply) {
+		if( request.empty() ) {
+			std::cerr << "Empty request" << std::endl;
+			return false;
+		}
+		std::string body = request.substr(1);
+		try {
+			switch( request[0] ) {
+			case sync_message::strata: {
+				std::string res(1, sync_message::estimate);
+				codec_type::put_varint(sync.receive_strata_encoding(body), res);
+				return reply(res);
+			}
+			case sync_message::iblt:
+				return handle_IBLT(body, reply);
+			case sync_message::tree_request:
+				return reply(sync_message::tree_nodes + sync.send_tree_nodes(body));
+			case sync_message::chunk_request:
+				return reply(sync_message::chunks + sync.send_chunks(body));
+			case sync_message::done:
+				done = true;
+				return true;
+			}
+		} catch( std::exception& e ) {
+			std::cerr << "Unable to handle request: " << e.what() << std::endl;
+			return false;
+		}
+		std::cerr << "Unknown request " << (int) request[0] << std::endl;
+		return false;
+	}
+
+  private:
+	bool handle_IBLT(const std::string& body, const reply_func& reply) {
+		bool peeled;
+		if( pipelined ) {
+			peeled = sync.receive_IBLT_encoding(body, [&reply](const std::string& frame) {
+				if( !reply(sync_message::rd2_frame + frame) ) {
+					throw std::runtime_error("Unable to send round 2 frame");
+				}
+			});
+		} else {
+			std::string rd2_encoding;
+			peeled = sync.receive_IBLT_encoding(body, rd2_encoding);
+			if( peeled ) {
+				return reply(sync_message::rd2 + rd2_encoding);
+			}
+		}
+		if( peeled ) {
+			return true;
+		}
+		std::string res(1, sync_message::retry);
+		codec_type::put_varint(sync.retry_estimate(), res);
+		return reply(res);
+	}
+};
+
+// wall clock seconds of each round of a sync, as the client sees it
+struct SyncTimings {
+	double strata; //estimator sent to estimate back
+	double iblt; //first IBLT sent to first byte of round 2 back, with retries
+	double rd2; //round 2 received and the file rebuilt
+	double repair; //bad chunks found and fetched again
+	double total;
+	size_t iblt_retries;
+
+	SyncTimings(): strata(0), iblt(0), rd2(0), repair(0), total(0), iblt_retries(0) {}
+};
+
+/** SyncClient runs the client side of the protocol over a transport, rebuilding the server's
+ ** version of my file in output_file, and times each round.
+ **/
+template <typename hash_type>
+class SyncClient {
+  public:
+	typedef FileSynchronizer<hash_type> fsync_type;
+	typedef Round2Codec<typename fsync_type::Round2Info> codec_type;
+	typedef std::chrono::steady_clock clock_type;
+
+	fsync_type& sync;
+	FrameTransport& transport;
+	size_t max_iblt_retries;
+	SyncTimings timings;
+
+	SyncClient(fsync_type& sync, FrameTransport& transport): sync(sync), transport(transport), max_iblt_retries(8) {}
+
+	// asks a server of many files for the one named file, chunked with my block size
+	bool open(const std::string& file) {
+		std::string message(1, sync_message::open);
+		codec_type::put_varint(sync.avg_block_size, message);
+		std::string reply;
+		return request(message + file, sync_message::opened, reply);
+	}
+
+	bool run(const std::string& output_file) {
+		try {
+			clock_type::time_point start = clock_type::now();
+			bool res = run_rounds(output_file);
+			timings.total = FrameTransport::seconds_since(start);
+			return res;
+		} catch( std::exception& e ) {
+			std::cerr << "Malformed reply: " << e.what() << std::endl;
+			return false;
+		}
+	}
+
+  private:
+	bool run_rounds(const std::string& output_file) {
+		clock_type::time_point start = clock_type::now();
+		std::string reply;
+		if( !request(sync_message::strata + sync.send_strata_encoding(), sync_message::estimate, reply) ) {
+			return false;
+		}
+		size_t pos = 1;
+		size_t diff_estimate = codec_type::get_varint(reply, pos);
+		timings.strata = FrameTransport::seconds_since(start);
+
+		start = clock_type::now();
+		while( true ) {
+			if( !transport.send(sync_message::iblt + sync.send_IBLT_encoding(diff_estimate)) || !transport.receive(reply) ) {
+				return false;
+			}
+			if( reply.empty() || reply[0] != sync_message::retry ) {
+				break;
+			}
+			if( ++timings.iblt_retries > max_iblt_retries ) {
+				std::cerr << "Counterparty could not peel " << timings.iblt_retries << " IBLTs" << std::endl;
+				return false;
+			}
+			pos = 1;
+			diff_estimate = codec_type::get_varint(reply, pos);
+		}
+		timings.iblt = FrameTransport::seconds_since(start);
+
+		start = clock_type::now();
+		bool rebuilt;
+		if( !reply.empty() && reply[0] == sync_message::rd2 ) {
+			rebuilt = sync.receive_rd2_encoding(reply.substr(1), output_file);
+		} else {
+			while( true ) {
+				if( !expect(reply, sync_message::rd2_frame) ) {
+					return false;
+				}
+				if( sync.receive_rd2_frame(reply.substr(1)) ) {
+					break;
+				}
+				if( !transport.receive(reply) ) {
+					return false;
+				}
+			}
+			rebuilt = sync.finish_rd2_frames(output_file);
+		}
+		timings.rd2 = FrameTransport::seconds_since(start);
+
+		if( !rebuilt && sync.needs_repair() ) {
+			start = clock_type::now();
+			rebuilt = repair(output_file);
+			timings.repair = FrameTransport::seconds_since(start);
+		}
+		return transport.send(std::string(1, sync_message::done)) && rebuilt;
+	}
+
+	bool repair(const std::string& output_file) {
+		std::string reply;
+		while( !sync.bad_chunks_found() ) {
+			if( !request(sync_message::tree_request + sync.send_tree_request(), sync_message::tree_nodes, reply)
+                || !sync.receive_tree_nodes(reply.substr(1)) ) {
+				return false;
+			}
+		}
+		return request(sync_message::chunk_request + sync.send_chunk_request(), sync_message::chunks, reply)
+               && sync.receive_chunks(reply.substr(1), output_file);
+	}
+
+	// sends message and receives the reply, which should be of the given type
+	bool request(const std::string& message, char reply_type, std::string& reply) {
+		return transport.send(message) && transport.receive(reply) && expect(reply, reply_type);
+	}
+
+	static bool expect(const std::string& reply, char type) {
+		if( reply.empty() || reply[0] != type ) {
+			std::cerr << "Unexpected reply " << (reply.empty() ? 0 : (int) reply[0]) << std::endl;
+			return false;
+		}
+		return true;
+	}
+};
+
+// serves one client over transport until it is done or goes away; returns whether it finished
+template <typename hash_type>
+bool serve_client(SyncServerSession<hash_type>& session, FrameTransport& transport) {
+	std::string request;
+	while( !session.done && transport.receive(request) ) {
+		if( !session.handle(request, [&transport](const std::string& reply) { return transport.send(reply); }) ) {
+			return false;
+		}
+	}
+	return session.done;
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef _TRANSPORT
+#define _TRANSPORT
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+/** FrameTransport passes messages over a stream fd, such as one end of a Unix socket pair or a
+ ** TCP connection. Each message is preceded by its length as 8 bytes in network order. Sends
+ ** go out whole, with short writes continued where they stopped, so a slow reader holds the
+ ** writer back. Receives block until the whole message is in. Errors, and a stream that ends
+ ** within a message, are reported on stderr and returned as false. Processes using it should
+ ** ignore SIGPIPE, so a counterparty that goes away shows up as a failed send.
+ **/
+class FrameTransport {
+  public:
+	static const size_t header_size = 8;
+
+	int fd;
+	uint64_t max_message_size; //longer lengths are taken as a broken stream
+	//totals so far, with the time spent blocked in send and receive
+	uint64_t bytes_sent, bytes_received, messages_sent, messages_received;
+	double send_seconds, receive_seconds;
+
+	FrameTransport(int fd): fd(fd), max_message_size((uint64_t) 1 << 40), bytes_sent(0),
+                            bytes_received(0), messages_sent(0), messages_received(0),
+                            send_seconds(0), receive_seconds(0), at_end(false) {}
+
+	static void put_header(uint64_t len, char* header) {
+		for(size_t i = 0; i < header_size; ++i) {
+			header[i] = (char) (len >> 8*(header_size - 1 - i));
+		}
+	}
+
+	static uint64_t get_header(const char* header) {
+		uint64_t len = 0;
+		for(size_t i = 0; i < header_size; ++i) {
+			len = (len << 8) | (unsigned char) header[i];
+		}
+		return len;
+	}
+
+	bool send(const std::string& message) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		char header[header_size];
+		put_header(message.size(), header);
+		struct iovec iov[2];
+		iov[0].iov_base = header;
+		iov[0].iov_len = header_size;
+		iov[1].iov_base = (void*) message.data();
+		iov[1].iov_len = message.size();
+		struct iovec* next = iov;
+		int num_left = 2;
+		while( num_left > 0 ) {
+			ssize_t res = writev(fd, next, num_left);
+			if( res < 0 && errno == EINTR ) {
+				continue;
+			}
+			if( res < 0 ) {
+				std::cerr << "Unable to send message: " << strerror(errno) << std::endl;
+				return false;
+			}
+			size_t written = res;
+			while( num_left > 0 && written >= next->iov_len ) {
+				written -= next->iov_len;
+				++next;
+				--num_left;
+			}
+			if( num_left > 0 ) {
+				next->iov_base = (char*) next->iov_base + written;
+				next->iov_len -= written;
+			}
+		}
+		bytes_sent += header_size + message.size();
+		++messages_sent;
+		send_seconds += seconds_since(start);
+		return true;
+	}
+
+	// false also once the counterparty has closed the stream, which closed() then tells
+	bool receive(std::string& message) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		char header[header_size];
+		size_t got = 0;
+		if( !read_fully(header, header_size, got) ) {
+			if( got == 0 && at_end ) {
+				return false; //closed between messages
+			}
+			std::cerr << "Stream ended within a message header" << std::endl;
+			return false;
+		}
+		uint64_t len = get_header(header);
+		if( len > max_message_size ) {
+			std::cerr << "Message of " << len << " bytes is longer than allowed" << std::endl;
+			return false;
+		}
+		message.resize(len);
+		got = 0;
+		if( !read_fully(&message[0], len, got) ) {
+			std::cerr << "Stream ended within a message" << std::endl;
+			return false;
+		}
+		bytes_received += header_size + len;
+		++messages_received;
+		receive_seconds += seconds_since(start);
+		return true;
+	}
+
+	// whether the counterparty closed the stream
+	bool closed() const {
+		return at_end;
+	}
+
+	static double seconds_since(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+  private:
+	bool at_end;
+
+	bool read_fully(char* buf, size_t len, size_t& got) {
+		while( got < len ) {
+			ssize_t res = read(fd, buf + got, len - got);
+			if( res < 0 && errno == EINTR ) {
+				continue;
+			}
+			if( res < 0 ) {
+				std::cerr << "Unable to receive message: " << strerror(errno) << std::endl;
+				return false;
+			}
+			if( res == 0 ) {
+				at_end = true;
+				return false;
+			}
+			got += res;
+		}
+		return true;
+	}
+};
+
+// a connected pair of Unix stream sockets
+inline bool unix_socket_pair(int fds[2]) {
+	if( socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0 ) {
+		std::cerr << "Unable to create socket pair: " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// a TCP socket listening on the loopback interface at port, or at a free port if port is 0;
+// port is set to the one taken. Returns -1 on error
+inline int listen_loopback(uint16_t& port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if( fd < 0 ) {
+		std::cerr << "Unable to create socket: " << strerror(errno) << std::endl;
+		return -1;
+	}
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	socklen_t addr_len = sizeof(addr);
+	if( bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0
+        || getsockname(fd, (struct sockaddr*) &addr, &addr_len) != 0 ) {
+		std::cerr << "Unable to listen on port " << port << ": " << strerror(errno) << std::endl;
+		close(fd);
+		return -1;
+	}
+	port = ntohs(addr.sin_port);
+	return fd;
+}
+
+// the protocol waits on every reply, so small messages are sent right away
+inline void set_no_delay(int fd) {
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+inline int accept_connection(int listen_fd) {
+	int fd;
+	do {
+		fd = accept(listen_fd, NULL, NULL);
+	} while( fd < 0 && errno == EINTR );
+	if( fd < 0 ) {
+		std::cerr << "Unable to accept connection: " << strerror(errno) << std::endl;
+		return -1;
+	}
+	set_no_delay(fd);
+	return fd;
+}
+
+inline int connect_loopback(uint16_t port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if( fd < 0 ) {
+		std::cerr << "Unable to create socket: " << strerror(errno) << std::endl;
+		return -1;
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if( connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ) {
+		std::cerr << "Unable to connect to port " << port << ": " << strerror(errno) << std::endl;
+		close(fd);
+		return -1;
+	}
+	set_no_delay(fd);
+	return fd;
+}
+
+#endif
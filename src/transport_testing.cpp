@@ -0,0 +1,226 @@
+#include "sync_session.hpp"
+#include "transport.hpp"
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "IBLT_helpers.hpp"
+#include "json/json.h"
+
+namespace po = boost::program_options;
+typedef FileSynchronizer<uint64_t> fsync_type;
+Json::Value info;
+Json::StyledWriter writer;
+
+// messages of any length arrive whole and in order, even when the reader lags behind, and a
+// stream cut short is told apart from one closed between messages
+void testFraming() {
+	int fds[2];
+	bool paired = unix_socket_pair(fds);
+	assert( paired );
+	(void) paired;
+	keyGenerator<uint64_t> kg(11);
+	std::vector<std::string> messages;
+	size_t lens[] = {0, 1, 7, 8, 100000, (size_t) 5 << 20, 3};
+	for(size_t i = 0; i < sizeof(lens)/sizeof(lens[0]); ++i) {
+		std::string message(lens[i], '\0');
+		for(size_t j = 0; j < message.size(); j += 1 + j/3) {
+			message[j] = (char) kg.generate_key();
+		}
+		messages.push_back(message);
+	}
+	FrameTransport sender(fds[0]), receiver(fds[1]);
+	std::thread writer_thread([&]() {
+		for(auto it = messages.begin(); it != messages.end(); ++it) {
+			bool sent = sender.send(*it);
+			assert( sent );
+			(void) sent;
+		}
+		close(fds[0]);
+	});
+	std::string message;
+	for(auto it = messages.begin(); it != messages.end(); ++it) {
+		bool received = receiver.receive(message);
+		assert( received && message == *it );
+		(void) received;
+	}
+	writer_thread.join();
+	bool received = receiver.receive(message);
+	assert( !received && receiver.closed() );
+	(void) received;
+	assert( receiver.bytes_received == sender.bytes_sent && receiver.messages_received == messages.size() );
+	close(fds[1]);
+
+	//a length past the limit, and a message cut short
+	paired = unix_socket_pair(fds);
+	assert( paired );
+	FrameTransport broken_sender(fds[0]), broken_receiver(fds[1]);
+	broken_receiver.max_message_size = 1000;
+	bool sent = broken_sender.send(std::string(1001, 'a'));
+	assert( sent );
+	(void) sent;
+	received = broken_receiver.receive(message);
+	assert( !received && !broken_receiver.closed() );
+	close(fds[1]);
+	paired = unix_socket_pair(fds);
+	assert( paired );
+	char header[FrameTransport::header_size];
+	FrameTransport::put_header(10, header);
+	ssize_t header_written = write(fds[0], header, sizeof(header));
+	ssize_t body_written = write(fds[0], "abc", 3);
+	assert( header_written == sizeof(header) && body_written == 3 );
+	(void) header_written;
+	(void) body_written;
+	close(fds[0]);
+	FrameTransport cut_receiver(fds[1]);
+	received = cut_receiver.receive(message);
+	assert( !received );
+	close(fds[1]);
+	std::cout << "Framing of " << messages.size() << " messages passed" << std::endl;
+}
+
+// party B in a process of its own, serving file2 over fd
+int runServer(int fd, const std::string& file2, size_t avg_block_size, bool pipelined) {
+	fsync_type file_sync_B(file2, avg_block_size);
+	file_sync_B.pipelined = pipelined;
+	FrameTransport transport(fd);
+	SyncServerSession<uint64_t> session(file_sync_B, pipelined);
+	bool res = serve_client(session, transport);
+	close(fd);
+	return res ? 0 : 1;
+}
+
+// syncs file1 to file2 with party B in a child process, over a Unix socket pair or loopback TCP
+bool testTwoProcesses(const std::string& file1, const std::string& file2, const std::string& output_file,
+                      size_t avg_block_size, bool use_tcp, bool pipelined) {
+	int fds[2] = {-1, -1};
+	int listen_fd = -1;
+	uint16_t port = 0;
+	if( use_tcp ) {
+		listen_fd = listen_loopback(port);
+		assert( listen_fd >= 0 );
+	} else {
+		bool paired = unix_socket_pair(fds);
+		assert( paired );
+		(void) paired;
+	}
+	pid_t pid = fork();
+	assert( pid >= 0 );
+	if( pid == 0 ) {
+		int fd = fds[1];
+		if( use_tcp ) {
+			fd = accept_connection(listen_fd);
+			close(listen_fd);
+		} else {
+			close(fds[0]);
+		}
+		_exit(fd >= 0 ? runServer(fd, file2, avg_block_size, pipelined) : 1);
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int fd = fds[0];
+	if( use_tcp ) {
+		fd = connect_loopback(port);
+		close(listen_fd);
+	} else {
+		close(fds[1]);
+	}
+	assert( fd >= 0 );
+	fsync_type file_sync_A(file1, avg_block_size);
+	file_sync_A.pipelined = pipelined;
+	double setup_seconds = FrameTransport::seconds_since(start);
+	FrameTransport transport(fd);
+	SyncClient<uint64_t> client(file_sync_A, transport);
+	unlink(output_file.c_str());
+	bool res = client.run(output_file);
+	close(fd);
+	int status;
+	waitpid(pid, &status, 0);
+	res = res && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	res = res && read_contents(output_file) == read_contents(file2);
+
+	const SyncTimings& t = client.timings;
+	size_t file2_size = get_file_size(file2);
+	info["transport"] = Json::Value(use_tcp ? "tcp" : "unix");
+	info["pipelined"] = Json::Value(pipelined);
+	info["block_size"] = Json::Value((Json::UInt64) avg_block_size);
+	info["file2_size"] = Json::Value((Json::UInt64) file2_size);
+	info["synchronized"] = Json::Value(res);
+	info["setup_seconds"] = Json::Value(setup_seconds);
+	info["strata_seconds"] = Json::Value(t.strata);
+	info["iblt_seconds"] = Json::Value(t.iblt);
+	info["rd2_seconds"] = Json::Value(t.rd2);
+	info["repair_seconds"] = Json::Value(t.repair);
+	info["total_seconds"] = Json::Value(t.total);
+	info["send_seconds"] = Json::Value(transport.send_seconds);
+	info["receive_seconds"] = Json::Value(transport.receive_seconds);
+	info["iblt_retries"] = Json::Value((Json::UInt64) t.iblt_retries);
+	info["bytes_sent"] = Json::Value((Json::UInt64) transport.bytes_sent);
+	info["bytes_received"] = Json::Value((Json::UInt64) transport.bytes_received);
+	info["messages"] = Json::Value((Json::UInt64) (transport.messages_sent + transport.messages_received));
+	//bytes of the file brought up to date per second of protocol
+	info["throughput_mb_per_second"] = Json::Value(t.total > 0 ? file2_size / t.total / (1 << 20) : 0);
+	return res;
+}
+
+int main(int argc, char* argv[]) {
+	std::string f1, f2, output_file;
+	size_t file_len, avg_block_size;
+	int block_changes, block_changes_size;
+	bool use_tcp, pipelined, framing;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("f1", po::value<std::string>(&f1)->default_value("A/f1.txt"), "First file name")
+		("f2", po::value<std::string>(&f2)->default_value("B/f1.txt"), "Second file name")
+		("output", po::value<std::string>(&output_file)->default_value("tmp/transport_out.txt"), "Reconstructed file name")
+		("file-len", po::value<size_t>(&file_len)->default_value(1000000), "File length")
+		("num-changes", po::value<int>(&block_changes), "number of block changes")
+		("change-size", po::value<int>(&block_changes_size)->default_value(5), "size of block changes")
+		("block-size", po::value<size_t>(&avg_block_size)->default_value(700), "avg block size")
+		("tcp", po::value<bool>(&use_tcp)->default_value(false), "loopback TCP rather than a Unix socket pair")
+		("pipelined", po::value<bool>(&pipelined)->default_value(false), "overlap the rounds with their computation")
+		("framing", po::value<bool>(&framing)->default_value(true), "whether to test the framing first")
+	;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if(vm.count("help")) {
+		std::cout << desc << "\n";
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if( framing ) {
+		testFraming();
+	}
+	if( vm.count("num-changes") ) {
+		info["test_type"] = Json::Value("block");
+		info["file_length"] = Json::Value((Json::UInt64) file_len);
+		info["num_block_changes"] = Json::Value(block_changes);
+		generate_random_file(f1, file_len);
+		generate_block_changed_file(f1, f2, block_changes, block_changes_size);
+	} else {
+		info["test_type"] = Json::Value("actual");
+		info["file1"] = Json::Value(f1);
+		info["file2"] = Json::Value(f2);
+	}
+	bool res = testTwoProcesses(f1, f2, output_file, avg_block_size, use_tcp, pipelined);
+	std::cout << writer.write( info ) << std::endl;
+	if( !res ) {
+		std::cerr << "Synchronization over the transport failed" << std::endl;
+	}
+	assert( res );
+	return 1;
+}